@@ -58,11 +58,14 @@ main(const int argc, char **argv) {
         }
         
         long n = -1; 
-        while ((n = recv(sock_fd, buf, BASE_RESPONSE_DATA + MAX_BYTES_DATA, 0)) != 0) {
+        size_t received = 0;
+        // la respuesta puede llegar en varios segmentos
+        while ((n = recv(sock_fd, buf + received, BASE_RESPONSE_DATA + MAX_BYTES_DATA - received, 0)) != 0) {
             if (n < 0) {
                 perror("client socket recv");
                 abort();
             }
+            received += n;
         }
 
         // termine de recibir
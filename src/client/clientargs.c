@@ -138,6 +138,10 @@ usage(const char *progname) {
         "-b                  imprime la cantidad de bytes transferidos del server.\n"
         "-a                  imprime una lista con los usuarios del proxy.\n"
         "-A                  imprime una lista con los usuarios administradores.\n"
+        "-l                  imprime las mediciones del event loop del server.\n"
+        "-r                  imprime los contadores del cache de DNS del server.\n"
+        "-s                  imprime el historial de conexiones del server a cada dirección de origin server.\n"
+        "-m                  imprime los contadores del pool de sesiones del server.\n"
         "-n                  enciende el password disector en el server.\n"
         "-N                  apaga el password disector en el server.\n"
         "-u <user:pass>      agrega un usuario del proxy con el nombre y contraseña indicados.\n"
@@ -171,7 +175,7 @@ parse_args(const int argc, char **argv, struct client_request_args *args, char *
     *ip_version = ipv4;
 
     for(req_idx = 0 ; req_idx < MAX_CLIENT_REQUESTS ; req_idx++){
-        int c = getopt(argc, argv, ":hcCbaAnNu:U:d:D:hv");
+        int c = getopt(argc, argv, ":hcCbaAlrsmnNu:U:d:D:hv");
         if (c == -1){
             break;
         }
@@ -208,6 +212,26 @@ parse_args(const int argc, char **argv, struct client_request_args *args, char *
                 args[req_idx].target.get_target = admin_users_list;
                 // TODO: Show list of admin users
                 break;
+            case 'l':
+                // Get event loop stats
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = loop_stats;
+                break;
+            case 'r':
+                // Get DNS cache stats
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = dns_cache_stats;
+                break;
+            case 's':
+                // Get origin server address scoreboard
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = addr_scores;
+                break;
+            case 'm':
+                // Get session pool stats
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = session_pool;
+                break;
             case 'n':
                 // Turns on password disector
                 args[req_idx].method = config;
@@ -1,5 +1,173 @@
 #include "../include/clientresponse.h"
 
+#define HIST_BUCKETS    32
+#define HIST_FIELDS     (3 + HIST_BUCKETS)
+
+static uint64_t
+get_uint64(const uint8_t *p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+// imprime una duración en ns con la unidad más cómoda
+static void
+print_ns(double ns) {
+    if (ns < 1e3) {
+        printf("%.0fns", ns);
+    } else if (ns < 1e6) {
+        printf("%.1fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        printf("%.1fms", ns / 1e6);
+    } else {
+        printf("%.1fs", ns / 1e9);
+    }
+}
+
+// imprime un histograma de la respuesta de loop_stats (ver monitor.h del server)
+static void
+print_hist(const char *name, const uint8_t *p, bool is_time) {
+    const uint64_t count = get_uint64(p);
+    const uint64_t sum   = get_uint64(p + 8);
+    const uint64_t max   = get_uint64(p + 16);
+
+    printf("%s: %llu samples", name, (unsigned long long) count);
+    if (count == 0) {
+        putchar('\n');
+        return;
+    }
+    printf(", avg ");
+    if (is_time) {
+        print_ns((double) sum / count);
+        printf(", max ");
+        print_ns(max);
+    } else {
+        printf("%.1f, max %llu", (double) sum / count, (unsigned long long) max);
+    }
+    putchar('\n');
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        const uint64_t n = get_uint64(p + 8 * (3 + i));
+        if (n == 0) {
+            continue;
+        }
+        printf("    ");
+        if (i <= 1) {
+            printf("%d", i);
+        } else if (i == HIST_BUCKETS - 1) {
+            printf(">= ");
+            if (is_time) {
+                print_ns(1ULL << (i - 1));
+            } else {
+                printf("%llu", 1ULL << (i - 1));
+            }
+        } else if (is_time) {
+            printf("< ");
+            print_ns(1ULL << i);
+        } else {
+            printf("%llu-%llu", 1ULL << (i - 1), (1ULL << i) - 1);
+        }
+        printf(": %llu (%.1f%%)\n", (unsigned long long) n, 100.0 * n / count);
+    }
+}
+
+static void
+print_loop_stats(const uint8_t *data, uint16_t dlen) {
+    static const char *names[] = {
+        "wait", "dispatch", "events per wakeup", "handle_read", "handle_write", "handle_block",
+    };
+    const size_t n = sizeof(names) / sizeof(names[0]);
+
+    if (dlen < n * HIST_FIELDS * 8) {
+        printf("The event loop stats response is too short!\n");
+        return;
+    }
+    printf("Event loop stats (all threads):\n");
+    for (size_t i = 0; i < n; i++) {
+        print_hist(names[i], data + i * HIST_FIELDS * 8, i != 2);
+    }
+}
+
+static void
+print_dns_cache_stats(const uint8_t *data, uint16_t dlen) {
+    static const char *names[] = {
+        "hits", "negative hits", "misses", "evictions", "expirations", "entries",
+        "coalesced", "refreshes",
+    };
+    const size_t n = sizeof(names) / sizeof(names[0]);
+
+    if (dlen < n * 8) {
+        printf("The DNS cache stats response is too short!\n");
+        return;
+    }
+    const uint64_t hits   = get_uint64(data);
+    const uint64_t misses = get_uint64(data + 16);
+    printf("DNS cache stats:\n");
+    for (size_t i = 0; i < n; i++) {
+        printf("%s: %llu\n", names[i], (unsigned long long) get_uint64(data + i * 8));
+    }
+    if (hits + misses > 0) {
+        printf("hit rate: %.1f%%\n", 100.0 * hits / (hits + misses));
+    }
+}
+
+static void
+print_session_pool(const uint8_t *data, uint16_t dlen) {
+    static const char *names[] = { "in use", "free", "peak", "bytes" };
+    const size_t n = sizeof(names) / sizeof(names[0]);
+
+    if (dlen < n * 8) {
+        printf("The session pool stats response is too short!\n");
+        return;
+    }
+    printf("Session pool stats (all threads):\n");
+    for (size_t i = 0; i < n; i++) {
+        printf("%s: %llu\n", names[i], (unsigned long long) get_uint64(data + i * 8));
+    }
+}
+
+static uint32_t
+get_uint32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// imprime el historial de conexiones a los origin servers (ver monitor.h del server)
+static void
+print_addr_scores(const uint8_t *data, uint16_t dlen) {
+    const uint8_t *end = data + dlen;
+
+    if (dlen < 2) {
+        printf("The address scoreboard response is too short!\n");
+        return;
+    }
+    const unsigned count = (unsigned) data[0] << 8 | data[1];
+    data += 2;
+    printf("Origin server addresses: %u\n", count);
+    for (unsigned i = 0; i < count; i++) {
+        const bool v4 = data < end && data[0] == 0x01;
+        const size_t addr_len = v4 ? 4 : 16;
+        if (data + 1 + addr_len + 2 + 3 * 4 + 1 > end) {
+            printf("The address scoreboard response is too short!\n");
+            return;
+        }
+        char ip[INET6_ADDRSTRLEN];
+        inet_ntop(v4 ? AF_INET : AF_INET6, data + 1, ip, sizeof(ip));
+        data += 1 + addr_len;
+        const unsigned port = (unsigned) data[0] << 8 | data[1];
+        data += 2;
+        printf(v4 ? "%s:%u" : "[%s]:%u", ip, port);
+        printf(" successes: %u failures: %u", get_uint32(data), get_uint32(data + 4));
+        if (get_uint32(data) > 0) {
+            printf(" connect time: ");
+            print_ns(get_uint32(data + 8) * 1e3);
+        }
+        data += 3 * 4;
+        printf("%s\n", *data++ ? " DOWN" : "");
+    }
+}
+
 void handle_get_ok_status(struct client_request_args arg, uint8_t *buf, uint8_t *combinedlen, uint8_t *numeric_data_array, uint32_t *numeric_response) {
     combinedlen[0] = buf[1];
     combinedlen[1] = buf[2]; 
@@ -30,6 +198,18 @@ void handle_get_ok_status(struct client_request_args arg, uint8_t *buf, uint8_t
             }
             putchar('\n'); // el ultimo nombre de la lista no tiene \0
             break;
+        case loop_stats:
+            print_loop_stats(buf + 3, dlen);
+            break;
+        case dns_cache_stats:
+            print_dns_cache_stats(buf + 3, dlen);
+            break;
+        case addr_scores:
+            print_addr_scores(buf + 3, dlen);
+            break;
+        case session_pool:
+            print_session_pool(buf + 3, dlen);
+            break;
     default:
         break;
     }
@@ -2,6 +2,9 @@
 #define ARGS_H_kFlmYm1tW9p5npzDr2opQJ9jM8
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "selector.h"
+#include "resolver.h"
 
 #define DEFAULT_SOCKS_ADDR          "0.0.0.0"
 #define DEFAULT_SOCKS_ADDR_V6       "::0"
@@ -13,6 +16,50 @@
 
 #define DEFAULT_DISECTORS_ENABLED   true
 
+#define DEFAULT_RELAY_BUFFERS       256
+
+#define DEFAULT_THREADS             1
+#define MAX_THREADS                 64
+
+/** límites de tiempo por defecto, en segundos (0 es sin límite) */
+#define DEFAULT_HELLO_TIMEOUT       10
+#define DEFAULT_AUTH_TIMEOUT        10
+#define DEFAULT_REQUEST_TIMEOUT     10
+#define DEFAULT_CONNECT_TIMEOUT     30
+#define DEFAULT_IDLE_TIMEOUT        0
+#define DEFAULT_RELEASE_TIMEOUT     5
+
+/** ms entre intentos de conexión en paralelo, como sugiere el RFC 8305 */
+#define DEFAULT_CONNECT_DELAY       250
+
+/** bytes que puede copiar cada túnel por iteración del selector (0 es sin límite) */
+#define DEFAULT_COPY_BUDGET         16384
+
+/** resolución DNS (ver resolver.h) */
+#define DEFAULT_DNS_THREADS         4
+#define MAX_DNS_THREADS             64
+#define DEFAULT_DNS_QUEUE           1024
+/** general SOCKS server failure */
+#define DEFAULT_DNS_BUSY_REPLY      0x01
+
+/** cache de DNS (ver dnscache.h). TTLs en segundos */
+#define DEFAULT_DNS_CACHE_SIZE      1024
+#define DEFAULT_DNS_CACHE_TTL       60
+#define DEFAULT_DNS_NEGATIVE_TTL    5
+/** renovación de los nombres populares: porcentaje de la vida y usos */
+#define DEFAULT_DNS_PREFETCH        80
+#define DEFAULT_DNS_PREFETCH_HITS   4
+
+/** historial de conexiones a los origin servers (ver scoreboard.h). TTL en segundos */
+#define DEFAULT_ADDR_SCORES         1024
+#define DEFAULT_ADDR_DOWN_AFTER     3
+#define DEFAULT_ADDR_DOWN_TTL       30
+
+/** sesiones que cada hilo tiene a mano (ver socks5nio.h) */
+#define DEFAULT_SESSION_PREWARM     64
+#define DEFAULT_SESSION_HIGH        1024
+#define DEFAULT_SESSION_LOW         256
+
 #define MAX_USERS           10
 
 struct users {
@@ -31,6 +78,59 @@ struct socks5args {
 
     bool            disectors_enabled;
 
+    /** motor de multiplexación del selector */
+    enum selector_engine engine;
+    /** buffers del modo relay de io_uring por selector */
+    size_t          relay_buffers;
+    /** hilos que atienden conexiones SOCKS (incluye al principal) */
+    size_t          threads;
+    /** el hilo principal acepta y reparte las conexiones entre los hilos */
+    bool            acceptor;
+
+    /** límites de tiempo de cada etapa de las sesiones, en segundos */
+    unsigned        hello_timeout;
+    unsigned        auth_timeout;
+    unsigned        request_timeout;
+    unsigned        connect_timeout;
+    unsigned        idle_timeout;
+    /** de inactividad tras el cual un túnel devuelve sus buffers vacíos */
+    unsigned        release_timeout;
+    /** ms entre intentos de conexión en paralelo (0 los hace de a uno) */
+    unsigned        connect_delay;
+
+    /** bytes por iteración del selector de cada túnel */
+    size_t          copy_budget;
+    /** copiar los túneles con splice(2) */
+    bool            splice;
+
+    /** quién resuelve los nombres */
+    enum resolver_engine dns_engine;
+    /** hilos y largo de la cola del pool de DNS */
+    size_t          dns_threads;
+    size_t          dns_queue;
+    /** respuesta SOCKS cuando la cola de DNS está llena */
+    uint8_t         dns_busy_reply;
+
+    /** entradas del cache de DNS (0 lo deshabilita) y sus TTLs en segundos */
+    size_t          dns_cache_size;
+    unsigned        dns_cache_ttl;
+    unsigned        dns_negative_ttl;
+    /** porcentaje de su vida desde el que se renueva una entrada (0 nunca) y usos necesarios */
+    unsigned        dns_prefetch;
+    unsigned        dns_prefetch_hits;
+
+    /** direcciones en el historial de conexiones (0 lo deshabilita), fallas
+     *  para darlas por caídas y por cuántos segundos */
+    size_t          addr_scores;
+    unsigned        addr_down_after;
+    unsigned        addr_down_ttl;
+
+    /** sesiones que reserva cada hilo, y libres desde y hasta las que devuelve memoria */
+    size_t          session_prewarm;
+    size_t          session_high;
+    size_t          session_low;
+    bool            session_huge_pages;
+
     struct users    users[MAX_USERS];
 };
 
@@ -28,7 +28,11 @@ enum get_target {
     concurrent_connections  = 1,
     transferred_bytes       = 2,
     proxy_users_list        = 3,
-    admin_users_list        = 4
+    admin_users_list        = 4,
+    loop_stats              = 5,
+    dns_cache_stats         = 6,
+    addr_scores             = 7,
+    session_pool            = 8
 };
 
 enum config_target {
@@ -0,0 +1,109 @@
+#ifndef DNSCACHE_H_r5TqWm8ZkN2vXc7LpB4yHs9dJ
+#define DNSCACHE_H_r5TqWm8ZkN2vXc7LpB4yHs9dJ
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+/**
+ * dnscache.c - cache de resoluciones de nombres, compartido por todos los hilos
+ *
+ * Guarda el resultado de getaddrinfo por (nombre, puerto, familia) durante un
+ * TTL fijo (getaddrinfo no informa el del registro DNS), o el del registro
+ * si es menor y quien resolvió lo conoce (ver dnsstub.h). También guarda las
+ * respuestas negativas (el nombre no existe), con su propio TTL, para que un
+ * nombre inválido pedido en ráfaga no ocupe a los hilos del resolver.
+ *
+ * La cantidad de entradas está acotada: al llenarse se descarta la menos
+ * usada recientemente.
+ *
+ * Una entrada exitosa que se usó varias veces y ya consumió buena parte de
+ * su vida se marca para renovar: `dnscache_get' se lo indica a un único
+ * llamador, que la vuelve a resolver en segundo plano (ver resolver.h)
+ * mientras se sigue usando la vieja. Así un nombre popular no llega a vencer.
+ *
+ * Las listas que entrega son copias propias del llamador, en un formato que
+ * no es el de getaddrinfo: se liberan con `dnscache_free' (nunca con
+ * freeaddrinfo).
+ */
+
+/** opciones del cache */
+struct dnscache_init {
+    /** máximas entradas. 0 deshabilita el cache */
+    size_t   entries;
+    /** vida de una resolución exitosa, en ms */
+    unsigned ttl;
+    /** vida de una respuesta negativa, en ms. 0 no las guarda */
+    unsigned negative_ttl;
+    /** porcentaje de la vida de una entrada a partir del cual se renueva. 0 nunca */
+    unsigned refresh_percent;
+    /** usos que necesita una entrada para que se renueve */
+    unsigned refresh_hits;
+};
+
+/** contadores desde el inicio */
+struct dnscache_stats {
+    /** búsquedas con entrada vigente (incluye las negativas) */
+    uint64_t hits;
+    /** de las anteriores, cuántas eran negativas */
+    uint64_t negative_hits;
+    /** búsquedas sin entrada, o con una vencida */
+    uint64_t misses;
+    /** entradas descartadas por falta de lugar */
+    uint64_t evictions;
+    /** entradas descartadas por vencidas */
+    uint64_t expirations;
+    /** entradas actuales */
+    uint64_t entries;
+    /** entradas marcadas para renovar */
+    uint64_t refreshes;
+};
+
+/**
+ * configura el cache. Se debe llamar antes de que haya hilos usándolo.
+ *
+ * @return 0 si pudo reservar la tabla.
+ */
+int
+dnscache_init(const struct dnscache_init *c);
+
+/**
+ * busca `host':`port' (en orden de host) para la familia `family'.
+ *
+ * @return true si hay una entrada vigente; en ese caso deja en `*result'
+ *         una copia de la lista, o NULL si la entrada es negativa, y en
+ *         `*refresh' si al llamador le toca renovarla.
+ *         false si no hay entrada (o no hay memoria para copiarla).
+ */
+bool
+dnscache_get(const char *host, uint16_t port, int family,
+             struct addrinfo **result, bool *refresh);
+
+/**
+ * guarda (o reemplaza) la resolución de `host':`port'. `list' es NULL
+ * para una respuesta negativa; si no, se copia (puede ser la de
+ * getaddrinfo). `ttl' es el de los registros en ms, 0 si no se conoce; la
+ * entrada vive lo que sea menor entre él y el configurado.
+ */
+void
+dnscache_put(const char *host, uint16_t port, int family,
+             const struct addrinfo *list, unsigned ttl);
+
+/** copia `list' en el formato del cache. NULL si `list' lo es o sin memoria */
+struct addrinfo *
+dnscache_copy(const struct addrinfo *list);
+
+/** libera una lista entregada por este módulo. Tolera NULL */
+void
+dnscache_free(struct addrinfo *list);
+
+/** completa `stats' con los contadores actuales */
+void
+dnscache_stats(struct dnscache_stats *stats);
+
+/** libera todas las entradas. Nadie más debe estar usando el cache */
+void
+dnscache_destroy(void);
+
+#endif
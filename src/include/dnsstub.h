@@ -0,0 +1,65 @@
+#ifndef DNSSTUB_H_w3KbN8pXq5TzLm2RcV7hJy4sF
+#define DNSSTUB_H_w3KbN8pXq5TzLm2RcV7hJy4sF
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+#include "selector.h"
+
+/**
+ * dnsstub.c - cliente DNS no bloqueante que corre en el selector
+ *
+ * En lugar de bloquear un hilo en getaddrinfo, envía las consultas A y AAAA
+ * por UDP a los nameservers de /etc/resolv.conf desde un socket registrado
+ * en el mismo selector que atiende la conexión, y procesa las respuestas en
+ * sus handlers. Cada hilo con selector tiene su propia instancia, que se
+ * crea con la primera consulta y se libera junto con el selector.
+ *
+ * Como la libc: cada consulta se envía a los servidores en orden, hasta
+ * `attempts' vueltas, esperando `timeout' a cada uno (ver `options' en
+ * resolv.conf(5)); SERVFAIL y REFUSED pasan al siguiente; una respuesta
+ * truncada se repite por TCP al mismo servidor.
+ *
+ * Los nombres de /etc/hosts y las direcciones literales se resuelven sin
+ * consultar a nadie. No se aplican `search' ni `domain': los clientes SOCKS
+ * piden nombres completos.
+ */
+
+/**
+ * lee la configuración de `resolv_conf' y `hosts' (las rutas del sistema si
+ * son NULL). Si no hay nameservers usa 127.0.0.1, como la libc.
+ *
+ * @param max_lookups resoluciones en curso por selector
+ * @return 0 si pudo leer la configuración (un archivo faltante no es error)
+ */
+int
+dnsstub_init(const char *resolv_conf, const char *hosts, size_t max_lookups);
+
+/**
+ * recibe el resultado de una resolución: la lista de direcciones, primero las
+ * IPv4, o NULL si falló. La lista es temporal: hay que copiarla (por ejemplo
+ * con dnscache_copy) para usarla después de retornar.
+ */
+typedef void (*dnsstub_callback)(void *data, const struct addrinfo *list);
+
+/**
+ * resuelve `host' (terminado en 0) para el puerto `port' (en orden de host).
+ * Se debe llamar desde el hilo de `s'. Al terminar guarda el resultado en el
+ * cache (ver dnscache.h) y llama a `done' con `data' en el hilo de `s'; con
+ * /etc/hosts o una dirección literal, antes de retornar. Si `s' se destruye
+ * antes, `done' recibe NULL mientras se destruye.
+ *
+ * @return false si hay demasiadas resoluciones en curso o no se pudo
+ *         iniciar: `done' no se va a llamar.
+ */
+bool
+dnsstub_resolve(fd_selector s, const char *host, uint16_t port,
+                dnsstub_callback done, void *data);
+
+/** libera la configuración. Los selectores ya deben estar destruidos */
+void
+dnsstub_destroy(void);
+
+#endif
@@ -35,6 +35,10 @@ GET
     X'02'  cantidad de bytes transferidos
     X'03'  listado de usuarios del proxy
     X'04'  listado de administradores
+    X'05'  mediciones del event loop (ver abajo)
+    X'06'  contadores del cache de DNS (ver abajo)
+    X'07'  historial de conexiones a los origin servers (ver abajo)
+    X'08'  contadores del pool de sesiones (ver abajo)
 CONFIG
     X'00'  ON/OFF password disector POP3
     X'01'  agregar usuario del proxy
@@ -59,6 +63,47 @@ DATA:
             <usuario>X'00'<token>
         Borrar usuario admin
             <usuario>
+
+RESPUESTA de GET X'05' (mediciones del event loop, sumando todos los hilos):
+    6 histogramas, en este orden:
+        espera (ns)   | despacho (ns) | eventos por espera |
+        handle_read (ns) | handle_write (ns) | handle_block (ns)
+    cada uno:
+        COUNT | SUM | MAX | BUCKETS
+          8      8     8    32 * 8
+    todos enteros sin signo en network order. BUCKETS[0] cuenta los ceros y
+    BUCKETS[i] los valores en [2^(i-1), 2^i); el último incluye los mayores.
+    "despacho" es el resto de la iteración: handlers, tareas y temporizadores.
+
+RESPUESTA de GET X'06' (cache de DNS, desde que arrancó el servidor):
+    HITS | NEGATIVE HITS | MISSES | EVICTIONS | EXPIRATIONS | ENTRIES | COALESCED | REFRESHES
+      8          8           8         8            8           8          8           8
+    enteros sin signo en network order. NEGATIVE HITS está incluido en HITS;
+    EVICTIONS cuenta las entradas descartadas por falta de lugar y
+    EXPIRATIONS las descartadas por vencidas. ENTRIES es el valor actual.
+    COALESCED cuenta los MISSES que esperaron una resolución en curso del
+    mismo nombre en lugar de lanzar otra. REFRESHES cuenta las entradas que se
+    volvieron a resolver antes de vencer por ser populares.
+
+RESPUESTA de GET X'07' (historial de conexiones a los origin servers, la
+dirección usada más recientemente primero):
+    COUNT | DIRECCIÓN 1 | ... | DIRECCIÓN COUNT
+      2
+    cada dirección:
+    ATYP | ADDR   | PORT | SUCCESSES | FAILURES | SRTT | DOWN
+      1    4 o 16    2        4           4         4      1
+    enteros sin signo en network order. ATYP es X'01' (IPv4) o X'04' (IPv6),
+    como en SOCKS. SRTT es el tiempo suavizado que tardan en establecerse las
+    conexiones, en microsegundos. DOWN es X'01' si la dirección se da por caída
+    (no se la intenta). Si no entran todas, se omiten las
+    usadas hace más tiempo.
+
+RESPUESTA de GET X'08' (pool de sesiones, sumando todos los hilos):
+    IN USE | FREE | PEAK | BYTES
+       8      8      8      8
+    enteros sin signo en network order. IN USE son las sesiones abiertas,
+    FREE las reservadas sin usar y PEAK el máximo de IN USE desde que arrancó
+    el servidor. BYTES es la memoria pedida al sistema para todas ellas.
 */
 
 enum monitor_state {            
@@ -104,6 +149,10 @@ enum monitor_target_get {
     monitor_target_get_transfered = 0x02,
     monitor_target_get_proxyusers = 0x03,
     monitor_target_get_adminusers = 0x04,
+    monitor_target_get_loop_stats = 0x05,
+    monitor_target_get_dns_cache  = 0x06,
+    monitor_target_get_addr_scores = 0x07,
+    monitor_target_get_session_pool = 0x08,
 };
 
 enum monitor_target_config {
@@ -0,0 +1,111 @@
+#ifndef RESOLVER_H_c7VwK2nQxR9tLh4ZpJ3mYs8bD
+#define RESOLVER_H_c7VwK2nQxR9tLh4ZpJ3mYs8bD
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+#include "selector.h"
+
+/**
+ * resolver.c - pool de hilos que resuelven nombres con getaddrinfo
+ *
+ * getaddrinfo bloquea, así que no se puede llamar desde un selector. Un
+ * número fijo de hilos toma los pedidos de una cola acotada; al terminar
+ * cada uno guarda el resultado en el cache (ver dnscache.h), deja una copia
+ * en la sesión y le avisa al selector que la atiende con
+ * `selector_notify_block', que ejecuta el handle_block del fd en el hilo del
+ * selector.
+ *
+ * Un pedido de un nombre (y puerto) que ya se está resolviendo no ocupa la
+ * cola: espera esa misma resolución, aunque la haya pedido otro hilo. Así,
+ * cuando vence la entrada del cache de un nombre popular, los pedidos que
+ * llegan juntos no generan una consulta cada uno.
+ *
+ * Antes de encolar conviene consultar el cache con `dnscache_get': un
+ * acierto no necesita pasar por acá.
+ *
+ * Si la cola está llena `resolver_submit' falla en el acto: ante una
+ * ráfaga de pedidos es preferible rechazar algunos que acumular esperas
+ * que igual van a vencer del lado del cliente.
+ *
+ * Con RESOLVER_NATIVE no hay hilos: `resolver_submit' le pasa el pedido al
+ * cliente DNS del selector (ver dnsstub.h), que se debe haber configurado
+ * con `dnsstub_init'.
+ */
+
+/** quién resuelve los nombres */
+enum resolver_engine {
+    /** cliente DNS no bloqueante en cada selector */
+    RESOLVER_NATIVE,
+    /** getaddrinfo en el pool de hilos */
+    RESOLVER_GETADDRINFO,
+};
+
+/** opciones de inicialización del pool */
+struct resolver_init {
+    enum resolver_engine engine;
+    /** hilos que resuelven (sólo RESOLVER_GETADDRINFO). Al menos 1 */
+    size_t threads;
+    /**
+     * pedidos que pueden esperar un hilo libre; con RESOLVER_NATIVE,
+     * resoluciones en curso por selector. Al menos 1
+     */
+    size_t queue;
+};
+
+/**
+ * lanza los hilos del pool. Se debe llamar antes de atender conexiones.
+ *
+ * @return 0 si todos los hilos se iniciaron.
+ */
+int
+resolver_start(const struct resolver_init *c);
+
+/**
+ * pide resolver `host' (terminado en 0) para el puerto `port' (en orden de
+ * host). Al terminar deja en `*result' una copia de la lista resuelta (NULL
+ * si falló; la libera el llamador con dnscache_free) y llama a
+ * selector_notify_block(s, fd). Si se sumó a una resolución en curso que al
+ * final no se pudo iniciar, deja `*busy' en true: el mismo caso que el
+ * retorno false. `*result' y `*busy' no se deben tocar hasta entonces.
+ * Con RESOLVER_NATIVE se debe llamar desde el hilo de `s'.
+ *
+ * @return false si la cola está llena o el pool no está iniciado: no habrá
+ *         notificación.
+ */
+bool
+resolver_submit(fd_selector s, int fd, const char *host, uint16_t port,
+                struct addrinfo **result, bool *busy);
+
+/**
+ * vuelve a resolver `host':`port' sólo para renovar su entrada del cache
+ * (ver dnscache_get), sin notificar a nadie. Los pedidos que llegan mientras
+ * tanto esperan esta resolución. Con RESOLVER_NATIVE se debe llamar desde el
+ * hilo de `s'.
+ */
+void
+resolver_refresh(fd_selector s, const char *host, uint16_t port);
+
+/**
+ * olvida los pedidos hechos desde `s': sus resoluciones siguen, pero ya no
+ * los notifican. Se debe llamar antes de destruir `s', ya que otro hilo
+ * puede estar resolviendo un nombre que espera una de sus sesiones.
+ */
+void
+resolver_detach(fd_selector s);
+
+/** pedidos que esperaron una resolución en curso en lugar de lanzar otra */
+uint64_t
+resolver_coalesced(void);
+
+/**
+ * detiene el pool y espera a que terminen los hilos (y la resolución que
+ * estén haciendo). Los pedidos encolados se descartan sin notificar. Se
+ * debe llamar antes de destruir los selectores. Tolera no haberlo iniciado.
+ */
+void
+resolver_stop(void);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef SCOREBOARD_H_m4HxT9qWv2NcJ7bRz5KpL8dYs
+#define SCOREBOARD_H_m4HxT9qWv2NcJ7bRz5KpL8dYs
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+/**
+ * scoreboard.c - historial de las conexiones a cada origin server,
+ * compartido por todos los hilos
+ *
+ * Por cada dirección (IP y puerto) recuerda cuántas conexiones se
+ * establecieron y cuántas fallaron, y el tiempo que tardan en establecerse.
+ * Con eso `scoreboard_sort' ordena las direcciones de una resolución antes de
+ * intentarlas: primero las que anduvieron (las más rápidas antes), después
+ * las desconocidas y al final las que vienen fallando.
+ *
+ * Una dirección cuyas últimas `down_after' conexiones no tuvieron respuesta
+ * (venció el tiempo, o la red o el host son inalcanzables) se da por caída
+ * durante `down_ttl': no vale la pena esperar otro timeout, así que no se la
+ * intenta. Un rechazo (RST) es rápido y no cuenta para esto.
+ *
+ * La cantidad de direcciones está acotada: al llenarse se olvida la menos
+ * usada recientemente.
+ */
+
+/** opciones del historial */
+struct scoreboard_init {
+    /** máximas direcciones. 0 lo deshabilita */
+    size_t   entries;
+    /** fallas seguidas sin respuesta para dar una dirección por caída */
+    unsigned down_after;
+    /** ms que se da una dirección por caída */
+    unsigned down_ttl;
+};
+
+/**
+ * configura el historial. Se debe llamar antes de que haya hilos usándolo.
+ *
+ * @return 0 si pudo reservar la tabla.
+ */
+int
+scoreboard_init(const struct scoreboard_init *c);
+
+/** se estableció una conexión a `addr' en `rtt_us' microsegundos */
+void
+scoreboard_success(const struct sockaddr *addr, unsigned rtt_us);
+
+/**
+ * falló una conexión a `addr'. `unresponsive' si no hubo respuesta
+ * (timeout, red o host inalcanzable) en lugar de un rechazo.
+ */
+void
+scoreboard_failure(const struct sockaddr *addr, bool unresponsive);
+
+/** `addr' se da por caída */
+bool
+scoreboard_is_down(const struct sockaddr *addr);
+
+/**
+ * reordena `*list' según el historial (ver arriba), sin cambiar el orden
+ * del resolver entre las que tienen el mismo puesto.
+ *
+ * @return cuántas direcciones del principio no se dan por caídas
+ */
+size_t
+scoreboard_sort(struct addrinfo **list);
+
+/**
+ * escribe en `buf' las direcciones, la más usada recientemente primero, en
+ * el formato de la respuesta del monitor (ver monitor.h), hasta llenar
+ * `size' bytes.
+ *
+ * @return bytes escritos
+ */
+size_t
+scoreboard_dump(uint8_t *buf, size_t size);
+
+/** libera todas las entradas. Nadie más debe estar usando el historial */
+void
+scoreboard_destroy(void);
+
+#endif
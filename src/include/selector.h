@@ -2,9 +2,13 @@
 #define SELECTOR_H_W50GNLODsARolpHbsDsrvYvMsbT
 
 #include <sys/time.h>
+#include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "buffer.h"
+
 /**
  * selector.c - un muliplexor de entrada salida
  *
@@ -28,8 +32,12 @@
  * la iteración normal. Los handlers no se tienen que preocupar por la
  * concurrencia.
  *
- * Dicha señalización se realiza mediante señales, y es por eso que al
- * iniciar la librería `selector_init' se debe configurar una señal a utilizar.
+ * Dicha señalización se realiza mediante un eventfd(2) que cada selector
+ * tiene registrado. Sobre el mismo mecanismo, `selector_post' permite que
+ * cualquier hilo encole una tarea para ejecutar en el hilo del selector.
+ *
+ * Cada selector tiene además temporizadores (`selector_timer_add') que se
+ * ejecutan en su hilo, al final de la iteración en la que vencen.
  *
  * Todos métodos retornan su estado (éxito / error) de forma uniforme.
  * Puede utilizar `selector_error' para obtener una representación human
@@ -65,13 +73,41 @@ typedef enum {
 const char *
 selector_error(const selector_status status);
 
+/**
+ * Motores de multiplexación disponibles.
+ *
+ * select(2) está limitado a FD_SETSIZE descriptores y en cada iteración
+ * recorre todos los fds hasta el máximo; epoll(7) no tiene ese límite y el
+ * costo de cada iteración depende sólo de la cantidad de fds listos.
+ * io_uring(7) envía todas las operaciones de una iteración en una sola
+ * llamada al sistema y permite el modo relay (ver `selector_set_relay').
+ *
+ * Si el motor pedido no está disponible se utiliza el default.
+ */
+enum selector_engine {
+    /** el mejor motor disponible en la plataforma */
+    SELECTOR_ENGINE_DEFAULT = 0,
+    SELECTOR_ENGINE_EPOLL   = 1,
+    SELECTOR_ENGINE_SELECT  = 2,
+    SELECTOR_ENGINE_URING   = 3,
+};
+
+/** tamaño de cada buffer del modo relay */
+#define SELECTOR_RELAY_BUFFER_SIZE (16 * 1024)
+
 /** opciones de inicialización del selector */
 struct selector_init {
-    /** señal a utilizar para notificaciones internas */
-    const int signal;
-
     /** tiempo máximo de bloqueo durante `selector_iteratate' */
     struct timespec select_timeout;
+
+    /** motor a utilizar por los selectores que se creen */
+    enum selector_engine engine;
+
+    /**
+     * cantidad de buffers que cada selector registra en el kernel para el
+     * modo relay (sólo io_uring). 0 lo deshabilita.
+     */
+    size_t relay_buffers;
 };
 
 /** inicializa la librería */
@@ -90,6 +126,10 @@ selector_new(const size_t initial_elements);
 void
 selector_destroy(fd_selector s);
 
+/** nombre del motor que utiliza el selector (ej: "epoll") */
+const char *
+selector_engine_name(fd_selector s);
+
 /**
  * Intereses sobre un file descriptor (quiero leer, quiero escribir, …)
  *
@@ -119,6 +159,14 @@ struct selector_key {
     int         fd;
     /** dato provisto por el usuario */
     void *      data; // se espera que sea un struct socks5 * al parecer, ver ATTACHMENT
+
+    /**
+     * sólo en modo relay: dónde se realizó la lectura/escritura y su
+     * resultado (cantidad de bytes, o -errno). NULL si el evento es de
+     * disponibilidad.
+     */
+    uint8_t *   io_ptr;
+    ssize_t     io_result;
 };
 
 /**
@@ -162,7 +210,13 @@ selector_status
 selector_unregister_fd(fd_selector   s,
                        const int     fd);
 
-/** permite cambiar los intereses para un file descriptor */
+/**
+ * permite cambiar los intereses para un file descriptor.
+ *
+ * El cambio se ve enseguida en los eventos que se despachan, pero recién se
+ * le informa al kernel antes de la próxima espera, junto con el resto de los
+ * cambios de la iteración; por eso sólo retorna errores de argumentos.
+ */
 selector_status
 selector_set_interest(fd_selector s, int fd, fd_interest i);
 
@@ -170,6 +224,41 @@ selector_set_interest(fd_selector s, int fd, fd_interest i);
 selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i);
 
+/**
+ * Modo relay: en lugar de avisar que `fd' está listo, el selector lee en el
+ * espacio libre de `rb' mientras haya interés de lectura, y escribe el
+ * contenido de `wb' mientras haya interés de escritura. Los handlers
+ * reciben el resultado en `key->io_ptr' y `key->io_result' y son quienes
+ * avanzan los buffers.
+ *
+ * Los buffers deben usar como datos a los obtenidos mediante
+ * `selector_relay_buffer_get'. Retorna SELECTOR_IARGS si el motor no lo
+ * soporta; ante cualquier error el fd sigue funcionando normalmente.
+ *
+ * Con `rb' y `wb' en NULL el fd vuelve al modo normal. Las operaciones en
+ * curso se cancelan: lo que lean o escriban ya no llega a los handlers.
+ */
+selector_status
+selector_set_relay(fd_selector s, int fd, buffer *rb, buffer *wb);
+
+/** el selector soporta el modo relay? */
+bool
+selector_relay_supported(fd_selector s);
+
+/**
+ * obtiene un buffer de SELECTOR_RELAY_BUFFER_SIZE bytes para el modo relay.
+ * NULL si no hay disponibles.
+ */
+uint8_t *
+selector_relay_buffer_get(fd_selector s);
+
+/**
+ * devuelve un buffer obtenido con `selector_relay_buffer_get'. Si el kernel
+ * todavía lo está usando se libera cuando termine.
+ */
+void
+selector_relay_buffer_put(fd_selector s, uint8_t *buf);
+
 
 /**
  * se bloquea hasta que hay eventos disponible y los despacha.
@@ -178,6 +267,13 @@ selector_set_interest_key(struct selector_key *key, fd_interest i);
 selector_status
 selector_select(fd_selector s);
 
+/**
+ * número de la iteración actual de `s' (ver `selector_select'). Permite a
+ * los handlers llevar cuentas por iteración.
+ */
+uint64_t
+selector_iteration(fd_selector s);
+
 /**
  * Método de utilidad que activa O_NONBLOCK en un fd.
  *
@@ -186,9 +282,130 @@ selector_select(fd_selector s);
 int
 selector_fd_set_nio(const int fd);
 
-/** notifica que un trabajo bloqueante terminó */
+/** tarea a ejecutar en el hilo de un selector (ver `selector_post') */
+typedef void (*selector_task)(fd_selector s, void *data);
+
+/**
+ * encola `task' para que se ejecute en el hilo del selector `s' durante su
+ * próxima iteración, recibiendo `data'. Se puede llamar desde cualquier
+ * hilo; las tareas se ejecutan en el orden en que se encolaron.
+ *
+ * No toma locks: las tareas salen de un pool preasignado por selector (si
+ * se agota se piden con malloc) y se encolan en una cola sin locks de
+ * varios productores y un consumidor.
+ */
+selector_status
+selector_post(fd_selector s, selector_task task, void *data);
+
+/**
+ * notifica que un trabajo bloqueante terminó: el handle_block de `fd' se
+ * ejecutará en el hilo del selector (si sigue registrado).
+ */
 selector_status
 selector_notify_block(fd_selector s,
                  const int   fd);
 
+/**
+ * temporizador de un selector. Lo aloca el usuario (típicamente dentro del
+ * estado de una conexión) y debe estar inicializado en cero. Sus campos son
+ * privados del selector.
+ */
+struct selector_timer {
+    struct selector_timer  *next, **pprev;
+    uint64_t                expires;
+    selector_task           task;
+    void                   *data;
+};
+
+/**
+ * programa `t' para que dentro de `ms' milisegundos se ejecute `task' con
+ * `data' en el hilo del selector. Si ya estaba programado, lo reprograma.
+ *
+ * Agregar, reprogramar y cancelar cuesta O(1), sin importar cuántos
+ * temporizadores haya. La resolución es de unos 10ms y nunca se ejecuta
+ * antes de tiempo. Sólo se puede llamar desde el hilo del selector.
+ */
+void
+selector_timer_add(fd_selector s, struct selector_timer *t, unsigned ms,
+                   selector_task task, void *data);
+
+/** cancela `t'. Tolera que no esté programado. */
+void
+selector_timer_cancel(fd_selector s, struct selector_timer *t);
+
+/** contadores de las tareas encoladas con `selector_post' */
+struct selector_jobs_stats {
+    /** tareas encoladas */
+    uint64_t posted;
+    /** tareas ejecutadas */
+    uint64_t completed;
+    /** tareas que no entraron en el pool y se pidieron con malloc */
+    uint64_t pool_misses;
+    /** tareas encoladas que todavía no se ejecutaron */
+    uint64_t depth;
+    /** máximo de `depth' observado */
+    uint64_t max_depth;
+    /**
+     * suma y máximo del tiempo entre que se encola y se ejecuta (ns), sobre
+     * `latency_samples' tareas elegidas al azar.
+     */
+    uint64_t latency_samples;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+};
+
+/**
+ * obtiene los contadores de tareas de `s'. Se puede llamar desde cualquier
+ * hilo; cada contador es consistente por separado, no entre sí.
+ */
+void
+selector_jobs_stats(fd_selector s, struct selector_jobs_stats *stats);
+
+/** cantidad de intervalos de cada histograma (ver selector_loop_stats) */
+#define SELECTOR_HIST_BUCKETS 32
+
+/**
+ * histograma con intervalos en potencias de 2: el intervalo 0 cuenta los
+ * ceros, y el i > 0 los valores en [2^(i-1), 2^i). El último cuenta además
+ * todos los mayores.
+ */
+struct selector_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[SELECTOR_HIST_BUCKETS];
+};
+
+/**
+ * mediciones del event loop. Permiten distinguir si una conexión espera
+ * porque el hilo está ocupado en otras (dispatch_ns alto, muchos eventos
+ * por vuelta) o porque algún handler es caro (read_ns, write_ns, block_ns).
+ */
+struct selector_loop_stats {
+    /** tiempo bloqueado esperando eventos en cada iteración (ns) */
+    struct selector_hist wait_ns;
+    /**
+     * tiempo del resto de cada iteración: despachar eventos, tareas y
+     * temporizadores, e informar los cambios de intereses (ns)
+     */
+    struct selector_hist dispatch_ns;
+    /** eventos que retornó cada espera */
+    struct selector_hist events;
+    /**
+     * duración de handle_read, handle_write y handle_block (ns), sobre una
+     * muestra de uno de cada 8 handlers.
+     */
+    struct selector_hist read_ns, write_ns, block_ns;
+};
+
+/**
+ * suma a `stats' las mediciones del event loop de `s' (así se pueden juntar
+ * las de varios selectores). Se puede llamar desde cualquier hilo.
+ *
+ * Siempre están activas: cuestan tres lecturas del reloj por iteración y dos
+ * por cada handler medido.
+ */
+void
+selector_loop_stats(fd_selector s, struct selector_loop_stats *stats);
+
 #endif
@@ -0,0 +1,88 @@
+#ifndef SLAB_H_t6QwZ3nVb8KxR2mLp5HsJ9cYd
+#define SLAB_H_t6QwZ3nVb8KxR2mLp5HsJ9cYd
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * slab.c - objetos de un mismo tamaño tomados de bloques grandes
+ *
+ * Los objetos se le piden al sistema de a bloques de `block_size' bytes
+ * (con mmap(2), alineados a su tamaño; los objetos de tamaño múltiplo de
+ * página quedan alineados a página). Cada bloque lleva la cuenta de sus
+ * objetos libres, y se entrega primero de los bloques que ya están en uso:
+ * así los que se vacían se le pueden devolver al sistema enteros (ver
+ * `struct slab_options'). Dentro de un bloque se entrega primero el último
+ * devuelto, que es el que más probablemente siga en cache. No pasan por
+ * malloc: una ráfaga de conexiones no fragmenta el heap.
+ *
+ * No es thread-safe: cada hilo usa sus propios slabs.
+ */
+struct slab;
+
+/** contadores de uno o más slabs (por ejemplo uno por hilo) */
+struct slab_stats {
+    /** objetos en los bloques pedidos al sistema */
+    atomic_size_t objects;
+    /** objetos entregados y no devueltos */
+    atomic_size_t in_use;
+    /** máximo que alcanzó `in_use' */
+    atomic_size_t peak;
+    /** bytes de los bloques pedidos al sistema */
+    atomic_size_t bytes;
+};
+
+struct slab_options {
+    /**
+     * objetos libres a partir de los cuales se le devuelven al sistema los
+     * bloques vacíos, mientras queden al menos `low' libres. 0 nunca.
+     */
+    size_t              high;
+    size_t              low;
+    /**
+     * respaldar los bloques con huge pages: de hugetlbfs si hay reservadas, si
+     * no transparent huge pages. Los bloques pasan a ser de 2 MiB.
+     */
+    bool                huge;
+    /** contadores a mantener, pueden ser compartidos por varios slabs. NULL ninguno */
+    struct slab_stats  *stats;
+};
+
+/**
+ * crea un slab de objetos de `size' bytes en bloques de `block_size' bytes,
+ * que debe ser potencia de 2 y tener lugar para al menos un objeto además de
+ * lo que ocupa llevar la cuenta. `opts' puede ser NULL: nunca devuelve
+ * bloques.
+ *
+ * @return NULL si no hay memoria o los tamaños no sirven
+ */
+struct slab *
+slab_new(size_t size, size_t block_size, const struct slab_options *opts);
+
+/** pide bloques hasta tener al menos `n' objetos libres. @return false si no hay memoria */
+bool
+slab_reserve(struct slab *s, size_t n);
+
+/** @return un objeto sin inicializar, o NULL si no hay memoria */
+void *
+slab_get(struct slab *s);
+
+/** devuelve un objeto obtenido con `slab_get' de este mismo slab. NULL no hace nada */
+void
+slab_put(struct slab *s, void *p);
+
+/**
+ * como `slab_put', pero además le devuelve al sistema las páginas enteras del
+ * objeto (madvise(2) con MADV_DONTNEED): deja de ocupar memoria hasta que se
+ * vuelva a usar, y se pierde su contenido. Cuesta una llamada al sistema, y
+ * un page fault por página al reusarlo.
+ */
+void
+slab_release(struct slab *s, void *p);
+
+/** libera todos los bloques, incluso los objetos que no se devolvieron */
+void
+slab_destroy(struct slab *s);
+
+#endif
@@ -2,6 +2,7 @@
 #define SOCKS5NIO_H
 
 #include <netdb.h>
+#include <stdatomic.h>
 #include "selector.h"
 
 #define MAX_USERS 10
@@ -9,6 +10,66 @@
 /** handler del socket pasivo que atiende conexiones socksv5 */
 void socksv5_passive_accept(struct selector_key *key);
 
+/**
+ * atiende una conexión ya aceptada (por ejemplo por el acceptor de
+ * workers.c) registrándola en el selector `s'.
+ * retorna 0 si anduvo todo bien; -1 si no pudo, en cuyo caso cierra `client'
+ */
+int socksv5_handle_connection(fd_selector s, const int client,
+                              const struct sockaddr *client_addr,
+                              const socklen_t client_addr_len);
+
+/**
+ * registra un contador de sesiones vivas para el hilo actual: se incrementa
+ * al crear cada sesión en este hilo y se decrementa al liberarla.
+ */
+void socksv5_set_sessions_counter(atomic_uint *counter);
+
+/** límites de tiempo de cada etapa de una sesión, en ms. 0 es sin límite */
+struct socks5_timeouts {
+    /** para recibir el hello y enviar su respuesta */
+    unsigned hello;
+    /** para recibir las credenciales y enviar su respuesta */
+    unsigned auth;
+    /** para recibir el request y para enviar su respuesta (sin contar DNS) */
+    unsigned request;
+    /** para conectarse a cada dirección del origin server */
+    unsigned connect;
+    /**
+     * entre intentos de conexión a las distintas direcciones del origin
+     * server, que siguen en paralelo (Happy Eyeballs). 0 los hace de a uno
+     */
+    unsigned connect_delay;
+    /** de inactividad durante la copia */
+    unsigned idle;
+    /** de inactividad durante la copia tras el cual se devuelven los buffers vacíos. 0 nunca */
+    unsigned release;
+};
+
+/** configura los límites de tiempo. Se debe llamar antes de atender conexiones */
+void socksv5_set_timeouts(const struct socks5_timeouts *t);
+
+/**
+ * bytes que puede copiar cada túnel por iteración del selector, sumando
+ * ambos sentidos. Al agotarlos cede el turno hasta la próxima iteración.
+ * 0 es sin límite. Se debe llamar antes de atender conexiones.
+ */
+void socksv5_set_copy_budget(size_t bytes);
+
+/**
+ * copiar los túneles con splice(2), sin pasar los bytes por memoria del
+ * proceso; el disector ve una copia hecha con tee(2) mientras la necesita.
+ * Por defecto sí. Se debe llamar antes de atender conexiones.
+ */
+void socksv5_set_splice(bool enabled);
+
+/**
+ * código de respuesta SOCKS (RFC 1928, campo REP) para los requests con
+ * nombre de dominio que llegan con la cola de resolución llena (ver
+ * resolver.h). Por defecto general SOCKS server failure.
+ */
+void socksv5_set_resolver_busy_status(uint8_t status);
+
 /** especifica la lista de users que pueden usar el servidor proxy
  * retorna 0 si anduvo todo bien
  * retorna -1 si el usuario ya esta registrado
@@ -21,7 +82,55 @@ int socksv5_unregister_user(char *uname);
 /** prende/apaga el disector de passwords pop3 */
 void socksv5_toggle_disector(bool to);
 
-/** libera pools internos */
+/**
+ * sesiones que cada hilo tiene a mano para las conexiones nuevas. Se toman de
+ * bloques grandes (ver slab.h) en lugar de malloc, y al cerrarse vuelven al
+ * pool del hilo.
+ */
+struct socks5_pool {
+    /** sesiones que se reservan al arrancar cada hilo */
+    size_t prewarm;
+    /**
+     * sesiones libres a partir de las cuales un hilo le devuelve al sistema los
+     * bloques vacíos, mientras queden al menos `low' libres. 0 nunca.
+     */
+    size_t high;
+    size_t low;
+    /** respaldar los bloques con huge pages si el sistema las da */
+    bool   huge_pages;
+};
+
+/** configura el pool de sesiones. Se debe llamar antes de atender conexiones */
+void socksv5_set_pool(const struct socks5_pool *p);
+
+/**
+ * crea el pool de sesiones del hilo que llama y reserva las configuradas.
+ * Cada hilo que atiende conexiones debería llamarla antes; si no, se crea con
+ * la primera conexión.
+ *
+ * @return 0 si pudo reservarlas
+ */
+int socksv5_pool_init(void);
+
+/** contadores de los pools de sesiones, sumando todos los hilos */
+struct socks5_pool_stats {
+    /** sesiones en uso */
+    uint64_t in_use;
+    /** sesiones reservadas sin usar */
+    uint64_t free;
+    /** máximo de sesiones en uso a la vez */
+    uint64_t peak;
+    /** bytes pedidos al sistema para las sesiones */
+    uint64_t bytes;
+};
+
+void socksv5_pool_stats(struct socks5_pool_stats *stats);
+
+/**
+ * libera los pools internos del hilo que lo llama. Antes se tienen que cerrar
+ * sus sesiones (ej: con selector_destroy): su memoria sale de estos pools, y
+ * una sesión sólo puede volver a los pools del hilo que la creó.
+ */
 void socksv5_pool_destroy(void);
 
 /** consultar estadisticas del servidor */
@@ -0,0 +1,75 @@
+#ifndef WORKERS_H_Qm3vTzK8pLw1RbN6sYhXcE2dJ
+#define WORKERS_H_Qm3vTzK8pLw1RbN6sYhXcE2dJ
+
+#include <stddef.h>
+
+#include "selector.h"
+
+/**
+ * workers.c - hilos adicionales que atienden conexiones SOCKS
+ *
+ * Cada worker tiene su propio selector. Una conexión nunca sale del hilo que
+ * la atiende, así que los handlers no necesitan sincronizarse (salvo para el
+ * estado global, ver socks5nio.c). Hay dos formas de repartir las
+ * conexiones nuevas:
+ *
+ *  - SO_REUSEPORT: cada worker tiene sus propios sockets pasivos sobre la
+ *    misma dirección y el kernel reparte según un hash de la conexión.
+ *
+ *  - acceptor: el hilo principal acepta (`workers_passive_accept') y le pasa
+ *    cada conexión al worker con menos sesiones vivas, mediante una cola
+ *    sin locks de un productor y un consumidor por worker, y le avisa con
+ *    `selector_post'. Evita que unos pocos túneles pesados terminen en el
+ *    mismo hilo por el hash.
+ *
+ * Los workers no atienden SIGINT ni SIGTERM: esas señales le llegan al hilo
+ * principal, que es quien llama a `workers_stop'.
+ */
+
+/** sockets pasivos SOCKS de un worker. -1 si no se usa esa familia */
+struct worker_listeners {
+    int v4;
+    int v6;
+};
+
+/** opciones de inicialización de los workers */
+struct workers_init {
+    /** cantidad de workers */
+    size_t n;
+
+    /**
+     * modo SO_REUSEPORT: `listeners[i]' son los sockets pasivos (no
+     * bloqueantes) del worker i; siguen siendo del llamador, que los cierra
+     * luego de `workers_stop'.
+     * NULL para el modo acceptor.
+     */
+    const struct worker_listeners *listeners;
+};
+
+/**
+ * lanza los workers. Se debe llamar luego de `selector_init'.
+ *
+ * @return 0 si todos los workers se iniciaron.
+ */
+int
+workers_start(const struct workers_init *c);
+
+/**
+ * handler de los sockets pasivos SOCKS en modo acceptor: acepta las
+ * conexiones pendientes y se las pasa a los workers.
+ */
+void
+workers_passive_accept(struct selector_key *key);
+
+/**
+ * suma a `stats' las mediciones del event loop de cada worker (ver
+ * `selector_loop_stats'). No hace nada si no hay workers.
+ */
+void
+workers_loop_stats(struct selector_loop_stats *stats);
+
+/** detiene los workers y espera a que terminen. Tolera no haberlos iniciado */
+void
+workers_stop(void);
+
+#endif
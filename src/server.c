@@ -4,12 +4,14 @@
  * Interpreta los argumentos de línea de comandos, y monta un socket
  * pasivo.
  *
- * Todas las conexiones entrantes se manejarán en éste hilo.
+ * Todas las conexiones entrantes se manejarán en éste hilo, salvo que se pidan
+ * más hilos con --threads (ver workers.h).
  *
- * Se descargará en otro hilos las operaciones bloqueantes (resolución de
- * DNS utilizando getaddrinfo), pero toda esa complejidad está oculta en
- * el selector.
+ * Los nombres se resuelven sin bloquear, con un cliente DNS propio en cada
+ * selector (ver dnsstub.h); opcionalmente se descarga getaddrinfo en un pool
+ * de hilos que avisan al selector cuando terminan (ver resolver.h).
  */
+#define _GNU_SOURCE // SO_REUSEPORT
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -20,6 +22,7 @@
 #include <unistd.h>
 #include <sys/types.h>   // socket
 #include <sys/socket.h>  // socket
+#include <sys/resource.h> // setrlimit
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -28,6 +31,11 @@
 #include "include/socks5nio.h"
 #include "include/monitornio.h"
 #include "include/args.h"
+#include "include/workers.h"
+#include "include/resolver.h"
+#include "include/dnscache.h"
+#include "include/scoreboard.h"
+#include "include/dnsstub.h"
 
 #define MAX_CONNECTIONS 512
 
@@ -42,8 +50,9 @@ sigterm_handler(const int signal) {
     done = true;
 }
 
-static int bind_ipv4_socket(struct in_addr bind_address, unsigned port);
-static int bind_ipv6_socket(struct in6_addr bind_address, unsigned port);
+static int bind_ipv4_socket(struct in_addr bind_address, unsigned port, bool reuseport);
+static int bind_ipv6_socket(struct in6_addr bind_address, unsigned port, bool reuseport);
+static void raise_fd_limit(void);
 
 int
 main(const int argc, char **argv) {
@@ -54,6 +63,9 @@ main(const int argc, char **argv) {
     // no tenemos nada que leer de stdin
     close(0);
 
+    // cada sesión usa dos fds, así que pedimos todos los que nos dejen
+    raise_fd_limit();
+
     const char       *err_msg = NULL;
     selector_status   ss      = SELECTOR_SUCCESS;
     fd_selector selector      = NULL;
@@ -64,9 +76,17 @@ main(const int argc, char **argv) {
     struct in6_addr server_ipv6_addr, monitor_ipv6_addr;
     int server_v6 = FD_UNUSED, monitor_v6 = FD_UNUSED;
 
+    // con acceptor el hilo principal sólo acepta y todos los hilos pedidos son
+    // workers; si no, el principal es uno más.
+    const size_t nworkers = args.acceptor ? args.threads : args.threads - 1;
+    // sockets pasivos socks de los workers (sólo sin acceptor)
+    struct worker_listeners *listeners = NULL;
+    // sin acceptor cada hilo tiene su socket pasivo sobre el mismo puerto
+    const bool reuseport = !args.acceptor && args.threads > 1;
+
     // socket pasivo socks IPv4
     if(inet_pton(AF_INET, args.socks_addr, &server_ipv4_addr) == 1){       // if parsing to ipv4 succeded
-        server_v4 = bind_ipv4_socket(server_ipv4_addr, args.socks_port);
+        server_v4 = bind_ipv4_socket(server_ipv4_addr, args.socks_port, reuseport);
         if (server_v4 < 0) {
             err_msg = "unable to create IPv4 socks socket";
             goto finally;
@@ -76,7 +96,7 @@ main(const int argc, char **argv) {
 
     // socket pasivo monitoreo IPv4
     if(inet_pton(AF_INET, args.mng_addr, &monitor_ipv4_addr) == 1) {
-        monitor_v4 = bind_ipv4_socket(monitor_ipv4_addr, args.mng_port);
+        monitor_v4 = bind_ipv4_socket(monitor_ipv4_addr, args.mng_port, false);
         if (monitor_v4 < 0) {
             err_msg = "unable to create IPv4 monitor socket";
             goto finally;
@@ -88,7 +108,7 @@ main(const int argc, char **argv) {
     char* ipv6_addr_text = args.is_default_socks_addr ? DEFAULT_SOCKS_ADDR_V6 : args.socks_addr;
 
     if((!IS_FD_USED(server_v4) || args.is_default_socks_addr) && (inet_pton(AF_INET6, ipv6_addr_text, &server_ipv6_addr) == 1)){
-        server_v6 = bind_ipv6_socket(server_ipv6_addr, args.socks_port);
+        server_v6 = bind_ipv6_socket(server_ipv6_addr, args.socks_port, reuseport);
         if (server_v6 < 0) {
             err_msg = "unable to create IPv6 socket";
             goto finally;
@@ -100,7 +120,7 @@ main(const int argc, char **argv) {
      ipv6_addr_text = args.is_default_mng_addr ? DEFAULT_CONF_ADDR_V6 : args.mng_addr;
 
     if((!IS_FD_USED(monitor_v4) || args.is_default_mng_addr) && (inet_pton(AF_INET6, ipv6_addr_text, &monitor_ipv6_addr) == 1)){
-        monitor_v6 = bind_ipv6_socket(monitor_ipv6_addr, args.mng_port);
+        monitor_v6 = bind_ipv6_socket(monitor_ipv6_addr, args.mng_port, false);
         if (monitor_v6 < 0) {
             err_msg = "unable to create IPv6 socket";
             goto finally;
@@ -118,10 +138,39 @@ main(const int argc, char **argv) {
         goto finally;
     }
 
+    if(reuseport) {
+        listeners = malloc(nworkers * sizeof(*listeners));
+        if(listeners == NULL) {
+            err_msg = "allocating worker sockets";
+            goto finally;
+        }
+        for(size_t i = 0; i < nworkers; i++) {
+            listeners[i].v4 = listeners[i].v6 = FD_UNUSED;
+        }
+        for(size_t i = 0; i < nworkers; i++) {
+            if(IS_FD_USED(server_v4)) {
+                listeners[i].v4 = bind_ipv4_socket(server_ipv4_addr, args.socks_port, true);
+                if(listeners[i].v4 < 0 || selector_fd_set_nio(listeners[i].v4) == -1) {
+                    err_msg = "unable to create worker IPv4 socks socket";
+                    goto finally;
+                }
+            }
+            if(IS_FD_USED(server_v6)) {
+                listeners[i].v6 = bind_ipv6_socket(server_ipv6_addr, args.socks_port, true);
+                if(listeners[i].v6 < 0 || selector_fd_set_nio(listeners[i].v6) == -1) {
+                    err_msg = "unable to create worker IPv6 socks socket";
+                    goto finally;
+                }
+            }
+        }
+    }
+
     // registrar sigterm es útil para terminar el programa normalmente.
     // esto ayuda mucho en herramientas como valgrind.
     signal(SIGTERM, sigterm_handler);
     signal(SIGINT,  sigterm_handler);
+    // en el modo relay de io_uring las escrituras no usan MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
 
     // seteamos los sockets pasivos como no bloqueantes
     if(IS_FD_USED(server_v4) && (selector_fd_set_nio(server_v4) == -1)){
@@ -145,11 +194,12 @@ main(const int argc, char **argv) {
     }
 
     const struct selector_init conf = {
-        .signal = SIGALRM, // señal para las notificaciones internas del selector
         .select_timeout = { // tiempo maximo de bloqueo, es una estructura de timespec
             .tv_sec  = 10,
             .tv_nsec = 0,
         },
+        .engine = args.engine,
+        .relay_buffers = args.relay_buffers,
     };
     if(0 != selector_init(&conf)) {
         err_msg = "initializing selector";
@@ -161,10 +211,11 @@ main(const int argc, char **argv) {
         err_msg = "unable to create selector";
         goto finally;
     }
+    fprintf(stdout, "Selector: using %s engine\n", selector_engine_name(selector));
 
     // handlers para cada tipo de accion (read, write y close) sobre el socket pasivo
     const struct fd_handler socksv5 = {
-        .handle_read       = socksv5_passive_accept,
+        .handle_read       = args.acceptor ? workers_passive_accept : socksv5_passive_accept,
         .handle_write      = NULL,
         .handle_close      = NULL, // nada que liberar
     };
@@ -226,6 +277,83 @@ main(const int argc, char **argv) {
     if (!args.disectors_enabled)
         socksv5_toggle_disector(false);
 
+    const struct socks5_timeouts timeouts = {
+        .hello   = args.hello_timeout   * 1000,
+        .auth    = args.auth_timeout    * 1000,
+        .request = args.request_timeout * 1000,
+        .connect = args.connect_timeout * 1000,
+        .connect_delay = args.connect_delay,
+        .idle    = args.idle_timeout    * 1000,
+        .release = args.release_timeout * 1000,
+    };
+    socksv5_set_timeouts(&timeouts);
+    socksv5_set_copy_budget(args.copy_budget);
+    socksv5_set_splice(args.splice);
+    socksv5_set_resolver_busy_status(args.dns_busy_reply);
+
+    const struct socks5_pool pool_conf = {
+        .prewarm    = args.session_prewarm,
+        .high       = args.session_high,
+        .low        = args.session_low,
+        .huge_pages = args.session_huge_pages,
+    };
+    socksv5_set_pool(&pool_conf);
+    // salvo que sólo acepte, este hilo también atiende conexiones
+    if(!args.acceptor && socksv5_pool_init() != 0) {
+        err_msg = "preallocating sessions";
+        goto finally;
+    }
+
+    const struct dnscache_init dnscache_conf = {
+        .entries      = args.dns_cache_size,
+        .ttl          = args.dns_cache_ttl    * 1000,
+        .negative_ttl = args.dns_negative_ttl * 1000,
+        .refresh_percent = args.dns_prefetch,
+        .refresh_hits = args.dns_prefetch_hits,
+    };
+    if(dnscache_init(&dnscache_conf) != 0) {
+        err_msg = "allocating DNS cache";
+        goto finally;
+    }
+
+    const struct scoreboard_init scoreboard_conf = {
+        .entries    = args.addr_scores,
+        .down_after = args.addr_down_after,
+        .down_ttl   = args.addr_down_ttl * 1000,
+    };
+    if(scoreboard_init(&scoreboard_conf) != 0) {
+        err_msg = "allocating address scoreboard";
+        goto finally;
+    }
+
+    if(args.dns_engine == RESOLVER_NATIVE && dnsstub_init(NULL, NULL, args.dns_queue) != 0) {
+        err_msg = "reading DNS configuration";
+        goto finally;
+    }
+
+    const struct resolver_init resolver_conf = {
+        .engine  = args.dns_engine,
+        .threads = args.dns_threads,
+        .queue   = args.dns_queue,
+    };
+    if(resolver_start(&resolver_conf) != 0) {
+        err_msg = "starting DNS resolver threads";
+        goto finally;
+    }
+
+    if(nworkers > 0) {
+        const struct workers_init workers_conf = {
+            .n         = nworkers,
+            .listeners = listeners,
+        };
+        if(workers_start(&workers_conf) != 0) {
+            err_msg = "starting workers";
+            goto finally;
+        }
+        fprintf(stdout, "Socks: serving on %zu threads%s\n", args.threads,
+                args.acceptor ? " fed by an acceptor thread" : "");
+    }
+
     printf("\n----------------------- LOGS -----------------------\n\n");
     // termina con un ctrl + C pero dejando un mensajito
     while(!done) {
@@ -255,13 +383,23 @@ finally:
         ret = 1;
     }
 
-    if(selector != NULL)
+    // los hilos del resolver notifican a los selectores: primero que nada
+    resolver_stop();
+    // antes de destruir nada: los workers usan los pools y el estado global
+    workers_stop();
+
+    if(selector != NULL) {
+        resolver_detach(selector);
         selector_destroy(selector);
+    }
 
     selector_close();
 
     socksv5_pool_destroy();
     connection_pool_destroy();
+    dnscache_destroy();
+    scoreboard_destroy();
+    dnsstub_destroy();
 
     if (server_v4 >= 0)
         close(server_v4);
@@ -271,12 +409,19 @@ finally:
         close(monitor_v4);
     if(monitor_v6 >= 0)
         close(monitor_v6);
+    for(size_t i = 0; listeners != NULL && i < nworkers; i++) {
+        if(listeners[i].v4 >= 0)
+            close(listeners[i].v4);
+        if(listeners[i].v6 >= 0)
+            close(listeners[i].v6);
+    }
+    free(listeners);
 
     return ret;
 }
 
 static int
-create_socket(sa_family_t family) {
+create_socket(sa_family_t family, bool reuseport) {
     const int s = socket(family, SOCK_STREAM, IPPROTO_TCP);
     if (s < 0) {
         fprintf(stderr, "unable to create socket\n");
@@ -287,6 +432,12 @@ create_socket(sa_family_t family) {
     socklen_t sock_optlen = sizeof(int);
     // man 7 ip. no importa reportar nada si falla.
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void*)sock_optval, sock_optlen);
+    // man 7 socket. el kernel reparte las conexiones entre los sockets del mismo puerto
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void*)sock_optval, sock_optlen) < 0) {
+        fprintf(stderr, "unable to set SO_REUSEPORT\n");
+        close(s);
+        return -1;
+    }
     return s;
 }
 
@@ -297,7 +448,7 @@ bind_socket(int server, struct sockaddr *address, socklen_t address_len) {
         return -1;
     }
 
-    if (listen(server, 5) < 0) {
+    if (listen(server, SOMAXCONN) < 0) {
         fprintf(stderr, "unable to listen on socket\n");
         return -1;
     }
@@ -305,10 +456,23 @@ bind_socket(int server, struct sockaddr *address, socklen_t address_len) {
     return 0;
 }
 
+/** sube el límite blando de file descriptors hasta el límite duro */
+static void
+raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        // si falla seguimos con el límite actual
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
 /** creates and binds an IPv4 socket */
 static int
-bind_ipv4_socket(struct in_addr bind_address, unsigned port) {
-    const int server = create_socket(AF_INET);
+bind_ipv4_socket(struct in_addr bind_address, unsigned port, bool reuseport) {
+    const int server = create_socket(AF_INET, reuseport);
+    if (server < 0)
+        return -1;
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -324,8 +488,10 @@ bind_ipv4_socket(struct in_addr bind_address, unsigned port) {
 
 /** creates and binds an IPv6 socket */
 static int
-bind_ipv6_socket(struct in6_addr bind_address, unsigned port) {
-    const int server = create_socket(AF_INET6);
+bind_ipv6_socket(struct in6_addr bind_address, unsigned port, bool reuseport) {
+    const int server = create_socket(AF_INET6, reuseport);
+    if (server < 0)
+        return -1;
     setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &(int){1}, sizeof(int)); // man ipv6, si falla fallara el bind
 
     struct sockaddr_in6 addr;
@@ -22,6 +22,63 @@ port(const char *s, char* progname) {
     return (unsigned short)sl;
 }
 
+static enum selector_engine
+engine(const char *s, char* progname) {
+    enum selector_engine ret = SELECTOR_ENGINE_DEFAULT;
+
+    if (strcmp(s, "epoll") == 0) {
+        ret = SELECTOR_ENGINE_EPOLL;
+    } else if (strcmp(s, "select") == 0) {
+        ret = SELECTOR_ENGINE_SELECT;
+    } else if (strcmp(s, "uring") == 0) {
+        ret = SELECTOR_ENGINE_URING;
+    } else {
+        fprintf(stderr, "%s: invalid engine %s, should be one of: epoll, select, uring.\n", progname, s);
+        exit(1);
+    }
+    return ret;
+}
+
+static enum resolver_engine
+dns_engine(const char *s, char* progname) {
+    enum resolver_engine ret = RESOLVER_NATIVE;
+
+    if (strcmp(s, "native") == 0) {
+        ret = RESOLVER_NATIVE;
+    } else if (strcmp(s, "getaddrinfo") == 0) {
+        ret = RESOLVER_GETADDRINFO;
+    } else {
+        fprintf(stderr, "%s: invalid DNS engine %s, should be one of: native, getaddrinfo.\n", progname, s);
+        exit(1);
+    }
+    return ret;
+}
+
+static size_t
+count(const char *s, const char *option, char* progname) {
+    char *end     = 0;
+    errno         = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno || sl < 0 || sl > INT_MAX) {
+        fprintf(stderr, "%s: invalid value %s for %s, should be a non-negative integer.\n", progname, s, option);
+        exit(1);
+    }
+    return (size_t)sl;
+}
+
+/** segundos, representables en milisegundos */
+static unsigned
+seconds(const char *s, const char *option, char* progname) {
+    const size_t ret = count(s, option, progname);
+
+    if (ret > UINT_MAX / 1000) {
+        fprintf(stderr, "%s: invalid value %s for %s, should be at most %u seconds.\n", progname, s, option, UINT_MAX / 1000);
+        exit(1);
+    }
+    return (unsigned)ret;
+}
+
 static void
 user(char *s, struct users *user, char* progname) {
     char *p = strchr(s, ':');
@@ -59,8 +116,77 @@ usage(const char *progname) {
         "   -P<conf  port>  Puerto TCP para conexiones entrantes del protocolo de configuracion. Por defecto es 8080.\n"
         "   -u<user>:<pass> Usuario y contraseña de usuario que puede usar el proxy. Hasta 10.\n"
         "   -v              Imprime información sobre la versión y termina.\n"
+        "   --engine <motor>\n"
+        "                   Motor de multiplexación: epoll, select o uring. Por defecto epoll si está disponible.\n"
+        "   --relay-buffers <n>\n"
+        "                   Buffers registrados en el kernel para el relay con uring. 0 lo deshabilita. Por defecto %d.\n"
+        "   --threads <n>   Hilos que atienden conexiones SOCKS, cada uno con su selector. Por defecto %d.\n"
+        "   --acceptor      El hilo principal acepta las conexiones y se las pasa al hilo con menos sesiones.\n"
+        "   --hello-timeout <s>\n"
+        "                   Segundos para completar el saludo SOCKS. 0 es sin límite. Por defecto %d.\n"
+        "   --auth-timeout <s>\n"
+        "                   Segundos para completar la autenticación. 0 es sin límite. Por defecto %d.\n"
+        "   --request-timeout <s>\n"
+        "                   Segundos para recibir el request y enviar su respuesta. 0 es sin límite. Por defecto %d.\n"
+        "   --connect-timeout <s>\n"
+        "                   Segundos para conectarse a cada dirección del origin server. 0 es sin límite. Por defecto %d.\n"
+        "   --connect-delay <ms>\n"
+        "                   Milisegundos de ventaja de cada dirección del origin server sobre la siguiente, que se\n"
+        "                   intentan en paralelo (Happy Eyeballs). 0 las intenta de a una. Por defecto %d.\n"
+        "   --idle-timeout <s>\n"
+        "                   Segundos sin tráfico luego de los cuales se cierra un túnel. 0 es sin límite. Por defecto %d.\n"
+        "   --release-timeout <s>\n"
+        "                   Segundos sin tráfico luego de los cuales un túnel devuelve sus buffers vacíos hasta que vuelva\n"
+        "                   a recibir datos. 0 nunca los devuelve. Por defecto %d.\n"
+        "   --copy-budget <bytes>\n"
+        "                   Bytes que puede copiar cada túnel por vuelta del event loop antes de cederle el turno a los demás. 0 es sin límite. Por defecto %d.\n"
+        "   --no-splice     Copia los túneles a través de buffers propios en lugar de splice(2).\n",
+        progname, DEFAULT_RELAY_BUFFERS, DEFAULT_THREADS, DEFAULT_HELLO_TIMEOUT,
+        DEFAULT_AUTH_TIMEOUT, DEFAULT_REQUEST_TIMEOUT, DEFAULT_CONNECT_TIMEOUT,
+        DEFAULT_CONNECT_DELAY, DEFAULT_IDLE_TIMEOUT, DEFAULT_RELEASE_TIMEOUT, DEFAULT_COPY_BUDGET);
+    // en dos partes: C99 sólo garantiza literales de hasta 4095 caracteres
+    fprintf(stderr,
+        "   --dns-engine <motor>\n"
+        "                   Cómo se resuelven los nombres: native (cliente DNS en cada event loop, según\n"
+        "                   /etc/resolv.conf y /etc/hosts) o getaddrinfo (en un pool de hilos). Por defecto native.\n"
+        "   --dns-threads <n>\n"
+        "                   Hilos que resuelven nombres de dominio con getaddrinfo. Por defecto %d.\n"
+        "   --dns-queue <n> Resoluciones que pueden esperar un hilo libre (con native, en curso por hilo). Por defecto %d.\n"
+        "   --dns-busy-reply <código>\n"
+        "                   Respuesta SOCKS (1-8) a los requests que encuentran la cola de DNS llena. Por defecto %d.\n"
+        "   --dns-cache-size <n>\n"
+        "                   Nombres resueltos que se recuerdan. 0 deshabilita el cache. Por defecto %d.\n"
+        "   --dns-cache-ttl <s>\n"
+        "                   Segundos que se recuerda una resolución exitosa. Por defecto %d.\n"
+        "   --dns-negative-ttl <s>\n"
+        "                   Segundos que se recuerda que un nombre no existe. 0 no los recuerda. Por defecto %d.\n"
+        "   --dns-prefetch <porcentaje>\n"
+        "                   Porcentaje de su vida desde el que se vuelve a resolver en segundo plano un nombre\n"
+        "                   del cache que se sigue usando. 0 no los renueva. Por defecto %d.\n"
+        "   --dns-prefetch-hits <n>\n"
+        "                   Usos que necesita un nombre del cache para que se renueve. Por defecto %d.\n"
+        "   --addr-scores <n>\n"
+        "                   Direcciones de origin servers de las que se recuerda cómo resultaron las conexiones,\n"
+        "                   para intentar primero las que andan. 0 deshabilita el historial. Por defecto %d.\n"
+        "   --addr-down-after <n>\n"
+        "                   Conexiones seguidas sin respuesta tras las que una dirección se da por caída. 0 nunca. Por defecto %d.\n"
+        "   --addr-down-ttl <s>\n"
+        "                   Segundos que una dirección se da por caída. Por defecto %d.\n"
+        "   --session-prewarm <n>\n"
+        "                   Sesiones que reserva cada hilo al arrancar. Por defecto %d.\n"
+        "   --session-high <n>\n"
+        "                   Sesiones libres a partir de las cuales un hilo le devuelve memoria al sistema. 0 nunca.\n"
+        "                   Por defecto %d.\n"
+        "   --session-low <n>\n"
+        "                   Sesiones libres que conserva un hilo al devolver memoria. Por defecto %d.\n"
+        "   --session-huge-pages\n"
+        "                   Reserva las sesiones en huge pages si el sistema las da.\n"
         "\n",
-        progname);
+        DEFAULT_DNS_THREADS, DEFAULT_DNS_QUEUE, DEFAULT_DNS_BUSY_REPLY, DEFAULT_DNS_CACHE_SIZE,
+        DEFAULT_DNS_CACHE_TTL, DEFAULT_DNS_NEGATIVE_TTL, DEFAULT_DNS_PREFETCH,
+        DEFAULT_DNS_PREFETCH_HITS, DEFAULT_ADDR_SCORES, DEFAULT_ADDR_DOWN_AFTER,
+        DEFAULT_ADDR_DOWN_TTL, DEFAULT_SESSION_PREWARM, DEFAULT_SESSION_HIGH,
+        DEFAULT_SESSION_LOW);
     exit(1);
 }
 
@@ -78,8 +204,104 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
 
     args->disectors_enabled = true;
 
+    args->engine = SELECTOR_ENGINE_DEFAULT;
+    args->relay_buffers = DEFAULT_RELAY_BUFFERS;
+    args->threads = DEFAULT_THREADS;
+
+    args->hello_timeout   = DEFAULT_HELLO_TIMEOUT;
+    args->auth_timeout    = DEFAULT_AUTH_TIMEOUT;
+    args->request_timeout = DEFAULT_REQUEST_TIMEOUT;
+    args->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    args->connect_delay   = DEFAULT_CONNECT_DELAY;
+    args->idle_timeout    = DEFAULT_IDLE_TIMEOUT;
+    args->release_timeout = DEFAULT_RELEASE_TIMEOUT;
+    args->copy_budget     = DEFAULT_COPY_BUDGET;
+    args->splice          = true;
+
+    args->dns_engine      = RESOLVER_NATIVE;
+    args->dns_threads     = DEFAULT_DNS_THREADS;
+    args->dns_queue       = DEFAULT_DNS_QUEUE;
+    args->dns_busy_reply  = DEFAULT_DNS_BUSY_REPLY;
+    args->dns_cache_size  = DEFAULT_DNS_CACHE_SIZE;
+    args->dns_cache_ttl   = DEFAULT_DNS_CACHE_TTL;
+    args->dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+    args->dns_prefetch    = DEFAULT_DNS_PREFETCH;
+    args->dns_prefetch_hits = DEFAULT_DNS_PREFETCH_HITS;
+    args->addr_scores     = DEFAULT_ADDR_SCORES;
+    args->addr_down_after = DEFAULT_ADDR_DOWN_AFTER;
+    args->addr_down_ttl   = DEFAULT_ADDR_DOWN_TTL;
+    args->session_prewarm = DEFAULT_SESSION_PREWARM;
+    args->session_high    = DEFAULT_SESSION_HIGH;
+    args->session_low     = DEFAULT_SESSION_LOW;
+    args->session_huge_pages = false;
+
     int nusers = 0;
 
+    // opciones sin versión corta
+    enum {
+        OPT_ENGINE = 0x100,
+        OPT_RELAY_BUFFERS,
+        OPT_THREADS,
+        OPT_ACCEPTOR,
+        OPT_HELLO_TIMEOUT,
+        OPT_AUTH_TIMEOUT,
+        OPT_REQUEST_TIMEOUT,
+        OPT_CONNECT_TIMEOUT,
+        OPT_CONNECT_DELAY,
+        OPT_IDLE_TIMEOUT,
+        OPT_RELEASE_TIMEOUT,
+        OPT_COPY_BUDGET,
+        OPT_NO_SPLICE,
+        OPT_DNS_ENGINE,
+        OPT_DNS_THREADS,
+        OPT_DNS_QUEUE,
+        OPT_DNS_BUSY_REPLY,
+        OPT_DNS_CACHE_SIZE,
+        OPT_DNS_CACHE_TTL,
+        OPT_DNS_NEGATIVE_TTL,
+        OPT_DNS_PREFETCH,
+        OPT_DNS_PREFETCH_HITS,
+        OPT_ADDR_SCORES,
+        OPT_ADDR_DOWN_AFTER,
+        OPT_ADDR_DOWN_TTL,
+        OPT_SESSION_PREWARM,
+        OPT_SESSION_HIGH,
+        OPT_SESSION_LOW,
+        OPT_SESSION_HUGE_PAGES,
+    };
+    static const struct option long_options[] = {
+        { "engine",        required_argument, 0, OPT_ENGINE        },
+        { "relay-buffers", required_argument, 0, OPT_RELAY_BUFFERS },
+        { "threads",       required_argument, 0, OPT_THREADS       },
+        { "acceptor",        no_argument,       0, OPT_ACCEPTOR        },
+        { "hello-timeout",   required_argument, 0, OPT_HELLO_TIMEOUT   },
+        { "auth-timeout",    required_argument, 0, OPT_AUTH_TIMEOUT    },
+        { "request-timeout", required_argument, 0, OPT_REQUEST_TIMEOUT },
+        { "connect-timeout", required_argument, 0, OPT_CONNECT_TIMEOUT },
+        { "connect-delay",   required_argument, 0, OPT_CONNECT_DELAY   },
+        { "idle-timeout",    required_argument, 0, OPT_IDLE_TIMEOUT    },
+        { "release-timeout", required_argument, 0, OPT_RELEASE_TIMEOUT },
+        { "copy-budget",     required_argument, 0, OPT_COPY_BUDGET     },
+        { "no-splice",       no_argument,       0, OPT_NO_SPLICE       },
+        { "dns-engine",      required_argument, 0, OPT_DNS_ENGINE      },
+        { "dns-threads",     required_argument, 0, OPT_DNS_THREADS     },
+        { "dns-queue",       required_argument, 0, OPT_DNS_QUEUE       },
+        { "dns-busy-reply",  required_argument, 0, OPT_DNS_BUSY_REPLY  },
+        { "dns-cache-size",  required_argument, 0, OPT_DNS_CACHE_SIZE  },
+        { "dns-cache-ttl",   required_argument, 0, OPT_DNS_CACHE_TTL   },
+        { "dns-negative-ttl", required_argument, 0, OPT_DNS_NEGATIVE_TTL },
+        { "dns-prefetch",    required_argument, 0, OPT_DNS_PREFETCH    },
+        { "dns-prefetch-hits", required_argument, 0, OPT_DNS_PREFETCH_HITS },
+        { "addr-scores",     required_argument, 0, OPT_ADDR_SCORES     },
+        { "addr-down-after", required_argument, 0, OPT_ADDR_DOWN_AFTER },
+        { "addr-down-ttl",   required_argument, 0, OPT_ADDR_DOWN_TTL   },
+        { "session-prewarm", required_argument, 0, OPT_SESSION_PREWARM },
+        { "session-high",    required_argument, 0, OPT_SESSION_HIGH    },
+        { "session-low",     required_argument, 0, OPT_SESSION_LOW     },
+        { "session-huge-pages", no_argument,    0, OPT_SESSION_HUGE_PAGES },
+        { 0,                 0,                 0, 0                   },
+    };
+
     while (true) {
         /*
             Uso: getopt(argc, argv, optstring)
@@ -94,8 +316,10 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
             para diferenciar cuando el error es por argumento invalido (getopt retorna '?') o que el argumento es valido
             pero falta su valor (getopt retorna '!'). En ambos retornos, el argumento procesado se guarda en 'optopt' y se
             puede usar en los mensajes de error custom.
+            getopt_long() se comporta igual, pero ademas acepta las opciones largas (ej: "--engine epoll") de
+            long_options, retornando el valor asociado a cada una (que elegimos fuera del rango de los caracteres).
         */
-        int c = getopt(argc, argv, ":hl:L:Np:P:u:v");
+        int c = getopt_long(argc, argv, ":hl:L:Np:P:u:v", long_options, NULL);
         if (c == -1)
             break;
 
@@ -133,13 +357,129 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
                 version();
                 exit(0);
                 break;
+            case OPT_ENGINE:
+                args->engine = engine(optarg, argv[0]);
+                break;
+            case OPT_RELAY_BUFFERS:
+                args->relay_buffers = count(optarg, "--relay-buffers", argv[0]);
+                break;
+            case OPT_THREADS:
+                args->threads = count(optarg, "--threads", argv[0]);
+                if (args->threads < 1 || args->threads > MAX_THREADS) {
+                    fprintf(stderr, "%s: invalid value %s for --threads, should be in the range of 1-%d.\n", argv[0], optarg, MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case OPT_ACCEPTOR:
+                args->acceptor = true;
+                break;
+            case OPT_HELLO_TIMEOUT:
+                args->hello_timeout = seconds(optarg, "--hello-timeout", argv[0]);
+                break;
+            case OPT_AUTH_TIMEOUT:
+                args->auth_timeout = seconds(optarg, "--auth-timeout", argv[0]);
+                break;
+            case OPT_REQUEST_TIMEOUT:
+                args->request_timeout = seconds(optarg, "--request-timeout", argv[0]);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                args->connect_timeout = seconds(optarg, "--connect-timeout", argv[0]);
+                break;
+            case OPT_CONNECT_DELAY:
+                args->connect_delay = count(optarg, "--connect-delay", argv[0]);
+                break;
+            case OPT_IDLE_TIMEOUT:
+                args->idle_timeout = seconds(optarg, "--idle-timeout", argv[0]);
+                break;
+            case OPT_RELEASE_TIMEOUT:
+                args->release_timeout = seconds(optarg, "--release-timeout", argv[0]);
+                break;
+            case OPT_COPY_BUDGET:
+                args->copy_budget = count(optarg, "--copy-budget", argv[0]);
+                break;
+            case OPT_NO_SPLICE:
+                args->splice = false;
+                break;
+            case OPT_DNS_ENGINE:
+                args->dns_engine = dns_engine(optarg, argv[0]);
+                break;
+            case OPT_DNS_THREADS:
+                args->dns_threads = count(optarg, "--dns-threads", argv[0]);
+                if (args->dns_threads < 1 || args->dns_threads > MAX_DNS_THREADS) {
+                    fprintf(stderr, "%s: invalid value %s for --dns-threads, should be in the range of 1-%d.\n", argv[0], optarg, MAX_DNS_THREADS);
+                    exit(1);
+                }
+                break;
+            case OPT_DNS_QUEUE:
+                args->dns_queue = count(optarg, "--dns-queue", argv[0]);
+                if (args->dns_queue < 1) {
+                    fprintf(stderr, "%s: invalid value %s for --dns-queue, should be at least 1.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_DNS_BUSY_REPLY: {
+                const size_t reply = count(optarg, "--dns-busy-reply", argv[0]);
+                // 0 sería succeeded; más de 8 no está definido en el RFC 1928
+                if (reply < 1 || reply > 8) {
+                    fprintf(stderr, "%s: invalid value %s for --dns-busy-reply, should be a SOCKS reply code in the range of 1-8.\n", argv[0], optarg);
+                    exit(1);
+                }
+                args->dns_busy_reply = (uint8_t)reply;
+                break;
+            }
+            case OPT_DNS_CACHE_SIZE:
+                args->dns_cache_size = count(optarg, "--dns-cache-size", argv[0]);
+                break;
+            case OPT_DNS_CACHE_TTL:
+                args->dns_cache_ttl = seconds(optarg, "--dns-cache-ttl", argv[0]);
+                break;
+            case OPT_DNS_NEGATIVE_TTL:
+                args->dns_negative_ttl = seconds(optarg, "--dns-negative-ttl", argv[0]);
+                break;
+            case OPT_DNS_PREFETCH:
+                args->dns_prefetch = count(optarg, "--dns-prefetch", argv[0]);
+                if (args->dns_prefetch > 99) {
+                    fprintf(stderr, "%s: invalid value %s for --dns-prefetch, should be in the range of 0-99.\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_DNS_PREFETCH_HITS:
+                args->dns_prefetch_hits = count(optarg, "--dns-prefetch-hits", argv[0]);
+                break;
+            case OPT_ADDR_SCORES:
+                args->addr_scores = count(optarg, "--addr-scores", argv[0]);
+                break;
+            case OPT_ADDR_DOWN_AFTER:
+                args->addr_down_after = count(optarg, "--addr-down-after", argv[0]);
+                break;
+            case OPT_ADDR_DOWN_TTL:
+                args->addr_down_ttl = seconds(optarg, "--addr-down-ttl", argv[0]);
+                break;
+            case OPT_SESSION_PREWARM:
+                args->session_prewarm = count(optarg, "--session-prewarm", argv[0]);
+                break;
+            case OPT_SESSION_HIGH:
+                args->session_high = count(optarg, "--session-high", argv[0]);
+                break;
+            case OPT_SESSION_LOW:
+                args->session_low = count(optarg, "--session-low", argv[0]);
+                break;
+            case OPT_SESSION_HUGE_PAGES:
+                args->session_huge_pages = true;
+                break;
             case ':':
-                fprintf(stderr, "%s: missing value for option -%c.\n", argv[0], optopt);
+                if (optopt >= OPT_ENGINE)
+                    fprintf(stderr, "%s: missing value for option %s.\n", argv[0], argv[optind - 1]);
+                else
+                    fprintf(stderr, "%s: missing value for option -%c.\n", argv[0], optopt);
                 usage(argv[0]);
                 exit(1);
                 break;
             case '?':
-                fprintf(stderr, "%s: invalid option -%c.\n", argv[0], optopt);
+                if (optopt == 0)
+                    fprintf(stderr, "%s: invalid option %s.\n", argv[0], argv[optind - 1]);
+                else
+                    fprintf(stderr, "%s: invalid option -%c.\n", argv[0], optopt);
                 usage(argv[0]);
                 exit(1);
             default:
@@ -147,6 +487,10 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
                 break;
         }
     }
+    if (args->session_high != 0 && args->session_low > args->session_high) {
+        fprintf(stderr, "%s: --session-low should not be greater than --session-high.\n", argv[0]);
+        exit(1);
+    }
     if (optind < argc) {
         fprintf(stderr, "argument not accepted: ");
         while (optind < argc) {
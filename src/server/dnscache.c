@@ -0,0 +1,316 @@
+/**
+ * dnscache.c - cache de resoluciones de nombres, compartido por todos los hilos
+ *
+ * Tabla de hash con encadenamiento más una lista doblemente enlazada en orden
+ * de uso (la cabeza es la más reciente). Un único mutex protege todo: cada
+ * operación es una búsqueda en la tabla y una copia de unos pocos nodos,
+ * nada comparado con la conexión al origin que viene después.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/dnscache.h"
+
+/** nodo de una lista copiada: la dirección va en el mismo bloque */
+struct node {
+    struct addrinfo         ai;
+    struct sockaddr_storage addr;
+};
+
+struct entry {
+    /** siguiente en el mismo bucket */
+    struct entry    *next;
+    /** vecinos en la lista de uso */
+    struct entry    *newer, *older;
+
+    uint32_t         hash;
+    uint16_t         port;
+    int              family;
+    /** CLOCK_MONOTONIC, ms */
+    uint64_t         expires;
+    /** desde cuándo se renueva; UINT64_MAX si nunca (o si ya se pidió) */
+    uint64_t         refresh_at;
+    /** usos desde que se guardó */
+    unsigned         uses;
+    /** NULL si es una respuesta negativa */
+    struct addrinfo *list;
+    char             host[];
+};
+
+static pthread_mutex_t  lock        = PTHREAD_MUTEX_INITIALIZER;
+static struct entry   **buckets     = NULL;
+/** potencia de 2 */
+static size_t           nbuckets    = 0;
+static size_t           max_entries = 0;
+static unsigned         ttl         = 0;
+static unsigned         negative_ttl = 0;
+static unsigned         refresh_percent = 0;
+static unsigned         refresh_hits = 0;
+/** extremos de la lista de uso */
+static struct entry    *newest      = NULL;
+static struct entry    *oldest      = NULL;
+static struct dnscache_stats stats;
+
+static uint64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/** FNV-1a del nombre, el puerto y la familia */
+static uint32_t
+hash(const char *host, uint16_t port, int family) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) host; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    h = (h ^ (port & 0xff)) * 16777619u;
+    h = (h ^ (port >> 8))   * 16777619u;
+    h = (h ^ (unsigned) family) * 16777619u;
+    return h;
+}
+
+struct addrinfo *
+dnscache_copy(const struct addrinfo *list) {
+    struct addrinfo *ret = NULL, **tail = &ret;
+
+    for (; list != NULL; list = list->ai_next) {
+        if (list->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        struct node *n = malloc(sizeof(*n));
+        if (n == NULL) {
+            dnscache_free(ret);
+            return NULL;
+        }
+        n->ai           = *list;
+        n->ai.ai_addr   = (struct sockaddr *) &n->addr;
+        n->ai.ai_canonname = NULL;
+        n->ai.ai_next   = NULL;
+        memcpy(&n->addr, list->ai_addr, list->ai_addrlen);
+        *tail = &n->ai;
+        tail  = &n->ai.ai_next;
+    }
+    return ret;
+}
+
+void
+dnscache_free(struct addrinfo *list) {
+    while (list != NULL) {
+        struct addrinfo *next = list->ai_next;
+        // ai es el primer campo de node
+        free(list);
+        list = next;
+    }
+}
+
+/** saca `e' de la lista de uso */
+static void
+lru_unlink(struct entry *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        oldest = e->newer;
+    }
+    e->newer = e->older = NULL;
+}
+
+/** pone `e' como la más reciente */
+static void
+lru_push(struct entry *e) {
+    e->newer = NULL;
+    e->older = newest;
+    if (newest != NULL) {
+        newest->newer = e;
+    } else {
+        oldest = e;
+    }
+    newest = e;
+}
+
+/** puntero al enlace que apunta a la entrada, o al NULL final del bucket */
+static struct entry **
+find(const char *host, uint16_t port, int family, uint32_t h) {
+    struct entry **link = buckets + (h & (nbuckets - 1));
+
+    for (; *link != NULL; link = &(*link)->next) {
+        const struct entry *e = *link;
+        if (e->hash == h && e->port == port && e->family == family
+            && strcmp(e->host, host) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/** saca y libera la entrada a la que apunta `link' */
+static void
+remove_entry(struct entry **link) {
+    struct entry *e = *link;
+
+    *link = e->next;
+    lru_unlink(e);
+    dnscache_free(e->list);
+    free(e);
+    stats.entries--;
+}
+
+int
+dnscache_init(const struct dnscache_init *c) {
+    max_entries  = c->entries;
+    ttl          = c->ttl;
+    negative_ttl = c->negative_ttl;
+    refresh_percent = c->refresh_percent;
+    refresh_hits = c->refresh_hits;
+    if (max_entries == 0) {
+        return 0;
+    }
+
+    nbuckets = 1;
+    while (nbuckets < max_entries) {
+        nbuckets <<= 1;
+    }
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL) {
+        max_entries = nbuckets = 0;
+        return -1;
+    }
+    return 0;
+}
+
+bool
+dnscache_get(const char *host, uint16_t port, int family,
+             struct addrinfo **result, bool *refresh) {
+    bool ret = false;
+
+    *refresh = false;
+    if (max_entries == 0) {
+        return false;
+    }
+    const uint32_t h = hash(host, port, family);
+
+    pthread_mutex_lock(&lock);
+    const uint64_t now  = now_ms();
+    struct entry **link = find(host, port, family, h);
+    struct entry  *e    = *link;
+    if (e != NULL && e->expires <= now) {
+        remove_entry(link);
+        stats.expirations++;
+        e = NULL;
+    }
+    if (e == NULL) {
+        stats.misses++;
+        goto finally;
+    }
+
+    *result = NULL;
+    if (e->list != NULL) {
+        *result = dnscache_copy(e->list);
+        if (*result == NULL) {
+            // sin memoria: que lo resuelva el resolver
+            stats.misses++;
+            goto finally;
+        }
+    } else {
+        stats.negative_hits++;
+    }
+    stats.hits++;
+    lru_unlink(e);
+    lru_push(e);
+    ret = true;
+
+    e->uses++;
+    if (e->uses >= refresh_hits && e->refresh_at <= now) {
+        // la pide uno solo; si la renovación falla, vence como cualquiera
+        e->refresh_at = UINT64_MAX;
+        stats.refreshes++;
+        *refresh = true;
+    }
+
+finally:
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void
+dnscache_put(const char *host, uint16_t port, int family,
+             const struct addrinfo *list, unsigned record_ttl) {
+    if (max_entries == 0 || (list == NULL && negative_ttl == 0)) {
+        return;
+    }
+    const size_t hostlen = strlen(host) + 1;
+    struct entry *e = malloc(sizeof(*e) + hostlen);
+    if (e == NULL) {
+        return;
+    }
+    e->list = NULL;
+    if (list != NULL && (e->list = dnscache_copy(list)) == NULL) {
+        free(e);
+        return;
+    }
+    e->hash   = hash(host, port, family);
+    e->port   = port;
+    e->family = family;
+    memcpy(e->host, host, hostlen);
+
+    pthread_mutex_lock(&lock);
+    const uint64_t now = now_ms();
+    unsigned life = list != NULL ? ttl : negative_ttl;
+    if (record_ttl != 0 && record_ttl < life) {
+        life = record_ttl;
+    }
+    e->expires = now + life;
+    e->uses    = 0;
+    e->refresh_at = UINT64_MAX;
+    if (list != NULL && refresh_percent != 0) {
+        e->refresh_at = now + (uint64_t) life * refresh_percent / 100;
+    }
+
+    struct entry **link = find(host, port, family, e->hash);
+    if (*link != NULL) {
+        // otro hilo la resolvió al mismo tiempo: nos quedamos con la nueva
+        remove_entry(link);
+    } else if (stats.entries == max_entries) {
+        const bool expired = oldest->expires <= now;
+        remove_entry(find(oldest->host, oldest->port, oldest->family, oldest->hash));
+        if (expired) {
+            stats.expirations++;
+        } else {
+            stats.evictions++;
+        }
+    }
+    struct entry **bucket = buckets + (e->hash & (nbuckets - 1));
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(e);
+    stats.entries++;
+    pthread_mutex_unlock(&lock);
+}
+
+void
+dnscache_stats(struct dnscache_stats *s) {
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void
+dnscache_destroy(void) {
+    pthread_mutex_lock(&lock);
+    while (oldest != NULL) {
+        remove_entry(find(oldest->host, oldest->port, oldest->family, oldest->hash));
+    }
+    free(buckets);
+    buckets     = NULL;
+    nbuckets    = 0;
+    max_entries = 0;
+    pthread_mutex_unlock(&lock);
+}
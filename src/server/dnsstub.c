@@ -0,0 +1,1008 @@
+/**
+ * dnsstub.c - cliente DNS no bloqueante que corre en el selector
+ *
+ * Cada resolución (`struct lookup') lanza dos consultas (`struct query'), A y
+ * AAAA, en paralelo. Todas las consultas UDP de un hilo salen del mismo
+ * socket; las respuestas se asocian por id, servidor de origen y pregunta.
+ * Cada consulta tiene su temporizador para los reintentos, y su propio
+ * socket si tuvo que pasar a TCP.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../include/dnsstub.h"
+#include "../include/dnscache.h"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+#define DNS_PORT            53
+/** como MAXNS de la libc */
+#define MAX_NAMESERVERS     3
+/** máximo de un mensaje UDP sin EDNS (RFC 1035 4.2.1) */
+#define DNS_UDP_SIZE        512
+#define DNS_HEADER_SIZE     12
+/** máximo de un nombre codificado (RFC 1035 3.1) */
+#define DNS_NAME_SIZE       255
+
+#define DNS_TYPE_A          1
+#define DNS_TYPE_AAAA       28
+#define DNS_CLASS_IN        1
+
+#define DNS_FLAG_QR         0x8000
+#define DNS_FLAG_TC         0x0200
+#define DNS_FLAG_RD         0x0100
+#define DNS_RCODE_NOERROR   0
+#define DNS_RCODE_NXDOMAIN  3
+
+/** valores por defecto de `options' en resolv.conf(5) */
+#define DEFAULT_TIMEOUT     5
+#define MAX_TIMEOUT         30
+#define DEFAULT_ATTEMPTS    2
+#define MAX_ATTEMPTS        5
+
+/** direcciones que se guardan por familia */
+#define MAX_ADDRS           8
+/** buckets de la tabla de consultas por id. Potencia de 2 */
+#define ID_BUCKETS          256
+/** respuestas UDP que se leen por evento */
+#define READ_BATCH          16
+
+////////////////////////////////////////////////////////////////////////////////
+// CONFIGURACIÓN (sólo lectura luego de dnsstub_init)
+////////////////////////////////////////////////////////////////////////////////
+
+static struct sockaddr_storage servers[MAX_NAMESERVERS];
+static size_t                  nservers     = 0;
+/** ms a esperar a cada servidor */
+static unsigned                timeout      = DEFAULT_TIMEOUT * 1000;
+/** vueltas por todos los servidores */
+static unsigned                attempts     = DEFAULT_ATTEMPTS;
+static size_t                  max_lookups  = 0;
+
+/** una línea nombre/dirección de /etc/hosts */
+struct host_entry {
+    char                    *name;
+    struct sockaddr_storage  addr;
+};
+static struct host_entry      *hosts        = NULL;
+static size_t                  nhosts       = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+// ESTADO POR HILO
+////////////////////////////////////////////////////////////////////////////////
+
+struct lookup;
+
+struct query {
+    struct lookup          *lookup;
+    /** siguiente en el mismo bucket de ids */
+    struct query           *next;
+    uint16_t                id;
+    uint16_t                type;
+    /** esperando una respuesta (está en la tabla de ids) */
+    bool                    active;
+    /** envíos hechos, y a qué servidor fue el último */
+    unsigned                tries;
+    unsigned                server;
+    struct selector_timer   timer;
+
+    /** -1 si no está consultando por TCP */
+    int                     tcp_fd;
+    /** largo (2 bytes) más el mensaje, a enviar y luego recibido */
+    uint8_t                *tcp_buf;
+    size_t                  tcp_len;
+    size_t                  tcp_done;
+};
+
+struct lookup {
+    struct dnsstub         *stub;
+    struct lookup          *prev, *next;
+
+    /** a quién entregarle el resultado */
+    dnsstub_callback        done;
+    void                   *data;
+    char                    host[DNS_NAME_SIZE + 1];
+    uint16_t                port;
+
+    struct query            queries[2];
+    unsigned                pending;
+
+    /** alguna respuesta dijo que el nombre no existe */
+    bool                    nxdomain;
+    /** consultas respondidas sin error (aunque no tengan direcciones) */
+    unsigned                answered;
+    /** menor TTL de las direcciones, en segundos */
+    uint32_t                ttl;
+    struct in_addr          v4[MAX_ADDRS];
+    size_t                  n4;
+    struct in6_addr         v6[MAX_ADDRS];
+    size_t                  n6;
+};
+
+struct dnsstub {
+    fd_selector              s;
+    /** socket UDP; si es IPv6 también llega a los servidores IPv4 */
+    int                      fd;
+    /** `servers' en la familia del socket. ss_family 0 si no se puede usar */
+    struct sockaddr_storage  dest[MAX_NAMESERVERS];
+    struct query            *ids[ID_BUCKETS];
+    struct lookup           *lookups;
+    size_t                   nlookups;
+    /** estado del generador de ids */
+    uint64_t                 seed;
+};
+
+/** instancia del hilo. Se libera al desregistrar su socket */
+static _Thread_local struct dnsstub *stub = NULL;
+
+static void stub_read(struct selector_key *key);
+static void stub_close(struct selector_key *key);
+static void tcp_write(struct selector_key *key);
+static void tcp_read(struct selector_key *key);
+static void tcp_close(struct selector_key *key);
+
+static const struct fd_handler stub_handler = {
+    .handle_read  = stub_read,
+    .handle_close = stub_close,
+};
+
+static const struct fd_handler tcp_handler = {
+    .handle_read  = tcp_read,
+    .handle_write = tcp_write,
+    .handle_close = tcp_close,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// CONFIGURACIÓN
+////////////////////////////////////////////////////////////////////////////////
+
+/** interpreta una dirección literal. false si no lo es */
+static bool
+parse_addr(const char *s, uint16_t port, struct sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in  *in  = (struct sockaddr_in *) addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+
+    if (inet_pton(AF_INET, s, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port   = htons(port);
+        return true;
+    }
+    if (inet_pton(AF_INET6, s, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port   = htons(port);
+        return true;
+    }
+    return false;
+}
+
+static socklen_t
+addr_len(const struct sockaddr_storage *addr) {
+    return addr->ss_family == AF_INET ? sizeof(struct sockaddr_in)
+                                      : sizeof(struct sockaddr_in6);
+}
+
+/** `options timeout:n attempts:n' */
+static void
+parse_option(const char *opt) {
+    unsigned n;
+
+    if (sscanf(opt, "timeout:%u", &n) == 1) {
+        timeout = (n < 1 ? 1 : n > MAX_TIMEOUT ? MAX_TIMEOUT : n) * 1000;
+    } else if (sscanf(opt, "attempts:%u", &n) == 1) {
+        attempts = n < 1 ? 1 : n > MAX_ATTEMPTS ? MAX_ATTEMPTS : n;
+    }
+}
+
+static void
+parse_resolv_conf(const char *path) {
+    char line[512];
+    char *save;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "#;\n")] = 0;
+        const char *key = strtok_r(line, " \t", &save);
+        if (key == NULL) {
+            continue;
+        }
+        if (strcmp(key, "nameserver") == 0) {
+            const char *value = strtok_r(NULL, " \t", &save);
+            if (value != NULL && nservers < MAX_NAMESERVERS
+                && parse_addr(value, DNS_PORT, servers + nservers)) {
+                nservers++;
+            }
+        } else if (strcmp(key, "options") == 0) {
+            for (const char *opt; (opt = strtok_r(NULL, " \t", &save)) != NULL; ) {
+                parse_option(opt);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static int
+parse_hosts(const char *path) {
+    char line[1024];
+    char *save;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct sockaddr_storage addr;
+
+        line[strcspn(line, "#\n")] = 0;
+        const char *value = strtok_r(line, " \t", &save);
+        if (value == NULL || !parse_addr(value, 0, &addr)) {
+            continue;
+        }
+        for (const char *name; (name = strtok_r(NULL, " \t", &save)) != NULL; ) {
+            struct host_entry *aux = realloc(hosts, (nhosts + 1) * sizeof(*hosts));
+            if (aux == NULL) {
+                fclose(f);
+                return -1;
+            }
+            hosts = aux;
+            hosts[nhosts].name = malloc(strlen(name) + 1);
+            if (hosts[nhosts].name == NULL) {
+                fclose(f);
+                return -1;
+            }
+            strcpy(hosts[nhosts].name, name);
+            hosts[nhosts].addr = addr;
+            nhosts++;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int
+dnsstub_init(const char *resolv_conf, const char *hosts_path, size_t lookups) {
+    max_lookups = lookups;
+    parse_resolv_conf(resolv_conf != NULL ? resolv_conf : "/etc/resolv.conf");
+    if (nservers == 0) {
+        parse_addr("127.0.0.1", DNS_PORT, servers);
+        nservers = 1;
+    }
+    return parse_hosts(hosts_path != NULL ? hosts_path : "/etc/hosts");
+}
+
+void
+dnsstub_destroy(void) {
+    for (size_t i = 0; i < nhosts; i++) {
+        free(hosts[i].name);
+    }
+    free(hosts);
+    hosts    = NULL;
+    nhosts   = 0;
+    nservers = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MENSAJES
+////////////////////////////////////////////////////////////////////////////////
+
+static uint16_t
+get16(const uint8_t *p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint8_t *
+put16(uint8_t *p, uint16_t x) {
+    *p++ = (uint8_t) (x >> 8);
+    *p++ = (uint8_t) x;
+    return p;
+}
+
+/**
+ * arma la consulta de tipo `type' por `host' en `buf' (al menos
+ * DNS_UDP_SIZE bytes). Retorna su largo, o 0 si el nombre no es válido.
+ */
+static size_t
+query_build(uint8_t *buf, uint16_t id, const char *host, uint16_t type) {
+    uint8_t *p = buf;
+
+    p = put16(p, id);
+    p = put16(p, DNS_FLAG_RD);
+    p = put16(p, 1);    // QDCOUNT
+    p = put16(p, 0);    // ANCOUNT
+    p = put16(p, 0);    // NSCOUNT
+    p = put16(p, 0);    // ARCOUNT
+
+    const uint8_t *name = p;
+    for (const char *label = host; *label != 0; ) {
+        const size_t len = strcspn(label, ".");
+        if (len == 0 || len > 63 || (p - name) + 1 + len + 1 > DNS_NAME_SIZE) {
+            return 0;
+        }
+        *p++ = (uint8_t) len;
+        memcpy(p, label, len);
+        p     += len;
+        label += len;
+        if (*label == '.') {
+            label++;    // tolera el punto final
+        }
+    }
+    if (p == name) {
+        return 0;
+    }
+    *p++ = 0;
+    p = put16(p, type);
+    p = put16(p, DNS_CLASS_IN);
+    return (size_t) (p - buf);
+}
+
+/** saltea el nombre en `off'. Retorna dónde termina, o 0 si está mal formado */
+static size_t
+name_skip(const uint8_t *p, size_t n, size_t off) {
+    while (off < n) {
+        const uint8_t len = p[off];
+        if (len == 0) {
+            return off + 1;
+        }
+        if ((len & 0xc0) == 0xc0) {
+            return off + 2 <= n ? off + 2 : 0;   // puntero de compresión
+        }
+        if ((len & 0xc0) != 0) {
+            return 0;
+        }
+        off += 1 + len;
+    }
+    return 0;
+}
+
+/** el nombre sin comprimir en `off' es `host' (sin importar mayúsculas)? */
+static bool
+name_equal(const uint8_t *p, size_t n, size_t off, const char *host) {
+    const char *c = host;
+
+    while (off < n) {
+        const uint8_t len = p[off++];
+        if (len == 0) {
+            return *c == 0 || strcmp(c, ".") == 0;
+        }
+        if ((len & 0xc0) != 0 || off + len > n) {
+            return false;
+        }
+        if (c != host && *c++ != '.') {
+            return false;
+        }
+        for (uint8_t i = 0; i < len; i++, c++) {
+            if (*c == 0 || tolower((unsigned char) *c) != tolower(p[off + i])) {
+                return false;
+            }
+        }
+        off += len;
+    }
+    return false;
+}
+
+/** qué hacer con una respuesta */
+enum response {
+    /** no es para esta consulta: seguir esperando */
+    RESPONSE_IGNORE,
+    /** el servidor no pudo: probar con el siguiente */
+    RESPONSE_NEXT,
+    /** no entró en UDP: repetirla por TCP */
+    RESPONSE_TRUNCATED,
+    /** consulta terminada (con o sin direcciones) */
+    RESPONSE_DONE,
+};
+
+/** agrega una dirección de tipo `type' a la resolución */
+static void
+lookup_add(struct lookup *l, uint16_t type, const uint8_t *rdata, uint16_t rdlen, uint32_t ttl) {
+    if (type == DNS_TYPE_A && rdlen == 4 && l->n4 < MAX_ADDRS) {
+        memcpy(l->v4 + l->n4++, rdata, 4);
+    } else if (type == DNS_TYPE_AAAA && rdlen == 16 && l->n6 < MAX_ADDRS) {
+        memcpy(l->v6 + l->n6++, rdata, 16);
+    } else {
+        return;
+    }
+    if (ttl < l->ttl) {
+        l->ttl = ttl;
+    }
+}
+
+static enum response
+response_parse(struct query *q, const uint8_t *p, size_t n, bool tcp) {
+    struct lookup *l = q->lookup;
+
+    if (n < DNS_HEADER_SIZE || get16(p) != q->id) {
+        return RESPONSE_IGNORE;
+    }
+    const uint16_t flags = get16(p + 2);
+    if ((flags & DNS_FLAG_QR) == 0 || ((flags >> 11) & 0xf) != 0 || get16(p + 4) != 1) {
+        return RESPONSE_IGNORE;
+    }
+    // la pregunta tiene que ser la nuestra
+    size_t off = DNS_HEADER_SIZE;
+    if (!name_equal(p, n, off, l->host) || (off = name_skip(p, n, off)) == 0
+        || off + 4 > n || get16(p + off) != q->type || get16(p + off + 2) != DNS_CLASS_IN) {
+        return RESPONSE_IGNORE;
+    }
+    off += 4;
+
+    if ((flags & DNS_FLAG_TC) != 0 && !tcp) {
+        return RESPONSE_TRUNCATED;
+    }
+    switch (flags & 0xf) {
+        case DNS_RCODE_NOERROR:
+            break;
+        case DNS_RCODE_NXDOMAIN:
+            l->nxdomain = true;
+            return RESPONSE_DONE;
+        default:
+            // SERVFAIL, REFUSED, etc.
+            return RESPONSE_NEXT;
+    }
+
+    // respuestas: alcanzan las del tipo pedido; los CNAME que lleven a
+    // ellas vienen antes y se saltean
+    const uint16_t ancount = get16(p + 6);
+    for (uint16_t i = 0; i < ancount; i++) {
+        if ((off = name_skip(p, n, off)) == 0 || off + 10 > n) {
+            break;
+        }
+        const uint16_t type  = get16(p + off);
+        const uint16_t class = get16(p + off + 2);
+        const uint32_t ttl   = (uint32_t) get16(p + off + 4) << 16 | get16(p + off + 6);
+        const uint16_t rdlen = get16(p + off + 8);
+        off += 10;
+        if (off + rdlen > n) {
+            break;
+        }
+        if (class == DNS_CLASS_IN && type == q->type) {
+            lookup_add(l, type, p + off, rdlen, ttl);
+        }
+        off += rdlen;
+    }
+    l->answered++;
+    return RESPONSE_DONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSULTAS
+////////////////////////////////////////////////////////////////////////////////
+
+static struct query **
+id_bucket(struct dnsstub *d, uint16_t id) {
+    return d->ids + (id & (ID_BUCKETS - 1));
+}
+
+static struct query *
+id_find(struct dnsstub *d, uint16_t id) {
+    struct query *q = *id_bucket(d, id);
+    while (q != NULL && q->id != id) {
+        q = q->next;
+    }
+    return q;
+}
+
+/** id al azar que no esté en uso (xorshift64*) */
+static uint16_t
+id_new(struct dnsstub *d) {
+    uint16_t id;
+    do {
+        d->seed ^= d->seed >> 12;
+        d->seed ^= d->seed << 25;
+        d->seed ^= d->seed >> 27;
+        id = (uint16_t) ((d->seed * 2685821657736338717ULL) >> 48);
+    } while (id_find(d, id) != NULL);
+    return id;
+}
+
+static void
+id_remove(struct dnsstub *d, struct query *q) {
+    for (struct query **link = id_bucket(d, q->id); *link != NULL; link = &(*link)->next) {
+        if (*link == q) {
+            *link = q->next;
+            break;
+        }
+    }
+    q->next = NULL;
+}
+
+/** cierra la conexión TCP de la consulta, si la tiene */
+static void
+query_tcp_end(struct query *q) {
+    if (q->tcp_fd != -1) {
+        // tcp_close cierra el fd y lo marca
+        selector_unregister_fd(q->lookup->stub->s, q->tcp_fd);
+    }
+    free(q->tcp_buf);
+    q->tcp_buf = NULL;
+}
+
+static void lookup_finish(struct lookup *l);
+
+/** la consulta terminó, con o sin respuesta */
+static void
+query_finish(struct query *q) {
+    struct lookup  *l = q->lookup;
+    struct dnsstub *d = l->stub;
+
+    selector_timer_cancel(d->s, &q->timer);
+    query_tcp_end(q);
+    id_remove(d, q);
+    q->active = false;
+    if (--l->pending == 0) {
+        lookup_finish(l);
+    }
+}
+
+static void query_timeout(fd_selector s, void *data);
+
+/**
+ * envía la consulta por UDP al próximo servidor que toque y espera su
+ * respuesta. false si ya se agotaron los intentos.
+ */
+static bool
+query_send(struct query *q) {
+    struct lookup  *l = q->lookup;
+    struct dnsstub *d = l->stub;
+    uint8_t buf[DNS_UDP_SIZE];
+
+    const size_t len = query_build(buf, q->id, l->host, q->type);
+    while (len > 0 && q->tries < attempts * nservers) {
+        q->server = q->tries % nservers;
+        q->tries++;
+
+        const struct sockaddr_storage *to = d->dest + q->server;
+        if (to->ss_family != 0
+            && sendto(d->fd, buf, len, 0, (const struct sockaddr *) to, addr_len(to)) == (ssize_t) len) {
+            selector_timer_add(d->s, &q->timer, timeout, query_timeout, q);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** pasa al próximo servidor, o da la consulta por terminada sin respuesta */
+static void
+query_retry(struct query *q) {
+    query_tcp_end(q);
+    if (!query_send(q)) {
+        query_finish(q);
+    }
+}
+
+/** repite la consulta por TCP al mismo servidor que la truncó */
+static void
+query_tcp(struct query *q) {
+    struct lookup  *l = q->lookup;
+    struct dnsstub *d = l->stub;
+    const struct sockaddr_storage *to = servers + q->server;
+
+    q->tcp_buf = malloc(2 + UINT16_MAX);
+    if (q->tcp_buf == NULL) {
+        goto fail;
+    }
+    const size_t len = query_build(q->tcp_buf + 2, q->id, l->host, q->type);
+    put16(q->tcp_buf, (uint16_t) len);
+    q->tcp_len     = 2 + len;
+    q->tcp_done    = 0;
+
+    const int fd = socket(to->ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        goto fail;
+    }
+    if (selector_fd_set_nio(fd) == -1
+        || (connect(fd, (const struct sockaddr *) to, addr_len(to)) == -1 && errno != EINPROGRESS)
+        || SELECTOR_SUCCESS != selector_register(d->s, fd, &tcp_handler, OP_WRITE, q)) {
+        close(fd);
+        goto fail;
+    }
+    q->tcp_fd = fd;
+    selector_timer_add(d->s, &q->timer, timeout, query_timeout, q);
+    return;
+
+fail:
+    query_retry(q);
+}
+
+/** procesa una respuesta a `q' */
+static void
+query_response(struct query *q, const uint8_t *p, size_t n, bool tcp) {
+    switch (response_parse(q, p, n, tcp)) {
+        case RESPONSE_IGNORE:
+            if (tcp) {
+                // por TCP no va a llegar otra
+                query_retry(q);
+            }
+            break;
+        case RESPONSE_NEXT:
+            query_retry(q);
+            break;
+        case RESPONSE_TRUNCATED:
+            query_tcp(q);
+            break;
+        case RESPONSE_DONE:
+            query_finish(q);
+            break;
+    }
+}
+
+/** venció la espera de una respuesta: al próximo servidor */
+static void
+query_timeout(fd_selector s, void *data) {
+    query_retry(data);
+}
+
+static void
+query_start(struct lookup *l, struct query *q, uint16_t type) {
+    struct dnsstub *d = l->stub;
+
+    q->lookup = l;
+    q->type   = type;
+    q->tcp_fd = -1;
+    q->id     = id_new(d);
+    q->active = true;
+    struct query **bucket = id_bucket(d, q->id);
+    q->next = *bucket;
+    *bucket = q;
+    if (!query_send(q)) {
+        // no se pudo enviar a nadie; la otra consulta puede seguir en
+        // curso, así que termina en la próxima iteración como un timeout
+        selector_timer_add(d->s, &q->timer, 0, query_timeout, q);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HANDLERS
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return false;
+    }
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *) a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *) b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *) a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *) b;
+    return x->sin6_port == y->sin6_port
+        && memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+}
+
+static void
+stub_read(struct selector_key *key) {
+    struct dnsstub *d = key->data;
+    uint8_t buf[DNS_UDP_SIZE];
+
+    for (unsigned i = 0; i < READ_BATCH; i++) {
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        const ssize_t n = recvfrom(key->fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &from_len);
+        if (n < 0) {
+            break; // no hay más (o falló): esperamos otro evento
+        }
+        if (n < DNS_HEADER_SIZE) {
+            continue;
+        }
+        // sólo se acepta del servidor al que se le preguntó
+        struct query *q = id_find(d, get16(buf));
+        if (q != NULL && q->tcp_fd == -1 && addr_equal(&from, d->dest + q->server)) {
+            query_response(q, buf, (size_t) n, false);
+        }
+    }
+}
+
+static void
+tcp_write(struct selector_key *key) {
+    struct query *q = key->data;
+
+    const ssize_t n = send(key->fd, q->tcp_buf + q->tcp_done, q->tcp_len - q->tcp_done, MSG_NOSIGNAL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // incluye no haber podido conectarse
+            query_retry(q);
+        }
+        return;
+    }
+    q->tcp_done += n;
+    if (q->tcp_done == q->tcp_len) {
+        q->tcp_done    = 0;
+        q->tcp_len     = 2;     // hasta leer el largo
+        selector_set_interest_key(key, OP_READ);
+    }
+}
+
+static void
+tcp_read(struct selector_key *key) {
+    struct query *q = key->data;
+
+    const ssize_t n = recv(key->fd, q->tcp_buf + q->tcp_done, q->tcp_len - q->tcp_done, 0);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            query_retry(q);
+        }
+        return;
+    }
+    q->tcp_done += n;
+    if (q->tcp_done == 2) {
+        q->tcp_len = 2 + get16(q->tcp_buf);
+    }
+    if (q->tcp_done == q->tcp_len && q->tcp_len > 2) {
+        query_response(q, q->tcp_buf + 2, q->tcp_len - 2, true);
+    }
+}
+
+static void
+tcp_close(struct selector_key *key) {
+    struct query *q = key->data;
+
+    close(key->fd);
+    q->tcp_fd = -1;
+}
+
+/**
+ * se destruye el selector (o falló el registro): las resoluciones en curso
+ * terminan como fallidas. Hay que avisarles igual: pueden tener pedidos de
+ * otros hilos esperando (ver resolver.c)
+ */
+static void
+stub_close(struct selector_key *key) {
+    struct dnsstub *d = key->data;
+
+    while (d->lookups != NULL) {
+        struct lookup *l = d->lookups;
+        for (size_t i = 0; i < N(l->queries); i++) {
+            struct query *q = l->queries + i;
+            if (q->active) {
+                selector_timer_cancel(d->s, &q->timer);
+                query_tcp_end(q);
+            }
+        }
+        d->lookups = l->next;
+        if (d->lookups != NULL) {
+            d->lookups->prev = NULL;
+        }
+        d->nlookups--;
+
+        const dnsstub_callback done = l->done;
+        void *data = l->data;
+        free(l);
+        done(data, NULL);
+    }
+    close(key->fd);
+    if (stub == d) {
+        stub = NULL;
+    }
+    free(d);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RESOLUCIONES
+////////////////////////////////////////////////////////////////////////////////
+
+/** la instancia del hilo, creándola si hace falta. NULL si no se pudo */
+static struct dnsstub *
+stub_get(fd_selector s) {
+    if (stub != NULL) {
+        return stub->s == s ? stub : NULL;
+    }
+    struct dnsstub *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->s = s;
+    // con un socket IPv6 que acepte direcciones IPv4 mapeadas alcanza para
+    // cualquier servidor; si no hay IPv6 sólo se usan los IPv4
+    int family = AF_INET6;
+    d->fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (d->fd == -1 || setsockopt(d->fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) == -1) {
+        if (d->fd != -1) {
+            close(d->fd);
+        }
+        family = AF_INET;
+        d->fd  = socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    if (d->fd == -1 || selector_fd_set_nio(d->fd) == -1) {
+        goto fail;
+    }
+    for (size_t i = 0; i < nservers; i++) {
+        const struct sockaddr_storage *from = servers + i;
+        struct sockaddr_storage *to = d->dest + i;
+        if (from->ss_family == family) {
+            *to = *from;
+        } else if (family == AF_INET6) {
+            // ::ffff:a.b.c.d
+            const struct sockaddr_in *in  = (const struct sockaddr_in *) from;
+            struct sockaddr_in6      *in6 = (struct sockaddr_in6 *) to;
+            memset(in6, 0, sizeof(*in6));
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port   = in->sin_port;
+            in6->sin6_addr.s6_addr[10] = in6->sin6_addr.s6_addr[11] = 0xff;
+            memcpy(in6->sin6_addr.s6_addr + 12, &in->sin_addr, 4);
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    d->seed = (uint64_t) ts.tv_nsec ^ ((uint64_t) ts.tv_sec << 32) ^ (uint64_t) (uintptr_t) d;
+    if (d->seed == 0) {
+        d->seed = 1;
+    }
+    if (SELECTOR_SUCCESS != selector_register(s, d->fd, &stub_handler, OP_READ, d)) {
+        goto fail;
+    }
+    stub = d;
+    return d;
+
+fail:
+    if (d->fd != -1) {
+        close(d->fd);
+    }
+    free(d);
+    return NULL;
+}
+
+/** arma una lista temporal con las direcciones de `l', primero las IPv4 */
+static struct addrinfo *
+lookup_list(const struct lookup *l, struct addrinfo ai[2 * MAX_ADDRS],
+            struct sockaddr_storage addrs[2 * MAX_ADDRS]) {
+    struct addrinfo *ret = NULL, **tail = &ret;
+    size_t n = 0;
+
+    for (size_t i = 0; i < l->n4 + l->n6; i++, n++) {
+        struct sockaddr_storage *addr = addrs + n;
+        memset(addr, 0, sizeof(*addr));
+        memset(ai + n, 0, sizeof(ai[n]));
+        if (i < l->n4) {
+            struct sockaddr_in *in = (struct sockaddr_in *) addr;
+            in->sin_family = AF_INET;
+            in->sin_port   = htons(l->port);
+            in->sin_addr   = l->v4[i];
+        } else {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port   = htons(l->port);
+            in6->sin6_addr   = l->v6[i - l->n4];
+        }
+        ai[n].ai_family   = addr->ss_family;
+        ai[n].ai_socktype = SOCK_STREAM;
+        ai[n].ai_protocol = IPPROTO_TCP;
+        ai[n].ai_addrlen  = addr_len(addr);
+        ai[n].ai_addr     = (struct sockaddr *) addr;
+        *tail = ai + n;
+        tail  = &ai[n].ai_next;
+    }
+    return ret;
+}
+
+/** terminaron las dos consultas: entrega el resultado y avisa */
+static void
+lookup_finish(struct lookup *l) {
+    struct dnsstub *d = l->stub;
+    struct addrinfo ai[2 * MAX_ADDRS];
+    struct sockaddr_storage addrs[2 * MAX_ADDRS];
+
+    struct addrinfo *list = lookup_list(l, ai, addrs);
+    if (list != NULL) {
+        // un TTL 0 se recuerda lo mínimo posible
+        const uint64_t ttl = l->ttl == 0 ? 1 : (uint64_t) l->ttl * 1000;
+        dnscache_put(l->host, l->port, AF_UNSPEC, list, ttl > UINT32_MAX ? UINT32_MAX : (unsigned) ttl);
+    } else if (l->nxdomain || l->answered == N(l->queries)) {
+        // no existe, o existe pero sin direcciones; si algún servidor no
+        // respondió no sabemos nada
+        dnscache_put(l->host, l->port, AF_UNSPEC, NULL, 0);
+    }
+
+    if (l->prev != NULL) {
+        l->prev->next = l->next;
+    } else {
+        d->lookups = l->next;
+    }
+    if (l->next != NULL) {
+        l->next->prev = l->prev;
+    }
+    d->nlookups--;
+
+    // `done' puede lanzar otra resolución: liberamos antes
+    const dnsstub_callback done = l->done;
+    void *data = l->data;
+    free(l);
+    done(data, list);
+}
+
+/** /etc/hosts o dirección literal: entrega el resultado. false si no es ninguno */
+static bool
+resolve_local(const char *host, uint16_t port, dnsstub_callback done, void *data) {
+    struct sockaddr_storage addrs[2 * MAX_ADDRS];
+    struct addrinfo ai[2 * MAX_ADDRS];
+    size_t n = 0;
+
+    if (parse_addr(host, port, addrs)) {
+        n = 1;
+    } else {
+        // primero las IPv4, como las respuestas de los servidores
+        for (int pass = 0; pass < 2; pass++) {
+            const int family = pass == 0 ? AF_INET : AF_INET6;
+            for (size_t i = 0; i < nhosts && n < N(addrs); i++) {
+                if (hosts[i].addr.ss_family == family && strcasecmp(hosts[i].name, host) == 0) {
+                    addrs[n] = hosts[i].addr;
+                    if (family == AF_INET) {
+                        ((struct sockaddr_in *) (addrs + n))->sin_port = htons(port);
+                    } else {
+                        ((struct sockaddr_in6 *) (addrs + n))->sin6_port = htons(port);
+                    }
+                    n++;
+                }
+            }
+        }
+    }
+    if (n == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        memset(ai + i, 0, sizeof(ai[i]));
+        ai[i].ai_family   = addrs[i].ss_family;
+        ai[i].ai_socktype = SOCK_STREAM;
+        ai[i].ai_protocol = IPPROTO_TCP;
+        ai[i].ai_addrlen  = addr_len(addrs + i);
+        ai[i].ai_addr     = (struct sockaddr *) (addrs + i);
+        ai[i].ai_next     = i + 1 < n ? ai + i + 1 : NULL;
+    }
+    done(data, ai);
+    return true;
+}
+
+bool
+dnsstub_resolve(fd_selector s, const char *host, uint16_t port,
+                dnsstub_callback done, void *data) {
+    uint8_t buf[DNS_UDP_SIZE];
+
+    if (resolve_local(host, port, done, data)) {
+        return true;
+    }
+    if (query_build(buf, 0, host, DNS_TYPE_A) == 0) {
+        // nombre inválido: como si no existiera
+        done(data, NULL);
+        return true;
+    }
+
+    struct dnsstub *d = stub_get(s);
+    if (d == NULL || d->nlookups >= max_lookups) {
+        return false;
+    }
+    struct lookup *l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        return false;
+    }
+    l->stub   = d;
+    l->done   = done;
+    l->data   = data;
+    l->port   = port;
+    l->ttl    = UINT32_MAX;
+    strcpy(l->host, host);  // query_build validó el largo
+    l->pending = N(l->queries);
+    l->next = d->lookups;
+    if (d->lookups != NULL) {
+        d->lookups->prev = l;
+    }
+    d->lookups = l;
+    d->nlookups++;
+
+    query_start(l, l->queries + 0, DNS_TYPE_A);
+    query_start(l, l->queries + 1, DNS_TYPE_AAAA);
+    return true;
+}
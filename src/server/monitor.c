@@ -86,6 +86,10 @@ target(const uint8_t c, struct monitor_parser *p) {
                 case monitor_target_get_transfered:
                 case monitor_target_get_proxyusers:
                 case monitor_target_get_adminusers:
+                case monitor_target_get_loop_stats:
+                case monitor_target_get_dns_cache:
+                case monitor_target_get_addr_scores:
+                case monitor_target_get_session_pool:
 					p->monitor->target.target_get = c;
                     next = monitor_done;
                     break;
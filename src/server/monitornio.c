@@ -8,6 +8,10 @@
 #include "../include/monitor.h"
 #include "../include/monitornio.h"
 #include "../include/socks5nio.h"
+#include "../include/workers.h"
+#include "../include/dnscache.h"
+#include "../include/scoreboard.h"
+#include "../include/resolver.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -210,6 +214,84 @@ monitor_is_admin(char *token) {
     return false;
 }
 
+/** tamaño de un histograma serializado (ver monitor.h) */
+#define HIST_WIRE_SIZE ((3 + SELECTOR_HIST_BUCKETS) * sizeof(uint64_t))
+
+static uint8_t *
+put_uint64(uint8_t *p, const uint64_t x) {
+    for (int i = 7; i >= 0; i--) {
+        *p++ = (uint8_t) (x >> (8 * i));
+    }
+    return p;
+}
+
+static uint8_t *
+put_hist(uint8_t *p, const struct selector_hist *h) {
+    p = put_uint64(p, h->count);
+    p = put_uint64(p, h->sum);
+    p = put_uint64(p, h->max);
+    for (unsigned i = 0; i < SELECTOR_HIST_BUCKETS; i++) {
+        p = put_uint64(p, h->buckets[i]);
+    }
+    return p;
+}
+
+// entrega las mediciones del event loop de todos los selectores (ver monitor.h)
+static uint16_t monitor_get_loop_stats(fd_selector s, uint8_t data[6 * HIST_WIRE_SIZE]) {
+    struct selector_loop_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    selector_loop_stats(s, &stats);
+    workers_loop_stats(&stats);
+
+    uint8_t *p = data;
+    p = put_hist(p, &stats.wait_ns);
+    p = put_hist(p, &stats.dispatch_ns);
+    p = put_hist(p, &stats.events);
+    p = put_hist(p, &stats.read_ns);
+    p = put_hist(p, &stats.write_ns);
+    p = put_hist(p, &stats.block_ns);
+    return (uint16_t) (p - data);
+}
+
+/** tamaño de la respuesta de los contadores del cache de DNS (ver monitor.h) */
+#define DNS_CACHE_WIRE_SIZE (8 * sizeof(uint64_t))
+
+// entrega los contadores del cache de DNS (ver monitor.h)
+static uint16_t monitor_get_dns_cache(uint8_t data[DNS_CACHE_WIRE_SIZE]) {
+    struct dnscache_stats stats;
+    dnscache_stats(&stats);
+
+    uint8_t *p = data;
+    p = put_uint64(p, stats.hits);
+    p = put_uint64(p, stats.negative_hits);
+    p = put_uint64(p, stats.misses);
+    p = put_uint64(p, stats.evictions);
+    p = put_uint64(p, stats.expirations);
+    p = put_uint64(p, stats.entries);
+    p = put_uint64(p, resolver_coalesced());
+    p = put_uint64(p, stats.refreshes);
+    return (uint16_t) (p - data);
+}
+
+/** tamaño de la respuesta de los contadores del pool de sesiones (ver monitor.h) */
+#define SESSION_POOL_WIRE_SIZE (4 * sizeof(uint64_t))
+
+// entrega los contadores del pool de sesiones (ver monitor.h)
+static uint16_t monitor_get_session_pool(uint8_t data[SESSION_POOL_WIRE_SIZE]) {
+    struct socks5_pool_stats stats;
+    socksv5_pool_stats(&stats);
+
+    uint8_t *p = data;
+    p = put_uint64(p, stats.in_use);
+    p = put_uint64(p, stats.free);
+    p = put_uint64(p, stats.peak);
+    p = put_uint64(p, stats.bytes);
+    return (uint16_t) (p - data);
+}
+
+// lo que entra en la respuesta: el buffer de escritura menos STATUS y DLEN
+#define ADDR_SCORES_WIRE_SIZE (0xffff - 3)
+
 static void monitor_finish(struct selector_key* key);
 static void monitor_process(struct selector_key *key, struct monitor_st *d);
 
@@ -304,6 +386,46 @@ monitor_process(struct selector_key *key, struct monitor_st *d) {
                     d->status = monitor_status_succeeded;
                     break;
                 }
+                case monitor_target_get_loop_stats: {
+                    data = malloc(6 * HIST_WIRE_SIZE);
+                    if (data == NULL) {
+                        d->status = monitor_status_server_error;
+                        break;
+                    }
+                    dlen = monitor_get_loop_stats(key->s, data);
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_dns_cache: {
+                    data = malloc(DNS_CACHE_WIRE_SIZE);
+                    if (data == NULL) {
+                        d->status = monitor_status_server_error;
+                        break;
+                    }
+                    dlen = monitor_get_dns_cache(data);
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_addr_scores: {
+                    data = malloc(ADDR_SCORES_WIRE_SIZE);
+                    if (data == NULL) {
+                        d->status = monitor_status_server_error;
+                        break;
+                    }
+                    dlen = (uint16_t) scoreboard_dump(data, ADDR_SCORES_WIRE_SIZE);
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_session_pool: {
+                    data = malloc(SESSION_POOL_WIRE_SIZE);
+                    if (data == NULL) {
+                        d->status = monitor_status_server_error;
+                        break;
+                    }
+                    dlen = monitor_get_session_pool(data);
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
                 default: {
                     d->status = monitor_status_invalid_target;
                     break;
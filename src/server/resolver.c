@@ -0,0 +1,385 @@
+/**
+ * resolver.c - pool de hilos que resuelven nombres con getaddrinfo
+ *
+ * Los pedidos de un mismo nombre y puerto que llegan mientras se resuelve se
+ * suman como `struct waiter' a la resolución en curso (`struct flight'), de
+ * cualquier hilo que sean: cuando termina se notifica a todos juntos.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "../include/resolver.h"
+#include "../include/dnscache.h"
+#include "../include/dnsstub.h"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+/** un pedido esperando una resolución */
+struct waiter {
+    struct waiter      *next;
+    /** a quién notificar al terminar, y dónde dejar el resultado */
+    fd_selector         s;
+    int                 fd;
+    struct addrinfo   **result;
+    /** se pone en true si la resolución no se pudo iniciar (ver flight_start) */
+    bool               *busy;
+};
+
+/** una resolución en curso */
+struct flight {
+    /** siguiente en el mismo bucket */
+    struct flight      *next;
+    struct waiter      *waiters;
+    uint16_t            port;
+    /** copia: la sesión puede reusar sus buffers mientras tanto */
+    char                host[];
+};
+
+/**
+ * resoluciones en curso, por nombre y puerto. Caben tantas como pedidos
+ * en la cola (o resoluciones por selector), así que alcanza con una tabla
+ * fija. Tiene su propio lock: no se toma junto con el de la cola.
+ */
+static struct flight       *flights[1024];
+static pthread_mutex_t      flights_lock = PTHREAD_MUTEX_INITIALIZER;
+/** pedidos que se sumaron a una resolución en curso */
+static uint64_t             coalesced    = 0;
+
+/** pedido de resolución encolado */
+struct resolver_job {
+    struct flight      *flight;
+    char                service[6];
+};
+
+/**
+ * cola circular de `size' pedidos. Tanto los selectores (que encolan) como
+ * los hilos del pool (que desencolan) son varios, así que alcanza con un
+ * mutex: cada pedido es una resolución DNS, órdenes de magnitud más cara.
+ */
+static struct resolver_job *jobs    = NULL;
+static size_t               size    = 0;
+static size_t               head    = 0;
+static size_t               len     = 0;
+static bool                 stopping = false;
+static pthread_mutex_t      lock    = PTHREAD_MUTEX_INITIALIZER;
+/** hay pedidos en la cola o hay que terminar */
+static pthread_cond_t       ready   = PTHREAD_COND_INITIALIZER;
+
+static pthread_t           *threads = NULL;
+static size_t               nthreads = 0;
+static enum resolver_engine engine  = RESOLVER_GETADDRINFO;
+
+/** FNV-1a del nombre y el puerto */
+static struct flight **
+flight_bucket(const char *host, uint16_t port) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) host; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    h = (h ^ (port & 0xff)) * 16777619u;
+    h = (h ^ (port >> 8))   * 16777619u;
+    return flights + h % N(flights);
+}
+
+/** puntero al enlace que apunta a la resolución, o al NULL final del bucket */
+static struct flight **
+flight_find(const char *host, uint16_t port) {
+    struct flight **link = flight_bucket(host, port);
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->port == port && strcmp((*link)->host, host) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/** saca `f' de la tabla: ya no se le suman pedidos. Con flights_lock tomado */
+static void
+flight_remove(struct flight *f) {
+    struct flight **link = flight_bucket(f->host, f->port);
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+}
+
+/**
+ * terminó la resolución de `data' (un flight): le deja a cada pedido una
+ * copia de `list' y lo notifica. Lo llama el hilo que resolvió.
+ *
+ * Los pedidos se atienden con flights_lock tomado: así resolver_detach no
+ * puede liberar la sesión de uno (ni su selector) mientras tanto.
+ */
+static void
+flight_done(void *data, const struct addrinfo *list) {
+    struct flight *f = data;
+
+    pthread_mutex_lock(&flights_lock);
+    flight_remove(f);
+    for (struct waiter *w = f->waiters, *next; w != NULL; w = next) {
+        next = w->next;
+        // sin memoria para la copia el pedido se entera como de una falla
+        *w->result = dnscache_copy(list);
+        // si no se puede encolar la notificación la sesión queda esperando
+        // hasta que se cierre el selector; no hay a quién más avisarle
+        selector_notify_block(w->s, w->fd);
+        free(w);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    free(f);
+}
+
+static void
+resolve(struct resolver_job *job) {
+    const struct addrinfo hints = {
+        .ai_family      = AF_UNSPEC,    // allow IPv4 or IPv6
+        .ai_socktype    = SOCK_STREAM,
+        .ai_flags       = AI_PASSIVE,   // for wildcard IP address
+        .ai_protocol    = 0,            // any protocol
+        .ai_canonname   = NULL,
+        .ai_addr        = NULL,
+        .ai_next        = NULL,
+    };
+    struct flight *f = job->flight;
+    struct addrinfo *res = NULL;
+    const int err = getaddrinfo(f->host, job->service, &hints, &res);
+
+    if (err == 0) {
+        dnscache_put(f->host, f->port, hints.ai_family, res, 0);
+        // las sesiones reciben copias en el formato del cache
+        flight_done(f, res);
+        freeaddrinfo(res);
+    } else {
+        // sólo es negativa si el nombre no existe; un timeout del
+        // servidor DNS (EAI_AGAIN) u otra falla no se recuerda
+        if (err == EAI_NONAME) {
+            dnscache_put(f->host, f->port, hints.ai_family, NULL, 0);
+        }
+        flight_done(f, NULL);
+    }
+}
+
+static void *
+resolver_run(void *arg) {
+    struct resolver_job job;
+
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (!stopping && len == 0) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        job = jobs[head];
+        head = (head + 1) % size;
+        len--;
+
+        pthread_mutex_unlock(&lock);
+        resolve(&job);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+int
+resolver_start(const struct resolver_init *c) {
+    int ret = 0;
+    sigset_t block, old;
+
+    engine = c->engine;
+    if (engine == RESOLVER_NATIVE) {
+        goto finally;
+    }
+    jobs    = calloc(c->queue, sizeof(*jobs));
+    threads = calloc(c->threads, sizeof(*threads));
+    if (jobs == NULL || threads == NULL) {
+        ret = -1;
+        goto finally;
+    }
+    size     = c->queue;
+    stopping = false;
+
+    // como los workers: las señales las atiende el hilo principal
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (size_t i = 0; i < c->threads; i++) {
+        if (0 != pthread_create(threads + i, NULL, resolver_run, NULL)) {
+            ret = -1;
+            break;
+        }
+        nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+finally:
+    return ret;
+}
+
+/** encola la resolución de `f' para el pool */
+static bool
+pool_submit(struct flight *f) {
+    bool ret = false;
+
+    pthread_mutex_lock(&lock);
+    if (nthreads == 0 || stopping || len == size) {
+        goto finally;
+    }
+    struct resolver_job *job = jobs + (head + len) % size;
+    job->flight = f;
+    snprintf(job->service, sizeof(job->service), "%u", (unsigned) f->port);
+    len++;
+    ret = true;
+    pthread_cond_signal(&ready);
+
+finally:
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/**
+ * suma `w' a la resolución en curso de `host':`port', o la inicia. `w' puede
+ * ser NULL: una renovación del cache, que no espera nadie.
+ *
+ * @return false si no se pudo iniciar; `w' ya está liberado
+ */
+static bool
+flight_start(fd_selector s, const char *host, uint16_t port, struct waiter *w) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight **link = flight_find(host, port);
+    struct flight *f     = *link;
+    if (f != NULL) {
+        // ya se está resolviendo: esperamos el mismo resultado
+        if (w != NULL) {
+            w->next    = f->waiters;
+            f->waiters = w;
+            coalesced++;
+        }
+        pthread_mutex_unlock(&flights_lock);
+        return true;
+    }
+    const size_t hostlen = strlen(host) + 1;
+    f = malloc(sizeof(*f) + hostlen);
+    if (f == NULL) {
+        pthread_mutex_unlock(&flights_lock);
+        free(w);
+        return false;
+    }
+    f->next    = NULL;
+    f->waiters = w;
+    f->port    = port;
+    memcpy(f->host, host, hostlen);
+    *link = f;
+    pthread_mutex_unlock(&flights_lock);
+
+    // desde acá `f' puede terminar (y liberarse) en cualquier momento
+    if (engine == RESOLVER_NATIVE ? dnsstub_resolve(s, host, port, flight_done, f)
+                                  : pool_submit(f)) {
+        return true;
+    }
+
+    // no se pudo iniciar: los que se sumaron mientras tanto se enteran como
+    // de un pool saturado, igual que este pedido con el retorno
+    pthread_mutex_lock(&flights_lock);
+    flight_remove(f);
+    for (struct waiter *x = f->waiters, *next; x != NULL; x = next) {
+        next = x->next;
+        if (x != w) {
+            *x->busy = true;
+            selector_notify_block(x->s, x->fd);
+        }
+        free(x);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    free(f);
+    return false;
+}
+
+bool
+resolver_submit(fd_selector s, int fd, const char *host, uint16_t port,
+                struct addrinfo **result, bool *busy) {
+    struct waiter *w = malloc(sizeof(*w));
+    if (w == NULL) {
+        return false;
+    }
+    w->s      = s;
+    w->fd     = fd;
+    w->result = result;
+    w->busy   = busy;
+    w->next   = NULL;
+    *result   = NULL;
+    *busy     = false;
+    return flight_start(s, host, port, w);
+}
+
+void
+resolver_refresh(fd_selector s, const char *host, uint16_t port) {
+    // si no se puede, la entrada vence y la resuelve el próximo pedido
+    flight_start(s, host, port, NULL);
+}
+
+void
+resolver_detach(fd_selector s) {
+    pthread_mutex_lock(&flights_lock);
+    for (size_t i = 0; i < N(flights); i++) {
+        for (struct flight *f = flights[i]; f != NULL; f = f->next) {
+            struct waiter **link = &f->waiters;
+            while (*link != NULL) {
+                struct waiter *w = *link;
+                if (w->s == s) {
+                    *link = w->next;
+                    free(w);
+                } else {
+                    link = &w->next;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&flights_lock);
+}
+
+uint64_t
+resolver_coalesced(void) {
+    pthread_mutex_lock(&flights_lock);
+    const uint64_t ret = coalesced;
+    pthread_mutex_unlock(&flights_lock);
+    return ret;
+}
+
+void
+resolver_stop(void) {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&ready);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // lo que quedó encolado se descarta sin notificar (ver resolver.h)
+    pthread_mutex_lock(&flights_lock);
+    for (; len > 0; head = (head + 1) % size, len--) {
+        struct flight *f = jobs[head].flight;
+        flight_remove(f);
+        for (struct waiter *w = f->waiters, *next; w != NULL; w = next) {
+            next = w->next;
+            free(w);
+        }
+        free(f);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    free(threads);
+    free(jobs);
+    threads  = NULL;
+    jobs     = NULL;
+    nthreads = 0;
+    size     = head = len = 0;
+}
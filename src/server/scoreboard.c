@@ -0,0 +1,391 @@
+/**
+ * scoreboard.c - historial de las conexiones a cada origin server
+ *
+ * Como dnscache.c: tabla de hash con encadenamiento más una lista en orden de
+ * uso, todo bajo un único mutex. Cada operación es una búsqueda y unas pocas
+ * cuentas, frente a una conexión TCP.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "../include/scoreboard.h"
+
+/** la dirección, en un formato fácil de comparar */
+struct score_key {
+    uint8_t  family;
+    uint16_t port;      // en orden de red
+    uint8_t  addr[16];  // IPv4 usa los primeros 4
+};
+
+struct score {
+    /** siguiente en el mismo bucket */
+    struct score    *next;
+    /** vecinos en la lista de uso */
+    struct score    *newer, *older;
+
+    uint32_t         hash;
+    struct score_key key;
+
+    uint32_t         successes;
+    uint32_t         failures;
+    /** fallas sin respuesta desde la última conexión establecida */
+    uint32_t         unresponsive;
+    /** la última conexión se estableció */
+    bool             last_ok;
+    /** tiempo de conexión suavizado en us (7/8 del anterior, como el SRTT de TCP) */
+    uint32_t         srtt;
+    /** CLOCK_MONOTONIC, ms; 0 si no está caída */
+    uint64_t         down_until;
+};
+
+static pthread_mutex_t  lock        = PTHREAD_MUTEX_INITIALIZER;
+static struct score   **buckets     = NULL;
+/** potencia de 2 */
+static size_t           nbuckets    = 0;
+static size_t           max_entries = 0;
+static size_t           nentries    = 0;
+static unsigned         down_after  = 0;
+static unsigned         down_ttl    = 0;
+/** extremos de la lista de uso */
+static struct score    *newest      = NULL;
+static struct score    *oldest      = NULL;
+
+/** puestos de scoreboard_sort, del mejor al peor */
+enum rank {
+    RANK_OK,
+    RANK_UNKNOWN,
+    RANK_FAILING,
+    RANK_DOWN,
+};
+
+static uint64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/** false si no es IPv4 ni IPv6 */
+static bool
+key_from(const struct sockaddr *addr, struct score_key *k) {
+    memset(k, 0, sizeof(*k));
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        k->port = in->sin_port;
+        memcpy(k->addr, &in->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        k->port = in6->sin6_port;
+        memcpy(k->addr, &in6->sin6_addr, 16);
+    } else {
+        return false;
+    }
+    k->family = (uint8_t) addr->sa_family;
+    return true;
+}
+
+/** FNV-1a de la clave */
+static uint32_t
+hash(const struct score_key *k) {
+    const uint8_t bytes[] = {
+        k->family, (uint8_t) (k->port & 0xff), (uint8_t) (k->port >> 8),
+    };
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < sizeof(k->addr); i++) {
+        h = (h ^ k->addr[i]) * 16777619u;
+    }
+    return h;
+}
+
+static bool
+key_equal(const struct score_key *a, const struct score_key *b) {
+    return a->family == b->family && a->port == b->port
+        && memcmp(a->addr, b->addr, sizeof(a->addr)) == 0;
+}
+
+/** saca `e' de la lista de uso */
+static void
+lru_unlink(struct score *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        oldest = e->newer;
+    }
+    e->newer = e->older = NULL;
+}
+
+/** pone `e' como la más reciente */
+static void
+lru_push(struct score *e) {
+    e->newer = NULL;
+    e->older = newest;
+    if (newest != NULL) {
+        newest->newer = e;
+    } else {
+        oldest = e;
+    }
+    newest = e;
+}
+
+/** puntero al enlace que apunta a la entrada, o al NULL final del bucket */
+static struct score **
+find(const struct score_key *k, uint32_t h) {
+    struct score **link = buckets + (h & (nbuckets - 1));
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->hash == h && key_equal(&(*link)->key, k)) {
+            break;
+        }
+    }
+    return link;
+}
+
+/** saca y libera la entrada a la que apunta `link' */
+static void
+remove_entry(struct score **link) {
+    struct score *e = *link;
+
+    *link = e->next;
+    lru_unlink(e);
+    free(e);
+    nentries--;
+}
+
+/**
+ * la entrada de `addr' como la más reciente, creándola si hace falta
+ * (quizás olvidando la más vieja). NULL si no se pudo. Con el lock tomado.
+ */
+static struct score *
+get(const struct sockaddr *addr) {
+    struct score_key k;
+
+    if (max_entries == 0 || !key_from(addr, &k)) {
+        return NULL;
+    }
+    const uint32_t h     = hash(&k);
+    struct score **link  = find(&k, h);
+    struct score  *e     = *link;
+    if (e != NULL) {
+        lru_unlink(e);
+        lru_push(e);
+        return e;
+    }
+
+    if (nentries == max_entries) {
+        remove_entry(find(&oldest->key, oldest->hash));
+        // la tabla cambió: el enlace puede haber quedado viejo
+        link = find(&k, h);
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->hash = h;
+    e->key  = k;
+    e->next = *link;
+    *link   = e;
+    lru_push(e);
+    nentries++;
+    return e;
+}
+
+int
+scoreboard_init(const struct scoreboard_init *c) {
+    max_entries = c->entries;
+    down_after  = c->down_after;
+    down_ttl    = c->down_ttl;
+    if (max_entries == 0) {
+        return 0;
+    }
+
+    nbuckets = 1;
+    while (nbuckets < max_entries) {
+        nbuckets <<= 1;
+    }
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL) {
+        max_entries = nbuckets = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void
+scoreboard_success(const struct sockaddr *addr, unsigned rtt_us) {
+    pthread_mutex_lock(&lock);
+    struct score *e = get(addr);
+    if (e != NULL) {
+        e->srtt = e->successes == 0 ? rtt_us
+                : (uint32_t) (((uint64_t) e->srtt * 7 + rtt_us) / 8);
+        e->successes++;
+        e->unresponsive = 0;
+        e->last_ok      = true;
+        e->down_until   = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+scoreboard_failure(const struct sockaddr *addr, bool unresponsive) {
+    pthread_mutex_lock(&lock);
+    struct score *e = get(addr);
+    if (e != NULL) {
+        e->failures++;
+        e->last_ok = false;
+        if (unresponsive && ++e->unresponsive >= down_after && down_after != 0) {
+            e->down_until = now_ms() + down_ttl;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/** puesto de `e' (que puede ser NULL) con el lock tomado */
+static enum rank
+rank(const struct score *e, uint64_t now) {
+    if (e == NULL) {
+        return RANK_UNKNOWN;
+    }
+    if (e->down_until > now) {
+        return RANK_DOWN;
+    }
+    return e->last_ok ? RANK_OK : RANK_FAILING;
+}
+
+/** busca sin crear ni cambiar el orden de uso. Con el lock tomado */
+static const struct score *
+peek(const struct sockaddr *addr) {
+    struct score_key k;
+
+    if (max_entries == 0 || !key_from(addr, &k)) {
+        return NULL;
+    }
+    return *find(&k, hash(&k));
+}
+
+bool
+scoreboard_is_down(const struct sockaddr *addr) {
+    pthread_mutex_lock(&lock);
+    const bool ret = rank(peek(addr), now_ms()) == RANK_DOWN;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+size_t
+scoreboard_sort(struct addrinfo **list) {
+    /** lo que hace falta de cada dirección para ordenarla */
+    struct item {
+        struct addrinfo *ai;
+        enum rank        rank;
+        uint32_t         srtt;
+    } items[64];
+    size_t n = 0, up = 0;
+
+    pthread_mutex_lock(&lock);
+    const uint64_t now = now_ms();
+    for (struct addrinfo *ai = *list; ai != NULL && n < sizeof(items) / sizeof(items[0]); ai = ai->ai_next) {
+        const struct score *e = peek(ai->ai_addr);
+        items[n].ai   = ai;
+        items[n].rank = rank(e, now);
+        items[n].srtt = e == NULL ? 0 : e->srtt;
+        n++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (n == 0) {
+        return 0;
+    }
+    // las que no entraron quedan al final, como estaban
+    struct addrinfo *rest = items[n - 1].ai->ai_next;
+
+    // por inserción (estable): son pocas
+    for (size_t i = 1; i < n; i++) {
+        const struct item x = items[i];
+        size_t j = i;
+        while (j > 0 && (items[j - 1].rank > x.rank
+                         || (x.rank == RANK_OK && items[j - 1].rank == RANK_OK
+                             && items[j - 1].srtt > x.srtt))) {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = x;
+    }
+    for (size_t i = 0; i < n; i++) {
+        items[i].ai->ai_next = i + 1 < n ? items[i + 1].ai : rest;
+        if (items[i].rank != RANK_DOWN) {
+            up++;
+        }
+    }
+    *list = items[0].ai;
+    return up;
+}
+
+/** escribe `v' en orden de red */
+static uint8_t *
+put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+size_t
+scoreboard_dump(uint8_t *buf, size_t size) {
+    // ATYP, dirección, puerto, 3 contadores y el estado
+    const size_t max_entry = 1 + 16 + 2 + 3 * 4 + 1;
+    uint8_t *p = buf;
+
+    if (size < 2) {
+        return 0;
+    }
+    p += 2;
+    uint16_t count = 0;
+
+    pthread_mutex_lock(&lock);
+    const uint64_t now = now_ms();
+    for (const struct score *e = newest; e != NULL && count < UINT16_MAX; e = e->older) {
+        if ((size_t) (p - buf) + max_entry > size) {
+            break;
+        }
+        const bool v4 = e->key.family == AF_INET;
+        *p++ = v4 ? 0x01 : 0x04;    // como el ATYP de SOCKS
+        memcpy(p, e->key.addr, v4 ? 4 : 16);
+        p += v4 ? 4 : 16;
+        memcpy(p, &e->key.port, 2);
+        p += 2;
+        p = put32(p, e->successes);
+        p = put32(p, e->failures);
+        p = put32(p, e->srtt);
+        *p++ = e->down_until > now ? 1 : 0;
+        count++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    buf[0] = count >> 8;
+    buf[1] = count & 0xff;
+    return (size_t) (p - buf);
+}
+
+void
+scoreboard_destroy(void) {
+    pthread_mutex_lock(&lock);
+    while (oldest != NULL) {
+        remove_entry(find(&oldest->key, oldest->hash));
+    }
+    free(buckets);
+    buckets     = NULL;
+    nbuckets    = 0;
+    max_entries = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -1,12 +1,15 @@
 /**
  * selector.c - un muliplexor de entrada salida
  */
+#define _GNU_SOURCE // syscall(2), MAP_POPULATE
 #include <stdio.h>  // perror
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include <assert.h> // :)
 #include <errno.h>  // :)
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <stdint.h> // SIZE_MAX
 #include <unistd.h>
@@ -15,6 +18,13 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
 #include "../include/selector.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
@@ -48,78 +58,150 @@ selector_error(const selector_status status) {
 }
 
 
-static void
-wake_handler(const int signal) {
-    // nada que hacer. está solo para interrumpir el select
-}
-
-// señal a usar para las notificaciones de resolución
+// configuración de la librería
 struct selector_init conf;
-static sigset_t emptyset, blockset;
 
 selector_status
 selector_init(const struct selector_init  *c) {
     memcpy(&conf, c, sizeof(conf));
 
-    // inicializamos el sistema de comunicación entre threads y el selector
-    // principal. La técnica se encuentra descripta en
-    // "The new pselect() system call" <https://lwn.net/Articles/176911/>
-    //  March 24, 2006
-    selector_status   ret = SELECTOR_SUCCESS;
-    struct sigaction act = {
-        .sa_handler = wake_handler,
-    };
-
-    // 0. calculamos mascara para evitar que se interrumpa antes de llegar al
-    //    select
-    sigemptyset(&blockset);
-    sigaddset  (&blockset, conf.signal);
-    if(-1 == sigprocmask(SIG_BLOCK, &blockset, NULL)) {
-        ret = SELECTOR_IO;
-        goto finally;
-    }
-
-    // 1. Registramos una función que atenderá la señal de interrupción
-    //    del selector.
-    //    Esta interrupción es útil en entornos multi-hilos.
-
-    if (sigaction(conf.signal, &act, 0)) {
-        ret = SELECTOR_IO;
-        goto finally;
-    }
-    sigemptyset(&emptyset);
-
-finally:
-    return ret;
+    // las notificaciones entre threads y el selector se hacen con un
+    // eventfd(2) por selector (ver selector_post), así que no hay que
+    // configurar señales.
+    return SELECTOR_SUCCESS;
 }
 
 selector_status
 selector_close(void) {
     // Nada para liberar.
-    // TODO(juan): podriamos reestablecer el handler de la señal.
     return SELECTOR_SUCCESS;
 }
 
 // estructuras internas
+struct item;
+
+/**
+ * Motor de multiplexación (select(2), epoll(7), ...).
+ *
+ * El selector mantiene la tabla de items y los intereses; el motor se encarga
+ * de reflejarlos en el kernel, de esperar eventos y de despacharlos.
+ */
+struct engine {
+    /** nombre para mostrar */
+    const char *name;
+    /** cantidad máxima de file descriptors que el motor puede manejar */
+    size_t (*max_items)(void);
+    /** inicializa los recursos propios del motor en el selector */
+    selector_status (*init)   (fd_selector s);
+    /** libera los recursos propios del motor */
+    void            (*destroy)(fd_selector s);
+    /** refleja en el kernel los intereses de `item'. `old' son los previos. */
+    selector_status (*update) (fd_selector s, const struct item *item,
+                               const fd_interest old);
+    /** se bloquea hasta que haya eventos (o timeout) y los despacha */
+    selector_status (*wait)   (fd_selector s);
+    /** pone a `item' en modo relay (ver selector_set_relay). NULL si no lo soporta */
+    selector_status (*relay)  (fd_selector s, struct item *item);
+};
+
 struct item {
    int                 fd;
    fd_interest         interest;
+   /** intereses que conoce el motor: difiere de `interest' si está en dirty */
+   fd_interest         committed;
+   /** está en la lista de cambios pendientes (ver interests_commit) */
+   bool                dirty;
    const fd_handler   *handler;
    void *              data; // se espera que sea un struct socks5 * al parecer, ver ATTACHMENT
+
+   /** sólo io_uring: operaciones en curso (índices en uring.ops, -1 si no hay) */
+   int                 poll_op, read_op, write_op;
+   /** sólo io_uring: eventos del poll en curso */
+   unsigned            poll_mask;
+   /** sólo io_uring: buffers del modo relay (NULL si no está en ese modo) */
+   buffer             *rb, *wb;
 };
 
-/* tarea bloqueante */
+/** tareas preasignadas por selector (ver jobs_pool_get) */
+#define JOBS_POOL_SIZE 1024
+/** se mide la latencia de una de cada tantas tareas. Potencia de 2 */
+#define JOBS_LATENCY_SAMPLE 16
+
+/* tarea encolada con selector_post (ej: un trabajo bloqueante que terminó) */
 struct blocking_job {
-    /** selector dueño de la resolucion */
-    fd_selector  s;
-    /** file descriptor dueño de la resolucion */
-    int fd;
+    /** función a ejecutar en el hilo del selector */
+    selector_task task;
 
     /** datos del trabajo provisto por el usuario */
     void *data;
 
-    /** el siguiente en la lista */
-    struct blocking_job *next;
+    /** el siguiente en la cola */
+    _Atomic(struct blocking_job *) next;
+
+    /** el siguiente libre en el pool (índice + 1, 0 si no hay) */
+    _Atomic uint32_t free_next;
+    /** pertenece a jobs_pool (si no, se pidió con malloc) */
+    bool pooled;
+
+    /**
+     * cuándo se encoló (CLOCK_MONOTONIC, ns), para medir la latencia. 0 si
+     * no se eligió para medirla (ver JOBS_LATENCY_SAMPLE).
+     */
+    uint64_t posted_ns;
+};
+
+/** resolución de los temporizadores (ms) */
+#define TIMER_TICK_MS   10
+/** cada nivel de la rueda tiene 2^WHEEL_BITS posiciones */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1U << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+/** con 4 niveles se cubren 2^24 ticks: unas 46 horas */
+#define WHEEL_LEVELS    4
+
+/**
+ * rueda jerárquica de temporizadores (Varghese & Lauck).
+ *
+ * El nivel 0 tiene una posición por tick; cada posición del nivel n abarca
+ * 2^(WHEEL_BITS * n) ticks. Un temporizador se guarda en el nivel más bajo
+ * que alcanza para su vencimiento y, cada vez que el nivel 0 da una vuelta,
+ * se reparten ("cascade") los de la posición actual del nivel siguiente.
+ * Así agregar y cancelar es O(1) y cada tick sólo mira una posición.
+ */
+struct timer_wheel {
+    /** próximo tick a procesar: ya se procesaron todos los anteriores */
+    uint64_t                now;
+    /** cantidad de temporizadores programados */
+    size_t                  pending;
+    struct selector_timer  *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/**
+ * se mide la duración de uno de cada tantos handlers: leer el reloj dos veces
+ * por evento es comparable a lo que cuesta un handler simple. Potencia de 2
+ */
+#define LOOP_HANDLER_SAMPLE 8
+
+/**
+ * histograma del event loop (ver selector_loop_stats). Sólo lo escribe el
+ * hilo del selector; es atómico para poder leerlo desde otro.
+ */
+struct loop_hist {
+    atomic_uint_fast64_t    count, sum, max;
+    atomic_uint_fast64_t    buckets[SELECTOR_HIST_BUCKETS];
+};
+
+/** mediciones del event loop de un selector */
+struct loop_stats {
+    struct loop_hist        wait, dispatch, events;
+    struct loop_hist        read, write, block;
+
+    /** cuándo empezó a esperar la iteración actual (ns) */
+    uint64_t                wait_ns;
+    /** cuándo retornó la espera (ns). 0 si el motor no lo informó */
+    uint64_t                woke_ns;
+    /** handlers ejecutados, para elegir cuáles medir */
+    unsigned                handlers;
 };
 
 /** marca para usar en item->fd para saber que no está en uso */
@@ -135,41 +217,90 @@ struct fdselector {
     struct item    *fds;
     size_t          fd_size;  // cantidad de elementos posibles de fds
 
+    /** máximo de elementos que soporta el motor (ver INVALID_FD) */
+    size_t          max_items;
+
+    /**
+     * fds cuyos intereses cambiaron en esta iteración y todavía no se
+     * reflejaron en el motor (ver selector_set_interest)
+     */
+    int            *dirty;
+    size_t          dirty_n, dirty_size;
+
     /** fd maximo para usar en select() */
     int max_fd;  // max(.fds[].fd)
 
+    /** motor utilizado para esperar los eventos */
+    const struct engine *engine;
+
     /** descriptores prototipicos ser usados en select */
     fd_set master_r, master_w;
     /** para ser usado en el select() (recordar que select cambia el valor) */
     fd_set  slave_r,  slave_w;
+    /** fds con algún evento en slave_r/slave_w (ver select_ready) */
+    int    *ready;
+
+    /** instancia de epoll(7) */
+    int                 epfd;
+    /** eventos retornados por epoll_wait(2) */
+    struct epoll_event *events;
+
+    /** instancia de io_uring(7) */
+    struct uring       *uring;
 
     /** timeout prototipico para usar en select() */
     struct timespec master_t;
     /** tambien select() puede cambiar el valor */
     struct timespec slave_t;
-
-    // notificaciónes entre blocking jobs y el selector
-    volatile pthread_t      selector_thread;
-    /** protege el acceso a resolutions jobs */
-    pthread_mutex_t         resolution_mutex;
+    /** timeout de la espera de esta iteración: master_t o el próximo temporizador */
+    struct timespec wait_t;
+
+    /** temporizadores (ver selector_timer_add) */
+    struct timer_wheel      timers;
+
+    /** mediciones del event loop (ver selector_loop_stats) */
+    struct loop_stats       loop;
+    /** iteraciones comenzadas (ver selector_iteration) */
+    uint64_t                iteration;
+
+    // notificaciónes entre otros hilos y el selector
+    /** eventfd(2) registrado en el selector: despierta la espera */
+    int                     jobs_fd;
+    /** tareas preasignadas */
+    struct blocking_job    *jobs_pool;
+    /**
+     * pila de tareas libres de jobs_pool: (generación << 32) | (índice + 1),
+     * 0 si está vacía. La generación evita el problema ABA entre productores.
+     */
+    _Atomic uint64_t        jobs_free;
     /**
-     * lista de trabajos blockeantes que finalizaron y que pueden ser
-     * notificados.
+     * cola (FIFO) de tareas encoladas con selector_post que todavía no se
+     * ejecutaron. Los productores agregan por jobs_tail y sólo el hilo del
+     * selector saca por jobs_head; jobs_stub hace que nunca quede vacía.
      */
-    struct blocking_job    *resolution_jobs;
+    _Atomic(struct blocking_job *) jobs_tail;
+    struct blocking_job    *jobs_head;
+    struct blocking_job     jobs_stub;
+    /**
+     * tareas encoladas sin ejecutar. Quien la lleva de 0 a 1 despierta al
+     * selector. Puede quedar negativa un instante (ver selector_post).
+     */
+    atomic_long             jobs_depth;
+
+    // contadores (ver selector_jobs_stats). Los que sólo escribe el hilo
+    // del selector son atómicos sólo para poder leerlos desde otro hilo.
+    atomic_uint_fast64_t    jobs_pool_misses, jobs_max_depth;
+    atomic_uint_fast64_t    jobs_completed;
+    atomic_uint_fast64_t    jobs_latency_samples;
+    atomic_uint_fast64_t    jobs_latency_total, jobs_latency_max;
 };
 
-/** cantidad máxima de file descriptors que la plataforma puede manejar */
-#define ITEMS_MAX_SIZE      FD_SETSIZE
-
-// en esta implementación el máximo está dado por el límite natural de select(2).
-
 /**
  * determina el tamaño a crecer, generando algo de slack para no tener
  * que realocar constantemente.
  */
 static
-size_t next_capacity(const size_t n) {
+size_t next_capacity(fd_selector s, const size_t n) {
     unsigned bits = 0;
     size_t tmp = n;
     while(tmp != 0) {
@@ -179,22 +310,24 @@ size_t next_capacity(const size_t n) {
     tmp = 1UL << bits;
 
     assert(tmp >= n);
-    if(tmp > ITEMS_MAX_SIZE) {
-        tmp = ITEMS_MAX_SIZE;
+    if(tmp > s->max_items) {
+        tmp = s->max_items;
     }
 
     return tmp + 1;
 }
 
+/** deja a `item' libre, sin nada de un registro anterior (ej: `dirty') */
 static inline void
 item_init(struct item *item) {
-    item->fd = FD_UNUSED;
+    memset(item, 0x00, sizeof(*item));
+    item->fd       = FD_UNUSED;
+    item->poll_op  = -1;
+    item->read_op  = -1;
+    item->write_op = -1;
 }
 
-/**
- * inicializa los nuevos items. `last' es el indice anterior.
- * asume que ya está blanqueada la memoria.
- */
+/** inicializa los nuevos items. `last' es el indice anterior. */
 static void
 items_init(fd_selector s, const size_t last) {
     assert(last <= s->fd_size);
@@ -204,39 +337,21 @@ items_init(fd_selector s, const size_t last) {
 }
 
 /**
- * calcula el fd maximo para ser utilizado en select()
+ * calcula el fd maximo para ser utilizado en select() luego de desregistrar
+ * `removed'. Sólo cambia si era el máximo; en ese caso se busca hacia abajo
+ * desde ahí, sin recorrer toda la tabla.
  */
 static int
-items_max_fd(fd_selector s) {
-    int max = 0;
-    for(int i = 0; i <= s->max_fd; i++) {
-        struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
-            if(item->fd > max) {
-                max = item->fd;
-            }
+items_max_fd(fd_selector s, const int removed) {
+    int max = s->max_fd;
+    if(removed == max) {
+        while(max > 0 && !ITEM_USED(s->fds + max)) {
+            max--;
         }
     }
     return max;
 }
 
-// borra el item de los fd_sets y los vuelve a setear segun sus intereses actuales
-static void
-items_update_fdset_for_fd(fd_selector s, const struct item * item) {
-    FD_CLR(item->fd, &s->master_r);
-    FD_CLR(item->fd, &s->master_w);
-
-    if(ITEM_USED(item)) {
-        if(item->interest & OP_READ) {
-            FD_SET(item->fd, &(s->master_r));
-        }
-
-        if(item->interest & OP_WRITE) {
-            FD_SET(item->fd, &(s->master_w));
-        }
-    }
-}
-
 /**
  * garantizar cierta cantidad de elemenos en `fds'.
  * Se asegura de que `n' sea un número que la plataforma donde corremos lo
@@ -250,12 +365,12 @@ ensure_capacity(fd_selector s, const size_t n) {
     if(n < s->fd_size) {
         // nada para hacer, entra...
         ret = SELECTOR_SUCCESS;
-    } else if(n > ITEMS_MAX_SIZE) {
+    } else if(n > s->max_items) {
         // me estás pidiendo más de lo que se puede.
         ret = SELECTOR_MAXFD;
     } else if(NULL == s->fds) {
         // primera vez.. alocamos
-        const size_t new_size = next_capacity(n);
+        const size_t new_size = next_capacity(s, n);
 
         s->fds = calloc(new_size, element_size);
         if(NULL == s->fds) {
@@ -266,7 +381,7 @@ ensure_capacity(fd_selector s, const size_t n) {
         }
     } else {
         // hay que agrandar...
-        const size_t new_size = next_capacity(n);
+        const size_t new_size = next_capacity(s, n);
         if (new_size > SIZE_MAX/element_size) { // ver MEM07-C
             ret = SELECTOR_ENOMEM;
         } else {
@@ -286,194 +401,308 @@ ensure_capacity(fd_selector s, const size_t n) {
     return ret;
 }
 
-fd_selector
-selector_new(const size_t initial_elements) {
-    size_t size = sizeof(struct fdselector);
-    fd_selector ret = malloc(size);
-    if(ret != NULL) {
-        memset(ret, 0x00, size);
-        ret->master_t.tv_sec  = conf.select_timeout.tv_sec;
-        ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
-        assert(ret->max_fd == 0);
-        ret->resolution_jobs  = 0;
-        pthread_mutex_init(&ret->resolution_mutex, 0);
-        if(0 != ensure_capacity(ret, initial_elements)) {
-            selector_destroy(ret);
-            ret = NULL;
+static void loop_woke(fd_selector s, const unsigned events);
+static void handler_run(fd_selector s, struct loop_hist *h,
+                        void (*handler)(struct selector_key *),
+                        struct selector_key *key);
+
+////////////////////////////////////////////////////////////////////////////////
+// MOTOR select(2)
+////////////////////////////////////////////////////////////////////////////////
+
+// en este motor el máximo está dado por el límite natural de select(2).
+static size_t
+select_max_items(void) {
+    return FD_SETSIZE;
+}
+
+static selector_status
+select_init(fd_selector s) {
+    FD_ZERO(&s->master_r);
+    FD_ZERO(&s->master_w);
+    s->ready = malloc(FD_SETSIZE * sizeof(*s->ready));
+    return s->ready == NULL ? SELECTOR_ENOMEM : SELECTOR_SUCCESS;
+}
+
+static void
+select_destroy(fd_selector s) {
+    free(s->ready);
+    s->ready = NULL;
+}
+
+// borra el item de los fd_sets y los vuelve a setear segun sus intereses actuales
+static selector_status
+select_update(fd_selector s, const struct item *item, const fd_interest old) {
+    FD_CLR(item->fd, &s->master_r);
+    FD_CLR(item->fd, &s->master_w);
+
+    if(item->interest & OP_READ) {
+        FD_SET(item->fd, &(s->master_r));
+    }
+
+    if(item->interest & OP_WRITE) {
+        FD_SET(item->fd, &(s->master_w));
+    }
+    return SELECTOR_SUCCESS;
+}
+
+/** bits de una palabra de un fd_set */
+#define FDSET_WORD_BITS  (8 * sizeof(unsigned long))
+/** palabras de un fd_set */
+#define FDSET_WORDS      (sizeof(fd_set) / sizeof(unsigned long))
+
+// en Linux un fd_set es un bitmap de `unsigned long': el fd `i' es el bit
+// i % FDSET_WORD_BITS de la palabra i / FDSET_WORD_BITS.
+_Static_assert(sizeof(fd_set) % sizeof(unsigned long) == 0,
+               "fd_set no es un arreglo de unsigned long");
+
+/**
+ * arma en `s->ready' la lista de fds que tienen algún evento, recorriendo
+ * los fd_sets de a una palabra (se saltean de a 64 los fds sin eventos) y
+ * deteniéndose cuando se encontraron los `n' eventos que informó select().
+ *
+ * @return cantidad de fds en la lista
+ */
+static size_t
+select_ready(fd_selector s, int n) {
+    unsigned long r[FDSET_WORDS], w[FDSET_WORDS];
+    const size_t words = (size_t)s->max_fd / FDSET_WORD_BITS + 1;
+    size_t ret = 0;
+
+    memcpy(r, &s->slave_r, words * sizeof(*r));
+    memcpy(w, &s->slave_w, words * sizeof(*w));
+    for(size_t i = 0; i < words && n > 0; i++) {
+        unsigned long bits = r[i] | w[i];
+        n -= __builtin_popcountl(r[i]) + __builtin_popcountl(w[i]);
+        while(bits != 0) {
+            s->ready[ret++] = (int)(i * FDSET_WORD_BITS) + __builtin_ctzl(bits);
+            bits &= bits - 1;
         }
     }
     return ret;
 }
 
-void
-selector_destroy(fd_selector s) {
-    // lean ya que se llama desde los casos fallidos de _new.
-    if(s != NULL) {
-        if(s->fds != NULL) {
-            for(size_t i = 0; i < s->fd_size ; i++) {
-                if(ITEM_USED(s->fds + i)) {
-                    selector_unregister_fd(s, i);
+/**
+ * se encarga de manejar los resultados del select: sólo se visitan los fds
+ * listos (ver select_ready), no toda la tabla.
+ */
+static void
+select_handle_iteration(fd_selector s, const int n) {
+    const size_t nready = select_ready(s, n);
+    struct selector_key key = {
+        .s = s,
+    };
+
+    for (size_t i = 0; i < nready; i++) {
+        const int fd = s->ready[i];
+        // los handlers pueden agrandar la tabla: no guardamos punteros a items
+        struct item *item = s->fds + fd;
+        if(!ITEM_USED(item)) {
+            continue;
+        }
+        key.fd   = item->fd;
+        key.data = item->data;
+        if(FD_ISSET(fd, &s->slave_r)) {
+            if(OP_READ & item->interest) {
+                if(0 == item->handler->handle_read) {
+                    assert(("OP_READ arrived but no handler. bug!" == 0));
+                } else {
+                    handler_run(s, &s->loop.read, item->handler->handle_read, &key);
                 }
             }
-            pthread_mutex_destroy(&s->resolution_mutex);
-            struct blocking_job *aux = s->resolution_jobs;
-            for(struct blocking_job *j = aux; j != NULL; ) {
-                aux = j;
-                j = j->next;
-                free(aux);
+        }
+        item = s->fds + fd;
+        if(FD_ISSET(fd, &s->slave_w)) {
+            if(OP_WRITE & item->interest) {
+                if(0 == item->handler->handle_write) {
+                    assert(("OP_WRITE arrived but no handler. bug!" == 0));
+                } else {
+                    handler_run(s, &s->loop.write, item->handler->handle_write, &key);
+                }
             }
-            free(s->fds);
-            s->fds     = NULL;
-            s->fd_size = 0;
         }
-        free(s);
     }
 }
 
-#define INVALID_FD(fd)  ((fd) < 0 || (fd) >= ITEMS_MAX_SIZE)
-
-selector_status
-selector_register(fd_selector        s,
-                     const int          fd,
-                     const fd_handler  *handler,
-                     const fd_interest  interest,
-                     void *data) {
+static selector_status
+select_wait(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
-    // 0. validación de argumentos
-    if(s == NULL || INVALID_FD(fd) || handler == NULL) {
-        ret = SELECTOR_IARGS;
-        goto finally;
-    }
-    // 1. tenemos espacio?
-    size_t ufd = (size_t)fd;
-    if(ufd >= s->fd_size) {
-        ret = ensure_capacity(s, ufd);
-        if(SELECTOR_SUCCESS != ret) {
-            goto finally;
-        }
-    }
 
-    // 2. registración
-    struct item * item = s->fds + ufd;
-    if(ITEM_USED(item)) {
-        ret = SELECTOR_FDINUSE;
-        goto finally;
-    } else {
-        item->fd       = fd;
-        item->handler  = handler;
-        item->interest = interest;
-        item->data     = data;
+    memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
+    memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
+    memcpy(&s->slave_t, &s->wait_t, sizeof(s->slave_t));
 
-        // actualizo colaterales
-        if(fd > s->max_fd) {
-            s->max_fd = fd;
+    int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
+                      NULL);
+    loop_woke(s, fds > 0 ? (unsigned) fds : 0);
+    if(-1 == fds) {
+        switch(errno) {
+            case EAGAIN:
+            case EINTR:
+                // si una señal nos interrumpio. ok!
+                break;
+            case EBADF:
+                // ayuda a encontrar casos donde se cierran los fd pero no
+                // se desregistraron
+                for(int i = 0 ; i < s->max_fd; i++) {
+                    if(FD_ISSET(i, &s->master_r)|| FD_ISSET(i, &s->master_w)) {
+                        if(-1 == fcntl(i, F_GETFD, 0)) {
+                            fprintf(stderr, "Bad descriptor detected: %d\n", i);
+                        }
+                    }
+                }
+                ret = SELECTOR_IO;
+                break;
+            default:
+                ret = SELECTOR_IO;
+                break;
         }
-        items_update_fdset_for_fd(s, item);
+    } else {
+        select_handle_iteration(s, fds);
     }
-
-finally:
     return ret;
 }
 
-selector_status
-selector_unregister_fd(fd_selector       s,
-                       const int         fd) {
-    selector_status ret = SELECTOR_SUCCESS;
-
-    if(NULL == s || INVALID_FD(fd)) {
-        ret = SELECTOR_IARGS;
-        goto finally;
-    }
+static const struct engine select_engine = {
+    .name      = "select",
+    .max_items = select_max_items,
+    .init      = select_init,
+    .destroy   = select_destroy,
+    .update    = select_update,
+    .wait      = select_wait,
+};
 
-    struct item *item = s->fds + fd;
-    if(!ITEM_USED(item)) {
-        ret = SELECTOR_IARGS;
-        goto finally;
-    }
+////////////////////////////////////////////////////////////////////////////////
+// MOTOR epoll(7)
+////////////////////////////////////////////////////////////////////////////////
 
-    if(item->handler->handle_close != NULL) {
-        struct selector_key key = {
-            .s    = s,
-            .fd   = item->fd,
-            .data = item->data,
-        };
-        item->handler->handle_close(&key);
-    }
+/** cantidad máxima de eventos que se despachan por iteración */
+#define EPOLL_MAX_EVENTS    1024
 
-    item->interest = OP_NOOP;
-    items_update_fdset_for_fd(s, item);
+/** si no hay límite de descriptores usamos este tope para la tabla de items */
+#define EPOLL_ITEMS_MAX_SIZE (1 << 24)
 
-    memset(item, 0x00, sizeof(*item));
-    item_init(item);
-    s->max_fd = items_max_fd(s);
+// en este motor el máximo está dado por RLIMIT_NOFILE: no puede existir
+// un fd mayor.
+static size_t
+epoll_max_items(void) {
+    struct rlimit rl;
+    size_t ret = EPOLL_ITEMS_MAX_SIZE;
 
-finally:
+    if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY
+       && rl.rlim_cur < EPOLL_ITEMS_MAX_SIZE) {
+        ret = rl.rlim_cur;
+    }
     return ret;
 }
 
-selector_status
-selector_set_interest(fd_selector s, int fd, fd_interest i) {
+static selector_status
+epoll_init(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    if(NULL == s || INVALID_FD(fd)) {
-        ret = SELECTOR_IARGS;
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(-1 == s->epfd) {
+        ret = SELECTOR_IO;
         goto finally;
     }
-    struct item *item = s->fds + fd;
-    if(!ITEM_USED(item)) {
-        ret = SELECTOR_IARGS;
-        goto finally;
+    s->events = calloc(EPOLL_MAX_EVENTS, sizeof(*s->events));
+    if(NULL == s->events) {
+        close(s->epfd);
+        s->epfd = -1;
+        ret = SELECTOR_ENOMEM;
     }
-    item->interest = i;
-    items_update_fdset_for_fd(s, item);
 finally:
     return ret;
 }
 
-selector_status
-selector_set_interest_key(struct selector_key *key, fd_interest i) {
-    selector_status ret;
+static void
+epoll_destroy(fd_selector s) {
+    if(s->epfd != -1) {
+        close(s->epfd);
+        s->epfd = -1;
+    }
+    free(s->events);
+    s->events = NULL;
+}
 
-    if(NULL == key || NULL == key->s || INVALID_FD(key->fd)) {
-        ret = SELECTOR_IARGS;
+/**
+ * Los fds sin intereses no se mantienen en el epoll: de otro modo un
+ * EPOLLHUP/EPOLLERR (que epoll reporta siempre) despertaría al selector en cada
+ * iteración por un fd que nadie quiere atender. Así respetamos la misma
+ * semántica que select(2).
+ */
+static selector_status
+epoll_update(fd_selector s, const struct item *item, const fd_interest old) {
+    selector_status ret = SELECTOR_SUCCESS;
+    struct epoll_event ev = {
+        .events  = 0,
+        .data.fd = item->fd,
+    };
+    int op;
+
+    if(item->interest & OP_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if(item->interest & OP_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if(OP_NOOP == old && OP_NOOP == item->interest) {
+        goto finally;
+    } else if(OP_NOOP == old) {
+        op = EPOLL_CTL_ADD;
+    } else if(OP_NOOP == item->interest) {
+        op = EPOLL_CTL_DEL;
+    } else if(old != item->interest) {
+        op = EPOLL_CTL_MOD;
     } else {
-        ret = selector_set_interest(key->s, key->fd, i);
+        goto finally;
     }
 
+    if(-1 == epoll_ctl(s->epfd, op, item->fd, &ev)) {
+        // al desregistrar el fd puede ya haber sido cerrado, y en ese caso
+        // el kernel ya lo quitó del epoll.
+        if(op != EPOLL_CTL_DEL) {
+            ret = SELECTOR_IO;
+        }
+    }
+finally:
     return ret;
 }
 
 /**
- * se encarga de manejar los resultados del select.
- * se encuentra separado para facilitar el testing
+ * despacha los eventos que retornó epoll_wait(2). El costo depende de la
+ * cantidad de fds listos y no del fd máximo.
  */
 static void
-handle_iteration(fd_selector s) {
-    int n = s->max_fd;
+epoll_handle_iteration(fd_selector s, const int n) {
     struct selector_key key = {
         .s = s,
     };
 
-    for (int i = 0; i <= n; i++) {
-        struct item *item = s->fds + i;
+    for (int i = 0; i < n; i++) {
+        const uint32_t events = s->events[i].events;
+        struct item *item = s->fds + s->events[i].data.fd;
         if(ITEM_USED(item)) {
             key.fd   = item->fd;
             key.data = item->data;
-            if(FD_ISSET(item->fd, &s->slave_r)) {
+            if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
                 if(OP_READ & item->interest) {
                     if(0 == item->handler->handle_read) {
                         assert(("OP_READ arrived but no handler. bug!" == 0));
                     } else {
-                        item->handler->handle_read(&key);
+                        handler_run(s, &s->loop.read, item->handler->handle_read, &key);
+                        // el handler pudo registrar fds y agrandar la tabla
+                        item = s->fds + key.fd;
                     }
                 }
             }
-            if(FD_ISSET(item->fd, &s->slave_w)) {
+            if(ITEM_USED(item) && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
                 if(OP_WRITE & item->interest) {
                     if(0 == item->handler->handle_write) {
                         assert(("OP_WRITE arrived but no handler. bug!" == 0));
                     } else {
-                        item->handler->handle_write(&key);
+                        handler_run(s, &s->loop.write, item->handler->handle_write, &key);
                     }
                 }
             }
@@ -481,103 +710,1572 @@ handle_iteration(fd_selector s) {
     }
 }
 
-// lanza el handler de todas las tareas bloqueantes que ya se hayan resuelto
-static void
-handle_block_notifications(fd_selector s) {
-    struct selector_key key = {
-        .s = s,
-    };
-    pthread_mutex_lock(&s->resolution_mutex);
-    struct blocking_job *aux = s->resolution_jobs;
-    for(struct blocking_job *j = aux; j != NULL ; ) {
+static selector_status
+epoll_wait_(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
 
-        struct item *item = s->fds + j->fd;
-        if(ITEM_USED(item)) {
-            key.fd   = item->fd;
-            key.data = item->data;
-            item->handler->handle_block(&key);
+    // redondeamos para arriba: despertarse antes de un temporizador es una vuelta en vano
+    const int timeout = s->wait_t.tv_sec * 1000 + (s->wait_t.tv_nsec + 999999) / 1000000;
+    int fds = epoll_wait(s->epfd, s->events, EPOLL_MAX_EVENTS, timeout);
+    loop_woke(s, fds > 0 ? (unsigned) fds : 0);
+    if(-1 == fds) {
+        switch(errno) {
+            case EAGAIN:
+            case EINTR:
+                // si una señal nos interrumpio. ok!
+                break;
+            default:
+                ret = SELECTOR_IO;
+                break;
         }
-        
-        aux = j;
-        j = j->next;
-        free(aux);
+    } else {
+        epoll_handle_iteration(s, fds);
     }
-    s->resolution_jobs = 0;
-    pthread_mutex_unlock(&s->resolution_mutex);
+    return ret;
 }
 
+static const struct engine epoll_engine = {
+    .name      = "epoll",
+    .max_items = epoll_max_items,
+    .init      = epoll_init,
+    .destroy   = epoll_destroy,
+    .update    = epoll_update,
+    .wait      = epoll_wait_,
+};
 
-selector_status
-selector_notify_block(fd_selector s, const int fd) {
+////////////////////////////////////////////////////////////////////////////////
+// MOTOR io_uring(7)
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * En lugar de preguntar qué fds están listos, encolamos operaciones en la
+ * submission queue y el kernel nos avisa en la completion queue cuando
+ * terminan. Todas las operaciones de una iteración se envían con una única
+ * llamada a io_uring_enter(2).
+ *
+ * Para los fds comunes se encola un poll (IORING_OP_POLL_ADD) por cada
+ * interés, lo que respeta la semántica del resto de los motores.
+ *
+ * Para los fds en modo relay (ver selector_set_relay) el motor realiza
+ * directamente la lectura/escritura sobre buffers registrados en el kernel
+ * (IORING_OP_READ_FIXED / IORING_OP_WRITE_FIXED), y se le entrega el
+ * resultado a los handlers en `key->io_ptr' y `key->io_result'.
+ */
+
+/** tamaño de la submission queue */
+#define URING_ENTRIES       4096
+/** user_data de las operaciones cuya respuesta no nos interesa (cancelaciones) */
+#define URING_IGNORE        UINT64_MAX
+
+enum uring_op_kind {
+    URING_OP_FREE,
+    URING_OP_POLL,
+    URING_OP_READ,
+    URING_OP_WRITE,
+};
+
+/** operación en curso. su índice en uring.ops es el user_data del sqe */
+struct uring_op {
+    enum uring_op_kind  kind;
+    /** fd sobre el que se realiza */
+    int                 fd;
+    /** buffer relay involucrado, -1 si no hay */
+    int                 slot;
+    /** dirección de la lectura/escritura */
+    uint8_t            *ptr;
+    /** siguiente en la lista de libres */
+    int                 next;
+};
+
+/** buffer registrado en el kernel para el modo relay */
+struct relay_slot {
+    /** lo tiene alguien (selector_relay_buffer_get) */
+    bool        in_use;
+    /** cantidad de operaciones del kernel que lo referencian */
+    unsigned    inflight;
+    /** siguiente en la lista de libres */
+    int         next;
+};
+
+struct uring {
+    int                  fd;
+
+    // submission queue
+    unsigned            *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe *sqes;
+    /** tail local: los sqes hasta acá se publican en el próximo enter */
+    unsigned             sq_local_tail;
+
+    // completion queue
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /**
+     * completions que se sacaron del ring para que el kernel acepte más
+     * sqes (ver uring_flush). Se despachan antes que las del ring.
+     */
+    struct io_uring_cqe *backlog;
+    size_t               backlog_head, backlog_n, backlog_size;
+
+    void                *ring;
+    size_t               ring_size, sqes_size;
+
+    /** operaciones en curso */
+    struct uring_op     *ops;
+    size_t               ops_size;
+    int                  ops_free;
+
+    /** buffers del modo relay: un único bloque registrado como buf_index 0 */
+    uint8_t             *relay;
+    size_t               relay_count;
+    struct relay_slot   *slots;
+    int                  slots_free;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static size_t
+uring_max_items(void) {
+    return epoll_max_items();
+}
+
+/** registra los buffers del modo relay. si falla el motor funciona sin relay */
+static void
+uring_relay_init(struct uring *u, const size_t count) {
+    const size_t size = count * SELECTOR_RELAY_BUFFER_SIZE;
+
+    if(count == 0) {
+        goto fail;
+    }
+    u->relay = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(MAP_FAILED == u->relay) {
+        u->relay = NULL;
+        goto fail;
+    }
+    u->slots = calloc(count, sizeof(*u->slots));
+    if(NULL == u->slots) {
+        goto fail;
+    }
+    struct iovec iov = {
+        .iov_base = u->relay,
+        .iov_len  = size,
+    };
+    if(-1 == sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1)) {
+        goto fail;
+    }
+    for(size_t i = 0; i < count; i++) {
+        u->slots[i].next = i + 1 < count ? (int) i + 1 : -1;
+    }
+    u->slots_free  = 0;
+    u->relay_count = count;
+    return;
+
+fail:
+    if(u->relay != NULL) {
+        munmap(u->relay, size);
+        u->relay = NULL;
+    }
+    free(u->slots);
+    u->slots       = NULL;
+    u->slots_free  = -1;
+    u->relay_count = 0;
+}
+
+static void
+uring_destroy(fd_selector s) {
+    struct uring *u = s->uring;
+    if(u == NULL) {
+        return;
+    }
+    // al cerrar el ring el kernel cancela todo lo que esté en curso
+    if(u->fd != -1) {
+        close(u->fd);
+    }
+    if(u->ring != NULL) {
+        munmap(u->ring, u->ring_size);
+    }
+    if(u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if(u->relay != NULL) {
+        munmap(u->relay, u->relay_count * SELECTOR_RELAY_BUFFER_SIZE);
+    }
+    free(u->slots);
+    free(u->ops);
+    free(u->backlog);
+    free(u);
+    s->uring = NULL;
+}
+
+static selector_status
+uring_init(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
+    struct io_uring_params p;
+    struct uring *u = calloc(1, sizeof(*u));
 
-    // TODO(juan): usar un pool
-    struct blocking_job *job = malloc(sizeof(*job));
-    if(job == NULL) {
+    if(u == NULL) {
         ret = SELECTOR_ENOMEM;
         goto finally;
     }
-    job->s  = s;
-    job->fd = fd;
+    s->uring    = u;
+    u->ops_free = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if(-1 == u->fd) {
+        ret = SELECTOR_IO;
+        goto finally;
+    }
+    // necesitamos esperar con timeout (EXT_ARG), un único
+    // mmap para ambas colas, y que el kernel no descarte completions.
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+                            | IORING_FEAT_EXT_ARG;
+    if((p.features & required) != required) {
+        ret = SELECTOR_IO;
+        goto finally;
+    }
+
+    const size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    const size_t cq_size = p.cq_off.cqes
+                         + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == u->ring) {
+        u->ring = NULL;
+        ret = SELECTOR_IO;
+        goto finally;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(MAP_FAILED == u->sqes) {
+        u->sqes = NULL;
+        ret = SELECTOR_IO;
+        goto finally;
+    }
 
-    // encolamos en el selector los resultados
-    pthread_mutex_lock(&s->resolution_mutex);
-    job->next = s->resolution_jobs;
-    s->resolution_jobs = job;
-    pthread_mutex_unlock(&s->resolution_mutex);
+    uint8_t *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+
+    // usamos los sqes en orden, así que el arreglo de indirección es la identidad
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for(unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
 
-    // notificamos al hilo principal
-    pthread_kill(s->selector_thread, conf.signal);
+    uring_relay_init(u, conf.relay_buffers);
 
 finally:
+    if(SELECTOR_SUCCESS != ret) {
+        uring_destroy(s);
+    }
     return ret;
 }
 
-selector_status
-selector_select(fd_selector s) {
-    selector_status ret = SELECTOR_SUCCESS;
+/**
+ * pasa al backlog las completions que haya en el ring.
+ * @return false si no hay memoria (errno queda en ENOMEM)
+ */
+static bool
+uring_drain(struct uring *u) {
+    unsigned head = *u->cq_head;
+    const unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++) {
+        if(u->backlog_n == u->backlog_size) {
+            const size_t size = u->backlog_size == 0 ? 256 : 2 * u->backlog_size;
+            struct io_uring_cqe *tmp = realloc(u->backlog, size * sizeof(*tmp));
+            if(tmp == NULL) {
+                errno = ENOMEM;
+                return false;
+            }
+            u->backlog      = tmp;
+            u->backlog_size = size;
+        }
+        u->backlog[u->backlog_n++] = u->cqes[head & *u->cq_mask];
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return true;
+}
 
-    memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
-    memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-    memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+/**
+ * publica y envía al kernel los sqes pendientes, sin esperar.
+ *
+ * Si la cola de completions desbordó el kernel no acepta sqes (EBUSY) hasta
+ * que se le haga lugar, y acá no se pueden despachar (estamos dentro de un
+ * handler): se pasan al backlog, y las que el kernel tenía guardadas aparte
+ * pasan al ring al pedir completions. Lo pendiente se reintenta.
+ */
+static selector_status
+uring_flush(struct uring *u) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned pending = u->sq_local_tail
+                           - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(pending == 0 || -1 != sys_io_uring_enter(u->fd, pending, 0, 0, NULL, 0)) {
+        return SELECTOR_SUCCESS;
+    }
+    switch(errno) {
+        case EINTR:
+        case EAGAIN:
+            return SELECTOR_SUCCESS;
+        case EBUSY:
+            if(!uring_drain(u)) {
+                return SELECTOR_IO;
+            }
+            if(-1 == sys_io_uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0)
+               && errno != EINTR && errno != EBUSY) {
+                return SELECTOR_IO;
+            }
+            return uring_drain(u) ? SELECTOR_SUCCESS : SELECTOR_IO;
+        default:
+            return SELECTOR_IO;
+    }
+}
 
-    s->selector_thread = pthread_self();
+/**
+ * obtiene un sqe libre. Si la cola está llena envía lo pendiente.
+ * @return NULL si el kernel no los acepta (ver errno)
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *u) {
+    const unsigned entries = *u->sq_mask + 1;
+    while(u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+          >= entries) {
+        if(SELECTOR_SUCCESS != uring_flush(u)) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = u->sqes + (u->sq_local_tail & *u->sq_mask);
+    u->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
 
-    int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
-                      &emptyset);
-    if(-1 == fds) {
+/** reserva una operación en curso. retorna su índice o -1 */
+static int
+uring_op_new(struct uring *u, enum uring_op_kind kind, int fd, int slot,
+             uint8_t *ptr) {
+    if(u->ops_free == -1) {
+        const size_t size = u->ops_size == 0 ? 1024 : u->ops_size * 2;
+        struct uring_op *tmp = realloc(u->ops, size * sizeof(*tmp));
+        if(tmp == NULL) {
+            return -1;
+        }
+        for(size_t i = u->ops_size; i < size; i++) {
+            tmp[i].kind = URING_OP_FREE;
+            tmp[i].next = i + 1 < size ? (int) i + 1 : -1;
+        }
+        u->ops_free = u->ops_size;
+        u->ops      = tmp;
+        u->ops_size = size;
+    }
+    const int id = u->ops_free;
+    struct uring_op *op = u->ops + id;
+    u->ops_free = op->next;
+    op->kind = kind;
+    op->fd   = fd;
+    op->slot = slot;
+    op->ptr  = ptr;
+    if(slot != -1) {
+        u->slots[slot].inflight++;
+    }
+    return id;
+}
+
+/** índice del slot relay donde está `ptr' */
+static int
+uring_slot_of(struct uring *u, const uint8_t *ptr) {
+    return (int)((ptr - u->relay) / SELECTOR_RELAY_BUFFER_SIZE);
+}
+
+/** vuelve un slot a la lista de libres si nadie más lo referencia */
+static void
+uring_slot_release(struct uring *u, int slot) {
+    struct relay_slot *r = u->slots + slot;
+    if(!r->in_use && r->inflight == 0) {
+        r->next = u->slots_free;
+        u->slots_free = slot;
+    }
+}
+
+static void
+uring_op_free(struct uring *u, int id) {
+    struct uring_op *op = u->ops + id;
+    if(op->slot != -1) {
+        u->slots[op->slot].inflight--;
+        uring_slot_release(u, op->slot);
+    }
+    op->kind = URING_OP_FREE;
+    op->next = u->ops_free;
+    u->ops_free = id;
+}
+
+/** cancela la operación `id' (su completion llegará con -ECANCELED) */
+static selector_status
+uring_cancel(struct uring *u, int id, bool poll) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if(sqe == NULL) {
+        return SELECTOR_IO;
+    }
+    sqe->opcode    = poll ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = (uint64_t) id;
+    sqe->user_data = URING_IGNORE;
+    return SELECTOR_SUCCESS;
+}
+
+/**
+ * encola las operaciones que hagan falta para atender los intereses de
+ * `item' y cancela las que ya no interesan.
+ */
+static selector_status
+uring_arm(fd_selector s, struct item *item) {
+    struct uring *u = s->uring;
+    struct io_uring_sqe *sqe;
+    size_t n;
+    uint8_t *ptr;
+    int id;
+
+    if(item->rb != NULL) {
+        if((item->interest & OP_READ) && item->read_op == -1) {
+            ptr = buffer_write_ptr(item->rb, &n);
+            if(n > 0) {
+                id = uring_op_new(u, URING_OP_READ, item->fd,
+                                  uring_slot_of(u, item->rb->data), ptr);
+                if(id == -1) {
+                    return SELECTOR_ENOMEM;
+                }
+                sqe = uring_sqe(u);
+                if(sqe == NULL) {
+                    uring_op_free(u, id);
+                    return SELECTOR_IO;
+                }
+                sqe->opcode    = IORING_OP_READ_FIXED;
+                sqe->fd        = item->fd;
+                sqe->addr      = (uint64_t)(uintptr_t) ptr;
+                sqe->len       = n;
+                sqe->buf_index = 0;
+                sqe->user_data = id;
+                item->read_op  = id;
+            }
+        } else if(!(item->interest & OP_READ) && item->read_op != -1) {
+            if(SELECTOR_SUCCESS != uring_cancel(u, item->read_op, false)) {
+                return SELECTOR_IO;
+            }
+            item->read_op = -1;
+        }
+
+        if((item->interest & OP_WRITE) && item->write_op == -1) {
+            ptr = buffer_read_ptr(item->wb, &n);
+            if(n > 0) {
+                id = uring_op_new(u, URING_OP_WRITE, item->fd,
+                                  uring_slot_of(u, item->wb->data), ptr);
+                if(id == -1) {
+                    return SELECTOR_ENOMEM;
+                }
+                sqe = uring_sqe(u);
+                if(sqe == NULL) {
+                    uring_op_free(u, id);
+                    return SELECTOR_IO;
+                }
+                sqe->opcode    = IORING_OP_WRITE_FIXED;
+                sqe->fd        = item->fd;
+                sqe->addr      = (uint64_t)(uintptr_t) ptr;
+                sqe->len       = n;
+                sqe->buf_index = 0;
+                sqe->user_data = id;
+                item->write_op = id;
+            }
+        } else if(!(item->interest & OP_WRITE) && item->write_op != -1) {
+            if(SELECTOR_SUCCESS != uring_cancel(u, item->write_op, false)) {
+                return SELECTOR_IO;
+            }
+            item->write_op = -1;
+        }
+    } else {
+        unsigned mask = 0;
+        if(item->interest & OP_READ) {
+            mask |= POLLIN;
+        }
+        if(item->interest & OP_WRITE) {
+            mask |= POLLOUT;
+        }
+        if(item->poll_op != -1 && item->poll_mask != mask) {
+            if(SELECTOR_SUCCESS != uring_cancel(u, item->poll_op, true)) {
+                return SELECTOR_IO;
+            }
+            item->poll_op = -1;
+        }
+        if(item->poll_op == -1 && mask != 0) {
+            id = uring_op_new(u, URING_OP_POLL, item->fd, -1, NULL);
+            if(id == -1) {
+                return SELECTOR_ENOMEM;
+            }
+            sqe = uring_sqe(u);
+            if(sqe == NULL) {
+                uring_op_free(u, id);
+                return SELECTOR_IO;
+            }
+            sqe->opcode       = IORING_OP_POLL_ADD;
+            sqe->fd           = item->fd;
+            sqe->poll32_events = mask;
+            sqe->user_data    = id;
+            item->poll_op     = id;
+            item->poll_mask   = mask;
+        }
+    }
+    return SELECTOR_SUCCESS;
+}
+
+static selector_status
+uring_update(fd_selector s, const struct item *item, const fd_interest old) {
+    // el item es nuestro: el const es por la interfaz del resto de los motores
+    return uring_arm(s, (struct item *) item);
+}
+
+static selector_status
+uring_relay(fd_selector s, struct item *item) {
+    struct uring *u = s->uring;
+
+    if(item->rb == NULL) {
+        // vuelve al modo normal. Aunque no se puedan cancelar, sus
+        // completions ya no son del item y se descartan
+        if(item->read_op != -1) {
+            uring_cancel(u, item->read_op, false);
+            item->read_op = -1;
+        }
+        if(item->write_op != -1) {
+            uring_cancel(u, item->write_op, false);
+            item->write_op = -1;
+        }
+        return uring_arm(s, item);
+    }
+    if(u->relay_count == 0) {
+        return SELECTOR_IARGS;
+    }
+    if(item->poll_op != -1) {
+        if(SELECTOR_SUCCESS != uring_cancel(u, item->poll_op, true)) {
+            return SELECTOR_IO;
+        }
+        item->poll_op = -1;
+    }
+    return uring_arm(s, item);
+}
+
+/** procesa una completion y despacha el evento al handler */
+static void
+uring_handle_cqe(fd_selector s, const struct io_uring_cqe *cqe) {
+    struct uring *u = s->uring;
+
+    if(cqe->user_data == URING_IGNORE) {
+        return;
+    }
+    const int id = (int) cqe->user_data;
+    const struct uring_op op = u->ops[id];
+    uring_op_free(u, id);
+
+    struct item *item = s->fds + op.fd;
+    if(!ITEM_USED(item)) {
+        return;
+    }
+    struct selector_key key = {
+        .s    = s,
+        .fd   = item->fd,
+        .data = item->data,
+    };
+    const int res = cqe->res;
+
+    switch(op.kind) {
+        case URING_OP_POLL: {
+            if(item->poll_op != id) {
+                break; // cancelado o de un item anterior con el mismo fd
+            }
+            item->poll_op = -1;
+            if(res == -ECANCELED) {
+                break;
+            }
+            const unsigned events = res < 0 ? POLLERR : (unsigned) res;
+            if((events & (POLLIN | POLLHUP | POLLERR))
+               && (OP_READ & item->interest)) {
+                handler_run(s, &s->loop.read, item->handler->handle_read, &key);
+                // el handler pudo registrar fds y agrandar la tabla
+                item = s->fds + op.fd;
+            }
+            if(ITEM_USED(item) && (events & (POLLOUT | POLLHUP | POLLERR))
+               && (OP_WRITE & item->interest)) {
+                handler_run(s, &s->loop.write, item->handler->handle_write, &key);
+            }
+            break;
+        }
+        case URING_OP_READ:
+            if(item->read_op != id) {
+                break;
+            }
+            item->read_op = -1;
+            if(res != -ECANCELED && (OP_READ & item->interest)) {
+                key.io_ptr    = op.ptr;
+                key.io_result = res;
+                handler_run(s, &s->loop.read, item->handler->handle_read, &key);
+            }
+            break;
+        case URING_OP_WRITE:
+            if(item->write_op != id) {
+                break;
+            }
+            item->write_op = -1;
+            if(res != -ECANCELED && (OP_WRITE & item->interest)) {
+                key.io_ptr    = op.ptr;
+                key.io_result = res;
+                handler_run(s, &s->loop.write, item->handler->handle_write, &key);
+            }
+            break;
+        default:
+            break;
+    }
+
+    // los polls son de una sola vez: si sigue interesado lo volvemos a encolar
+    item = s->fds + op.fd;
+    if(ITEM_USED(item)) {
+        uring_arm(s, item);
+    }
+}
+
+static selector_status
+uring_wait(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
+    struct uring *u = s->uring;
+
+    struct __kernel_timespec ts = {
+        .tv_sec  = s->wait_t.tv_sec,
+        .tv_nsec = s->wait_t.tv_nsec,
+    };
+    // sin máscara de señales: sólo el timeout
+    struct io_uring_getevents_arg arg = {
+        .ts         = (uint64_t)(uintptr_t) &ts,
+    };
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned pending = u->sq_local_tail
+                           - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    // si ya hay completions no hace falta bloquearse
+    const unsigned ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)
+                         - *u->cq_head + (unsigned) (u->backlog_n - u->backlog_head);
+    if(-1 == sys_io_uring_enter(u->fd, pending, ready > 0 ? 0 : 1,
+                                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                &arg, sizeof(arg))) {
         switch(errno) {
             case EAGAIN:
+            case EBUSY:
             case EINTR:
-                // si una señal nos interrumpio. ok!
-                break;
-            case EBADF:
-                // ayuda a encontrar casos donde se cierran los fd pero no
-                // se desregistraron
-                for(int i = 0 ; i < s->max_fd; i++) {
-                    if(FD_ISSET(i, &s->master_r)|| FD_ISSET(i, &s->master_w)) {
-                        if(-1 == fcntl(i, F_GETFD, 0)) {
-                            fprintf(stderr, "Bad descriptor detected: %d\n", i);
-                        }
-                    }
-                }
-                ret = SELECTOR_IO;
+            case ETIME:
+                // timeout o una señal nos interrumpio. ok!
                 break;
             default:
                 ret = SELECTOR_IO;
                 goto finally;
+        }
+    }
 
+    // sólo las que ya estaban: las que lleguen mientras tanto, en la próxima
+    unsigned n = (unsigned) (u->backlog_n - u->backlog_head)
+               + (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head);
+    loop_woke(s, n);
+    for(; n > 0; n--) {
+        struct io_uring_cqe cqe;
+        // primero las del backlog, que son anteriores. Un handler puede
+        // agregarle (ver uring_flush): se relee en cada vuelta
+        if(u->backlog_head < u->backlog_n) {
+            cqe = u->backlog[u->backlog_head++];
+        } else {
+            u->backlog_head = u->backlog_n = 0;
+            const unsigned head = *u->cq_head;
+            if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            cqe = u->cqes[head & *u->cq_mask];
+            // liberamos el lugar antes de despachar: los handlers pueden encolar
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
         }
-    } else {
-        handle_iteration(s);
+        uring_handle_cqe(s, &cqe);
     }
-    if(ret == SELECTOR_SUCCESS) {
-        handle_block_notifications(s);
+    if(u->backlog_head == u->backlog_n) {
+        u->backlog_head = u->backlog_n = 0;
     }
+
 finally:
     return ret;
 }
 
+static const struct engine uring_engine = {
+    .name      = "io_uring",
+    .max_items = uring_max_items,
+    .init      = uring_init,
+    .destroy   = uring_destroy,
+    .update    = uring_update,
+    .wait      = uring_wait,
+    .relay     = uring_relay,
+};
+
+bool
+selector_relay_supported(fd_selector s) {
+    return s->uring != NULL && s->uring->relay_count > 0;
+}
+
+uint8_t *
+selector_relay_buffer_get(fd_selector s) {
+    uint8_t *ret = NULL;
+    if(selector_relay_supported(s) && s->uring->slots_free != -1) {
+        struct uring *u = s->uring;
+        const int slot = u->slots_free;
+        u->slots_free = u->slots[slot].next;
+        u->slots[slot].in_use = true;
+        ret = u->relay + (size_t) slot * SELECTOR_RELAY_BUFFER_SIZE;
+    }
+    return ret;
+}
+
+void
+selector_relay_buffer_put(fd_selector s, uint8_t *buf) {
+    if(buf != NULL && s->uring != NULL) {
+        const int slot = uring_slot_of(s->uring, buf);
+        s->uring->slots[slot].in_use = false;
+        uring_slot_release(s->uring, slot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SELECTOR
+////////////////////////////////////////////////////////////////////////////////
+
+/** motores disponibles, en orden de preferencia */
+static const struct engine *engines[] = {
+    [SELECTOR_ENGINE_EPOLL]  = &epoll_engine,
+    [SELECTOR_ENGINE_SELECT] = &select_engine,
+    [SELECTOR_ENGINE_URING]  = &uring_engine,
+};
+
+/**
+ * inicializa el motor pedido. Si es el default, o si el pedido no está
+ * disponible (ej: io_uring deshabilitado en el kernel), el primero que ande.
+ */
+static selector_status
+engine_init(fd_selector s) {
+    selector_status ret = SELECTOR_IARGS;
+
+    if(conf.engine != SELECTOR_ENGINE_DEFAULT) {
+        if((size_t) conf.engine < N(engines) && engines[conf.engine] != NULL) {
+            s->engine = engines[conf.engine];
+            ret = s->engine->init(s);
+        }
+    }
+    for(size_t i = 0; i < N(engines) && ret != SELECTOR_SUCCESS; i++) {
+        if(engines[i] != NULL) {
+            s->engine = engines[i];
+            ret = s->engine->init(s);
+        }
+    }
+    if(SELECTOR_SUCCESS != ret) {
+        s->engine = NULL;
+    } else {
+        s->max_items = s->engine->max_items();
+    }
+    return ret;
+}
+
+static void handle_jobs(struct selector_key *key);
+static void timers_init(struct timer_wheel *w);
+static struct blocking_job *jobs_pool_new(fd_selector s);
+
+/** handler del eventfd de notificaciones (ver selector_post) */
+static const struct fd_handler jobs_handler = {
+    .handle_read  = handle_jobs,
+};
+
+fd_selector
+selector_new(const size_t initial_elements) {
+    size_t size = sizeof(struct fdselector);
+    fd_selector ret = malloc(size);
+    if(ret != NULL) {
+        memset(ret, 0x00, size);
+        ret->master_t.tv_sec  = conf.select_timeout.tv_sec;
+        ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
+        assert(ret->max_fd == 0);
+        ret->epfd             = -1;
+        timers_init(&ret->timers);
+        ret->jobs_head        = &ret->jobs_stub;
+        atomic_init(&ret->jobs_tail, &ret->jobs_stub);
+        atomic_init(&ret->jobs_stub.next, NULL);
+        ret->jobs_pool        = jobs_pool_new(ret);
+        ret->jobs_fd          = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(-1 == ret->jobs_fd
+           || NULL == ret->jobs_pool
+           || SELECTOR_SUCCESS != engine_init(ret)
+           || 0 != ensure_capacity(ret, initial_elements)
+           || SELECTOR_SUCCESS != selector_register(ret, ret->jobs_fd,
+                                                &jobs_handler, OP_READ, NULL)) {
+            selector_destroy(ret);
+            ret = NULL;
+        }
+    }
+    return ret;
+}
+
+void
+selector_destroy(fd_selector s) {
+    // lean ya que se llama desde los casos fallidos de _new.
+    if(s != NULL) {
+        if(s->fds != NULL) {
+            for(size_t i = 0; i < s->fd_size ; i++) {
+                if(ITEM_USED(s->fds + i)) {
+                    selector_unregister_fd(s, i);
+                }
+            }
+            free(s->fds);
+            s->fds     = NULL;
+            s->fd_size = 0;
+        }
+        if(s->jobs_fd != -1) {
+            close(s->jobs_fd);
+        }
+        // ya no hay productores: la cola está consistente
+        for(struct blocking_job *j = s->jobs_head; j != NULL; ) {
+            struct blocking_job *aux = j;
+            j = atomic_load(&j->next);
+            if(aux != &s->jobs_stub && !aux->pooled) {
+                free(aux);
+            }
+        }
+        free(s->jobs_pool);
+        free(s->dirty);
+        if(s->engine != NULL) {
+            s->engine->destroy(s);
+        }
+        free(s);
+    }
+}
+
+const char *
+selector_engine_name(fd_selector s) {
+    return s->engine->name;
+}
+
+#define INVALID_FD(s, fd)  ((fd) < 0 || (size_t)(fd) >= (s)->max_items)
+
+selector_status
+selector_register(fd_selector        s,
+                     const int          fd,
+                     const fd_handler  *handler,
+                     const fd_interest  interest,
+                     void *data) {
+    selector_status ret = SELECTOR_SUCCESS;
+    // 0. validación de argumentos
+    if(s == NULL || fd < 0 || handler == NULL) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    if(INVALID_FD(s, fd)) {
+        ret = SELECTOR_MAXFD;
+        goto finally;
+    }
+    // 1. tenemos espacio?
+    size_t ufd = (size_t)fd;
+    if(ufd >= s->fd_size) {
+        ret = ensure_capacity(s, ufd);
+        if(SELECTOR_SUCCESS != ret) {
+            goto finally;
+        }
+    }
+
+    // 2. registración
+    struct item * item = s->fds + ufd;
+    if(ITEM_USED(item)) {
+        ret = SELECTOR_FDINUSE;
+        goto finally;
+    } else {
+        item->fd       = fd;
+        item->handler  = handler;
+        item->interest = interest;
+        item->data     = data;
+
+        ret = s->engine->update(s, item, OP_NOOP);
+        if(SELECTOR_SUCCESS != ret) {
+            item_init(item);
+            goto finally;
+        }
+        item->committed = interest;
+
+        // actualizo colaterales
+        if(fd > s->max_fd) {
+            s->max_fd = fd;
+        }
+    }
+
+finally:
+    return ret;
+}
+
+selector_status
+selector_unregister_fd(fd_selector       s,
+                       const int         fd) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+
+    if(item->handler->handle_close != NULL) {
+        struct selector_key key = {
+            .s    = s,
+            .fd   = item->fd,
+            .data = item->data,
+        };
+        item->handler->handle_close(&key);
+    }
+
+    // si tenía cambios pendientes, el motor sólo conoce los confirmados
+    item->interest = OP_NOOP;
+    s->engine->update(s, item, item->committed);
+
+    item_init(item);
+    s->max_fd = items_max_fd(s, fd);
+
+finally:
+    return ret;
+}
+
+selector_status
+selector_set_interest(fd_selector s, int fd, fd_interest i) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    item->interest = i;
+    if(!item->dirty) {
+        if(s->dirty_n == s->dirty_size) {
+            const size_t size = s->dirty_size == 0 ? 64 : 2 * s->dirty_size;
+            int *tmp = realloc(s->dirty, size * sizeof(*tmp));
+            if(tmp == NULL) {
+                // sin memoria para diferirlo: lo aplicamos ya
+                ret = s->engine->update(s, item, item->committed);
+                if(SELECTOR_SUCCESS == ret) {
+                    item->committed = i;
+                }
+                goto finally;
+            }
+            s->dirty      = tmp;
+            s->dirty_size = size;
+        }
+        s->dirty[s->dirty_n++] = fd;
+        item->dirty = true;
+    }
+finally:
+    return ret;
+}
+
+selector_status
+selector_set_relay(fd_selector s, int fd, buffer *rb, buffer *wb) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(s, fd) || (size_t)fd >= s->fd_size
+       || (rb == NULL) != (wb == NULL)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item) || s->engine->relay == NULL) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    item->rb = rb;
+    item->wb = wb;
+    ret = s->engine->relay(s, item);
+    if(SELECTOR_SUCCESS != ret && rb != NULL) {
+        // pudo quedar encolada alguna operación: el fd sigue como antes
+        item->rb = NULL;
+        item->wb = NULL;
+        s->engine->relay(s, item);
+    }
+finally:
+    return ret;
+}
+
+selector_status
+selector_set_interest_key(struct selector_key *key, fd_interest i) {
+    selector_status ret;
+
+    if(NULL == key || NULL == key->s || INVALID_FD(key->s, key->fd)) {
+        ret = SELECTOR_IARGS;
+    } else {
+        ret = selector_set_interest(key->s, key->fd, i);
+    }
+
+    return ret;
+}
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/** suma `x' a un contador que sólo escribe el hilo del selector */
+static void
+counter_add(atomic_uint_fast64_t *v, const uint64_t x) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + x,
+                          memory_order_relaxed);
+}
+
+/** guarda en `v' el máximo entre su valor y `x' */
+static void
+atomic_max(atomic_uint_fast64_t *v, const uint64_t x) {
+    uint_fast64_t cur = atomic_load_explicit(v, memory_order_relaxed);
+    while(cur < x && !atomic_compare_exchange_weak_explicit(v, &cur, x,
+                            memory_order_relaxed, memory_order_relaxed)) {
+        // cur tiene el valor nuevo
+    }
+}
+
+/** agrega `job' a la cola de tareas. Lo puede llamar cualquier hilo */
+static void
+jobs_push(fd_selector s, struct blocking_job *job) {
+    atomic_store_explicit(&job->next, NULL, memory_order_relaxed);
+    struct blocking_job *prev = atomic_exchange(&s->jobs_tail, job);
+    // entre el exchange y este store la cola queda "cortada" (ver jobs_pop)
+    atomic_store_explicit(&prev->next, job, memory_order_release);
+}
+
+/**
+ * saca la primera tarea de la cola. Sólo lo llama el hilo del selector.
+ *
+ * Retorna NULL si no hay ninguna disponible; `busy' indica que un productor
+ * está a mitad de jobs_push y hay que reintentar más tarde.
+ */
+static struct blocking_job *
+jobs_pop(fd_selector s, bool *busy) {
+    struct blocking_job *head = s->jobs_head;
+    struct blocking_job *next = atomic_load_explicit(&head->next,
+                                                     memory_order_acquire);
+    *busy = false;
+    if(head == &s->jobs_stub) {
+        if(next == NULL) {
+            *busy = atomic_load(&s->jobs_tail) != head;
+            return NULL;
+        }
+        s->jobs_head = head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if(next != NULL) {
+        s->jobs_head = next;
+        return head;
+    }
+    if(head != atomic_load(&s->jobs_tail)) {
+        *busy = true;
+        return NULL;
+    }
+    // head es la última: volvemos a poner el stub detrás para poder sacarla
+    jobs_push(s, &s->jobs_stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if(next != NULL) {
+        s->jobs_head = next;
+        return head;
+    }
+    *busy = true;
+    return NULL;
+}
+
+static struct blocking_job *
+jobs_pool_new(fd_selector s) {
+    struct blocking_job *pool = calloc(JOBS_POOL_SIZE, sizeof(*pool));
+    if(pool != NULL) {
+        for(uint32_t i = 0; i < JOBS_POOL_SIZE; i++) {
+            pool[i].pooled = true;
+            atomic_init(&pool[i].free_next, i + 1 < JOBS_POOL_SIZE ? i + 2 : 0);
+        }
+        atomic_init(&s->jobs_free, 1);
+    }
+    return pool;
+}
+
+/** toma una tarea libre del pool. NULL si está agotado */
+static struct blocking_job *
+jobs_pool_get(fd_selector s) {
+    uint64_t old = atomic_load(&s->jobs_free), new;
+    struct blocking_job *job;
+
+    do {
+        const uint32_t idx = (uint32_t) old;
+        if(idx == 0) {
+            return NULL;
+        }
+        job = s->jobs_pool + idx - 1;
+        new = ((old >> 32) + 1) << 32
+            | atomic_load_explicit(&job->free_next, memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak(&s->jobs_free, &old, new));
+
+    return job;
+}
+
+static void
+jobs_pool_put(fd_selector s, struct blocking_job *job) {
+    if(!job->pooled) {
+        free(job);
+        return;
+    }
+    const uint32_t idx = (uint32_t)(job - s->jobs_pool) + 1;
+    uint64_t old = atomic_load(&s->jobs_free), new;
+    do {
+        atomic_store_explicit(&job->free_next, (uint32_t) old,
+                              memory_order_relaxed);
+        new = ((old >> 32) + 1) << 32 | idx;
+    } while(!atomic_compare_exchange_weak(&s->jobs_free, &old, new));
+}
+
+static void
+jobs_wakeup(fd_selector s) {
+    const uint64_t one = 1;
+    if(write(s->jobs_fd, &one, sizeof(one)) == -1) {
+        // sólo falla si el contador está al máximo: ya está despierto
+    }
+}
+
+// ejecuta las tareas encoladas con selector_post
+static void
+handle_jobs(struct selector_key *key) {
+    fd_selector s = key->s;
+    uint64_t count;
+    bool busy = false;
+
+    // leer resetea el contador del eventfd. Lo hacemos antes de mirar la
+    // cola: si alguien encola después, el eventfd vuelve a quedar listo.
+    if(read(s->jobs_fd, &count, sizeof(count)) == -1) {
+        // EAGAIN: otro lo leyó. La cola igual puede tener algo.
+    }
+
+    // las tareas pueden encolar otras: ponemos un límite para no quedarnos
+    // acá indefinidamente.
+    for(unsigned i = 0; i < JOBS_POOL_SIZE; i++) {
+        struct blocking_job *j = jobs_pop(s, &busy);
+        if(j == NULL) {
+            break;
+        }
+        if(j->posted_ns != 0) {
+            const uint64_t latency = now_ns() - j->posted_ns;
+            counter_add(&s->jobs_latency_samples, 1);
+            counter_add(&s->jobs_latency_total, latency);
+            if(latency > atomic_load_explicit(&s->jobs_latency_max,
+                                              memory_order_relaxed)) {
+                atomic_store_explicit(&s->jobs_latency_max, latency,
+                                      memory_order_relaxed);
+            }
+        }
+
+        j->task(s, j->data);
+        jobs_pool_put(s, j);
+        counter_add(&s->jobs_completed, 1);
+        atomic_fetch_sub(&s->jobs_depth, 1);
+    }
+
+    // quedó algo (un productor a medias o superamos el límite): quien lo
+    // encoló pudo no despertarnos porque jobs_depth no era 0.
+    if(busy || atomic_load(&s->jobs_depth) > 0) {
+        jobs_wakeup(s);
+    }
+}
+
+selector_status
+selector_post(fd_selector s, selector_task task, void *data) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    struct blocking_job *job = jobs_pool_get(s);
+    if(job == NULL) {
+        job = malloc(sizeof(*job));
+        if(job == NULL) {
+            ret = SELECTOR_ENOMEM;
+            goto finally;
+        }
+        job->pooled = false;
+        atomic_fetch_add_explicit(&s->jobs_pool_misses, 1, memory_order_relaxed);
+    }
+    // leer el reloj en cada tarea no es gratis: medimos una muestra
+    static _Thread_local unsigned sample = 0;
+    job->task      = task;
+    job->data      = data;
+    job->posted_ns = (sample++ & (JOBS_LATENCY_SAMPLE - 1)) == 0 ? now_ns() : 0;
+
+    jobs_push(s, job);
+
+    // se incrementa luego de encolar: si el selector ya la ejecutó,
+    // jobs_depth queda en -1 y vuelve a 0 sin despertarlo de nuevo.
+    // Si no era 0, quien la llevó de 0 a 1 ya lo despertó (o lo hará
+    // handle_jobs al ver que quedan tareas).
+    const long depth = atomic_fetch_add(&s->jobs_depth, 1);
+    if(depth == 0) {
+        jobs_wakeup(s);
+    }
+    if(depth >= 0) {
+        atomic_max(&s->jobs_max_depth, (uint64_t) depth + 1);
+    }
+
+finally:
+    return ret;
+}
+
+/** tarea de selector_notify_block: lanza el handle_block del fd */
+static void
+notify_block(fd_selector s, void *data) {
+    const int fd = (int)(intptr_t) data;
+    struct item *item = s->fds + fd;
+
+    if(ITEM_USED(item) && item->handler->handle_block != NULL) {
+        struct selector_key key = {
+            .s    = s,
+            .fd   = item->fd,
+            .data = item->data,
+        };
+        handler_run(s, &s->loop.block, item->handler->handle_block, &key);
+    }
+}
+
+selector_status
+selector_notify_block(fd_selector s, const int fd) {
+    return selector_post(s, notify_block, (void *)(intptr_t) fd);
+}
+
+void
+selector_jobs_stats(fd_selector s, struct selector_jobs_stats *stats) {
+    const long depth = atomic_load(&s->jobs_depth);
+
+    stats->completed        = atomic_load_explicit(&s->jobs_completed, memory_order_relaxed);
+    stats->pool_misses      = atomic_load_explicit(&s->jobs_pool_misses, memory_order_relaxed);
+    stats->depth            = depth > 0 ? (uint64_t) depth : 0;
+    stats->posted           = stats->completed + stats->depth;
+    stats->max_depth        = atomic_load_explicit(&s->jobs_max_depth, memory_order_relaxed);
+    stats->latency_samples  = atomic_load_explicit(&s->jobs_latency_samples, memory_order_relaxed);
+    stats->latency_total_ns = atomic_load_explicit(&s->jobs_latency_total, memory_order_relaxed);
+    stats->latency_max_ns   = atomic_load_explicit(&s->jobs_latency_max, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MEDICIONES DEL EVENT LOOP
+////////////////////////////////////////////////////////////////////////////////
+
+/** intervalo de `x': 0 para el 0, y si no 1 + log2(x), hasta el último */
+static unsigned
+hist_bucket(const uint64_t x) {
+    const unsigned b = x == 0 ? 0 : 64 - __builtin_clzll(x);
+    return b < SELECTOR_HIST_BUCKETS ? b : SELECTOR_HIST_BUCKETS - 1;
+}
+
+static void
+hist_add(struct loop_hist *h, const uint64_t x) {
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, x);
+    counter_add(&h->buckets[hist_bucket(x)], 1);
+    if(x > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, x, memory_order_relaxed);
+    }
+}
+
+/** suma `h' a `out' */
+static void
+hist_sum(const struct loop_hist *h, struct selector_hist *out) {
+    const uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->sum   += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    if(max > out->max) {
+        out->max = max;
+    }
+    for(unsigned i = 0; i < SELECTOR_HIST_BUCKETS; i++) {
+        out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+}
+
+/** lo llama el motor apenas retorna la espera, antes de despachar */
+static void
+loop_woke(fd_selector s, const unsigned events) {
+    s->loop.woke_ns = now_ns();
+    hist_add(&s->loop.events, events);
+}
+
+/**
+ * ejecuta un handler, midiendo cuánto tarda uno de cada LOOP_HANDLER_SAMPLE.
+ * El del eventfd no se mide: sólo ejecuta tareas, y las que lanzan un
+ * handle_block ya se miden por su lado.
+ */
+static void
+handler_run(fd_selector s, struct loop_hist *h,
+            void (*handler)(struct selector_key *), struct selector_key *key) {
+    if(key->fd == s->jobs_fd
+       || (s->loop.handlers++ & (LOOP_HANDLER_SAMPLE - 1)) != 0) {
+        handler(key);
+    } else {
+        const uint64_t start = now_ns();
+        handler(key);
+        hist_add(h, now_ns() - start);
+    }
+}
+
+void
+selector_loop_stats(fd_selector s, struct selector_loop_stats *stats) {
+    hist_sum(&s->loop.wait,     &stats->wait_ns);
+    hist_sum(&s->loop.dispatch, &stats->dispatch_ns);
+    hist_sum(&s->loop.events,   &stats->events);
+    hist_sum(&s->loop.read,     &stats->read_ns);
+    hist_sum(&s->loop.write,    &stats->write_ns);
+    hist_sum(&s->loop.block,    &stats->block_ns);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TEMPORIZADORES
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+now_ticks(void) {
+    return now_ns() / (TIMER_TICK_MS * 1000000ULL);
+}
+
+static void
+timers_init(struct timer_wheel *w) {
+    w->now = now_ticks();
+}
+
+/** ubica `t' en la posición de la rueda que corresponde a su vencimiento */
+static void
+timer_link(struct timer_wheel *w, struct selector_timer *t) {
+    if(t->expires < w->now) {
+        t->expires = w->now;
+    }
+    const uint64_t delta = t->expires - w->now;
+    unsigned level = 0;
+    while(level < WHEEL_LEVELS - 1
+          && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if(delta >= (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        // más allá de lo que cubre la rueda: lo acercamos
+        t->expires = w->now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    struct selector_timer **slot = &w->slots[level]
+                                     [(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next  = *slot;
+    t->pprev = slot;
+    if(*slot != NULL) {
+        (*slot)->pprev = &t->next;
+    }
+    *slot = t;
+}
+
+static void
+timer_unlink(struct selector_timer *t) {
+    *t->pprev = t->next;
+    if(t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+void
+selector_timer_add(fd_selector s, struct selector_timer *t, unsigned ms,
+                   selector_task task, void *data) {
+    struct timer_wheel *w = &s->timers;
+
+    if(t->pprev != NULL) {
+        timer_unlink(t);
+    } else {
+        w->pending++;
+    }
+    // redondeamos para arriba: nunca antes de tiempo
+    const uint64_t tick = TIMER_TICK_MS * 1000000ULL;
+    t->expires = (now_ns() + ms * 1000000ULL + tick - 1) / tick;
+    t->task    = task;
+    t->data    = data;
+    timer_link(w, t);
+}
+
+void
+selector_timer_cancel(fd_selector s, struct selector_timer *t) {
+    if(t->pprev != NULL) {
+        timer_unlink(t);
+        s->timers.pending--;
+    }
+}
+
+/**
+ * reparte los temporizadores de la posición actual del nivel `level' en los
+ * niveles inferiores. Retorna esa posición: si es 0 el nivel dio una vuelta.
+ */
+static unsigned
+timers_cascade(struct timer_wheel *w, const unsigned level) {
+    const unsigned idx = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct selector_timer *t = w->slots[level][idx];
+
+    w->slots[level][idx] = NULL;
+    while(t != NULL) {
+        struct selector_timer *next = t->next;
+        timer_link(w, t);
+        t = next;
+    }
+    return idx;
+}
+
+/** ejecuta los temporizadores vencidos */
+static void
+timers_run(fd_selector s) {
+    struct timer_wheel *w = &s->timers;
+    const uint64_t now = now_ticks();
+
+    if(w->pending == 0) {
+        // nada que recorrer
+        w->now = now + 1;
+        return;
+    }
+    for(; w->now <= now; w->now++) {
+        const unsigned idx = w->now & WHEEL_MASK;
+        if(idx == 0) {
+            for(unsigned level = 1; level < WHEEL_LEVELS; level++) {
+                if(timers_cascade(w, level) != 0) {
+                    break;
+                }
+            }
+        }
+        // de a uno: la tarea puede cancelar otros temporizadores de la lista
+        struct selector_timer *t;
+        while((t = w->slots[0][idx]) != NULL) {
+            timer_unlink(t);
+            w->pending--;
+            t->task(s, t->data);
+        }
+    }
+}
+
+/**
+ * calcula en `ts' cuánto puede bloquearse la espera: hasta el próximo
+ * temporizador del nivel 0, o hasta que el nivel 0 dé la vuelta si no hay
+ * ninguno (ahí se reparten los de niveles superiores), sin pasarse del
+ * timeout configurado.
+ */
+static void
+timers_timeout(fd_selector s, struct timespec *ts) {
+    struct timer_wheel *w = &s->timers;
+
+    *ts = s->master_t;
+    if(w->pending == 0) {
+        return;
+    }
+
+    // en los ticks múltiplos de WHEEL_SIZE hay que repartir el nivel siguiente
+    uint64_t next = w->now;
+    while((next & WHEEL_MASK) != 0 && w->slots[0][next & WHEEL_MASK] == NULL) {
+        next++;
+    }
+
+    const uint64_t now = now_ns();
+    const uint64_t at  = next * TIMER_TICK_MS * 1000000ULL;
+    const uint64_t ns  = at > now ? at - now : 0;
+    if(ns < (uint64_t) s->master_t.tv_sec * 1000000000ULL + s->master_t.tv_nsec) {
+        ts->tv_sec  = ns / 1000000000ULL;
+        ts->tv_nsec = ns % 1000000000ULL;
+    }
+}
+
+/**
+ * refleja en el motor los intereses que cambiaron durante la iteración, de
+ * una vez antes de esperar. Si un fd cambió varias veces sólo se aplica el
+ * último valor, y si volvió al original el motor no hace nada (ej: epoll no
+ * llama a epoll_ctl(2)).
+ *
+ * Un error del motor ya no le llega a quien cambió el interés: se informa
+ * por stderr y el fd queda con los intereses anteriores.
+ */
+static void
+interests_commit(fd_selector s) {
+    for(size_t i = 0; i < s->dirty_n; i++) {
+        struct item *item = s->fds + s->dirty[i];
+        // se pudo desregistrar (y hasta volver a registrar) en el medio
+        if(!ITEM_USED(item) || !item->dirty) {
+            continue;
+        }
+        item->dirty = false;
+        const selector_status st = s->engine->update(s, item, item->committed);
+        if(SELECTOR_SUCCESS == st) {
+            item->committed = item->interest;
+        } else {
+            fprintf(stderr, "Selector: updating interests of fd %d: %s\n", item->fd,
+                    st == SELECTOR_IO ? strerror(errno) : selector_error(st));
+            item->interest = item->committed;
+        }
+    }
+    s->dirty_n = 0;
+}
+
+uint64_t
+selector_iteration(fd_selector s) {
+    return s->iteration;
+}
+
+selector_status
+selector_select(fd_selector s) {
+    const uint64_t start = now_ns();
+    s->iteration++;
+    interests_commit(s);
+    timers_timeout(s, &s->wait_t);
+
+    s->loop.wait_ns = now_ns();
+    s->loop.woke_ns = 0;
+    selector_status ret = s->engine->wait(s);
+    if(ret == SELECTOR_SUCCESS) {
+        timers_run(s);
+    }
+
+    const uint64_t end  = now_ns();
+    const uint64_t woke = s->loop.woke_ns == 0 ? end : s->loop.woke_ns;
+    hist_add(&s->loop.wait, woke - s->loop.wait_ns);
+    hist_add(&s->loop.dispatch, (s->loop.wait_ns - start) + (end - woke));
+    return ret;
+}
+
 int
 selector_fd_set_nio(const int fd) {
     int ret = 0;
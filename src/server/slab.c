@@ -0,0 +1,281 @@
+/**
+ * slab.c - objetos de un mismo tamaño tomados de bloques grandes
+ */
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB, madvise
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../include/slab.h"
+
+/** tamaño de los bloques respaldados por huge pages */
+#define HUGE_BLOCK_SIZE (2 * 1024 * 1024)
+
+/**
+ * un bloque pedido al sistema. La cuenta va al principio del bloque mismo, y
+ * como los bloques están alineados a su tamaño se llega a ella desde
+ * cualquiera de sus objetos.
+ */
+struct block {
+    /** vecinos en la lista de su estado (ver struct slab) */
+    struct block  *next, *prev;
+    uint8_t       *objects;
+    size_t         nfree;
+    /**
+     * índices de los objetos libres, el último devuelto arriba. No se guarda
+     * nada en los objetos libres, así su memoria se le puede devolver al
+     * sistema (ver slab_release)
+     */
+    uint32_t       free[];
+};
+
+struct slab {
+    size_t              size;
+    size_t              block_size;
+    size_t              per_block;
+    size_t              page;
+    struct slab_options opts;
+
+    /** bloques con objetos libres y en uso, sin libres, y sin objetos en uso */
+    struct block       *partial, *full, *empty;
+    /** objetos libres, sumando todos los bloques */
+    size_t              nfree;
+};
+
+static size_t
+round_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+struct slab *
+slab_new(size_t size, size_t block_size, const struct slab_options *opts) {
+    struct slab *s = calloc(1, sizeof(*s));
+
+    if (s == NULL) {
+        return NULL;
+    }
+    if (opts != NULL) {
+        s->opts = *opts;
+    }
+    if (s->opts.huge) {
+        block_size = HUGE_BLOCK_SIZE;
+    }
+    s->page       = (size_t) sysconf(_SC_PAGESIZE);
+    s->size       = round_up(size == 0 ? 1 : size, sizeof(void *));
+    s->block_size = block_size;
+
+    // los de tamaño múltiplo de página empiezan en una página, el resto en una línea de cache
+    const size_t align = s->size % s->page == 0 ? s->page : 64;
+    size_t n = block_size / s->size;
+    while (n > 0 && round_up(sizeof(struct block) + n * sizeof(uint32_t), align) + n * s->size > block_size) {
+        n--;
+    }
+    if (n == 0 || (block_size & (block_size - 1)) != 0 || block_size < s->page) {
+        free(s);
+        return NULL;
+    }
+    s->per_block = n;
+    return s;
+}
+
+/** saca a `b' de la lista `list' */
+static void
+list_remove(struct block **list, struct block *b) {
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        *list = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+    b->next = b->prev = NULL;
+}
+
+/** pone a `b' primero en la lista `list' */
+static void
+list_push(struct block **list, struct block *b) {
+    b->prev = NULL;
+    b->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = b;
+    }
+    *list = b;
+}
+
+/** `block_size' bytes alineados a su tamaño, o MAP_FAILED */
+static void *
+map_block(const struct slab *s) {
+    const size_t len = s->block_size;
+    uint8_t *p;
+
+#ifdef MAP_HUGETLB
+    if (s->opts.huge) {
+        // las huge pages reservadas quedan alineadas a su tamaño
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            return p;
+        }
+    }
+#endif
+    // se pide el doble y se recorta lo que sobra a cada lado
+    p = mmap(NULL, 2 * len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return p;
+    }
+    uint8_t *aligned = (uint8_t *) round_up((uintptr_t) p, len);
+    if (aligned != p) {
+        munmap(p, aligned - p);
+    }
+    munmap(aligned + len, p + len - aligned);
+#ifdef MADV_HUGEPAGE
+    if (s->opts.huge) {
+        madvise(aligned, len, MADV_HUGEPAGE);
+    }
+#endif
+    return aligned;
+}
+
+/** pide un bloque al sistema y lo agrega a los vacíos */
+static bool
+slab_grow(struct slab *s) {
+    struct block *b = map_block(s);
+
+    if (b == MAP_FAILED) {
+        return false;
+    }
+    const size_t align = s->size % s->page == 0 ? s->page : 64;
+    b->objects = (uint8_t *) b + round_up(sizeof(struct block) + s->per_block * sizeof(uint32_t), align);
+    b->nfree   = s->per_block;
+    // en orden inverso, así se entregan de menor a mayor dirección
+    for (size_t i = 0; i < s->per_block; i++) {
+        b->free[i] = (uint32_t) (s->per_block - 1 - i);
+    }
+    list_push(&s->empty, b);
+    s->nfree += s->per_block;
+
+    if (s->opts.stats != NULL) {
+        atomic_fetch_add_explicit(&s->opts.stats->objects, s->per_block, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->opts.stats->bytes, s->block_size, memory_order_relaxed);
+    }
+    return true;
+}
+
+/** le devuelve al sistema el bloque vacío `b' */
+static void
+slab_unmap(struct slab *s, struct block *b) {
+    list_remove(&s->empty, b);
+    s->nfree -= s->per_block;
+    munmap(b, s->block_size);
+
+    if (s->opts.stats != NULL) {
+        atomic_fetch_sub_explicit(&s->opts.stats->objects, s->per_block, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&s->opts.stats->bytes, s->block_size, memory_order_relaxed);
+    }
+}
+
+bool
+slab_reserve(struct slab *s, size_t n) {
+    while (s->nfree < n) {
+        if (!slab_grow(s)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void *
+slab_get(struct slab *s) {
+    struct block *b = s->partial;
+
+    if (b == NULL) {
+        if (s->empty == NULL && !slab_grow(s)) {
+            return NULL;
+        }
+        b = s->empty;
+        list_remove(&s->empty, b);
+        list_push(&s->partial, b);
+    }
+    const uint32_t i = b->free[--b->nfree];
+    s->nfree--;
+    if (b->nfree == 0) {
+        list_remove(&s->partial, b);
+        list_push(&s->full, b);
+    }
+
+    struct slab_stats *stats = s->opts.stats;
+    if (stats != NULL) {
+        const size_t in_use = atomic_fetch_add_explicit(&stats->in_use, 1, memory_order_relaxed) + 1;
+        size_t peak = atomic_load_explicit(&stats->peak, memory_order_relaxed);
+        while (in_use > peak && !atomic_compare_exchange_weak_explicit(&stats->peak, &peak, in_use,
+                                    memory_order_relaxed, memory_order_relaxed)) {
+            // otro hilo lo cambió: `peak' tiene el valor nuevo
+        }
+    }
+    return b->objects + (size_t) i * s->size;
+}
+
+void
+slab_put(struct slab *s, void *p) {
+    if (p == NULL) {
+        return;
+    }
+    struct block *b = (struct block *) ((uintptr_t) p & ~(uintptr_t) (s->block_size - 1));
+
+    if (b->nfree == 0) {
+        list_remove(&s->full, b);
+        list_push(&s->partial, b);
+    }
+    b->free[b->nfree++] = (uint32_t) (((uint8_t *) p - b->objects) / s->size);
+    s->nfree++;
+    if (b->nfree == s->per_block) {
+        list_remove(&s->partial, b);
+        list_push(&s->empty, b);
+    }
+    if (s->opts.stats != NULL) {
+        atomic_fetch_sub_explicit(&s->opts.stats->in_use, 1, memory_order_relaxed);
+    }
+
+    if (s->opts.high != 0 && s->nfree > s->opts.high) {
+        while (s->empty != NULL && s->nfree >= s->opts.low + s->per_block) {
+            slab_unmap(s, s->empty);
+        }
+    }
+}
+
+void
+slab_release(struct slab *s, void *p) {
+    if (p == NULL) {
+        return;
+    }
+    // sólo las páginas enteras del objeto: las otras las comparte con sus vecinos
+    const uintptr_t start = round_up((uintptr_t) p, s->page);
+    const uintptr_t end   = ((uintptr_t) p + s->size) & ~(uintptr_t) (s->page - 1);
+    if (start < end) {
+        madvise((void *) start, end - start, MADV_DONTNEED);
+    }
+    slab_put(s, p);
+}
+
+void
+slab_destroy(struct slab *s) {
+    if (s == NULL) {
+        return;
+    }
+    struct block *lists[] = { s->partial, s->full, s->empty };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        for (struct block *b = lists[i], *next; b != NULL; b = next) {
+            next = b->next;
+            if (s->opts.stats != NULL) {
+                // los objetos en uso dejan de existir
+                atomic_fetch_sub_explicit(&s->opts.stats->in_use, s->per_block - b->nfree, memory_order_relaxed);
+                atomic_fetch_sub_explicit(&s->opts.stats->objects, s->per_block, memory_order_relaxed);
+                atomic_fetch_sub_explicit(&s->opts.stats->bytes, s->block_size, memory_order_relaxed);
+            }
+            munmap(b, s->block_size);
+        }
+    }
+    free(s);
+}
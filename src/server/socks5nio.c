@@ -1,6 +1,7 @@
 /**
  * socks5nio.c  - controla el flujo de un proxy SOCKSv5 (sockets no bloqueantes)
  */
+#define _GNU_SOURCE // splice(2), pipe2(2)
 #include <stdio.h>
 #include <stdlib.h>  // malloc
 #include <string.h>  // memset
@@ -8,7 +9,9 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>  // close
+#include <fcntl.h>   // splice
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <arpa/inet.h>
 
@@ -21,15 +24,34 @@
 #include "../include/stm.h"
 #include "../include/socks5nio.h"
 #include "../include/netutils.h"
+#include "../include/resolver.h"
+#include "../include/dnscache.h"
+#include "../include/scoreboard.h"
+#include "../include/slab.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
-#define RAW_BUFFER_SIZE 1024
+/** bytes de cada bloque que piden al sistema los slabs de buffers y de sesiones */
+#define BUFFER_BLOCK  (256 * 1024)
+#define SESSION_BLOCK (256 * 1024)
+/** lecturas seguidas que llenan el buffer para pasar a la clase siguiente (ver copy_adapt) */
+#define BUFFER_GROW_AFTER 4
+/** lecturas seguidas que entran holgadas en la clase anterior para volver a ella */
+#define BUFFER_SHRINK_AFTER 64
+
+/** máximo que se le pide a cada splice(2): más de lo que entra en un pipe */
+#define SPLICE_MAX_LEN (1 << 20)
+/** bytes que el disector ve por vez en modo splice (ver copy_splice_w) */
+#define TEE_WINDOW 4096
+
+/** conexiones al origin server que se intentan a la vez (ver REQUEST_CONNECTING) */
+#define MAX_CONNECT_ATTEMPTS 4
 
 // Estadisticas del servidor proxy a ser consultadas por el protocolo de monitoreo
-uint32_t historic_connections = 0;
-uint32_t current_connections  = 0;
-uint32_t bytes_transferred    = 0;
+// Son atómicas porque cada worker (ver workers.h) actualiza las suyas.
+_Atomic uint32_t historic_connections = 0;
+_Atomic uint32_t current_connections  = 0;
+_Atomic uint32_t bytes_transferred    = 0;
 
 uint32_t socksv5_historic_connections() {
     return historic_connections;
@@ -129,9 +151,15 @@ enum socks_v5state {
 
     /**
      * Espera que se establezca la conexion al origin server
+     *
+     * Si el nombre resolvió a varias direcciones se intentan como en Happy
+     * Eyeballs (RFC 8305): alternando familias, y empezando un intento nuevo
+     * cada `connect_delay' ms (o apenas falla uno) sin abandonar los
+     * anteriores. El primero que se conecta pasa a ser el origin_fd y se
+     * cierran los demás.
      * 
      * Intereses:
-     *     - OP_WRITE sobre origin_fd
+     *     - OP_WRITE sobre cada attempt_fds en curso
      *     - OP_NOOP sobre client_fd
      *
      * Transiciones:
@@ -160,6 +188,7 @@ enum socks_v5state {
      * Intereses: (tanto para client_fd como para origin_fd)
      *     - OP_READ  si hay espacio libre para escribir en el buffer de lectura
      *     - OP_WRITE si hay bytes para leer en el buffer de escritura
+     *     (en modo splice, el pipe de cada sentido hace de buffer)
      *
      * Transiciones:
      *   - DONE    cuando no queda nada mas por copiar
@@ -237,12 +266,74 @@ struct copy {
     // seria como el "intereses" de este extremo del copy, teniendo prendidos 1 o varios de los bits de OP_READ, OP_WRITE y OP_NOOP. Sirve para cerrar la escritura o la lectura.
     fd_interest duplex;
     struct copy *other; // el otro extremo del copy
+    /** modo splice (ver copy_splice_init): pipe por el que pasa lo leído de fd, NULL si se usa rb */
+    int         *pipe;
+    /** bytes en el pipe */
+    size_t      piped;
+    /** el pipe no aceptó más bytes: no se lee de fd hasta que se vacíe algo */
+    bool        pipe_full;
+    /** la última escritura en fd no entró entera: se espera a OP_WRITE (ver copy_write_through) */
+    bool        write_short;
+    /** lecturas seguidas que llenaron rb, y que hubieran entrado holgadas en la clase anterior */
+    unsigned    fills, lulls;
+};
+
+/**
+ * lo que sólo se usa hasta establecer el túnel (HELLO_READ a REQUEST_WRITE).
+ * Sale de su propio slab y vuelve a él al llegar a COPY (ver
+ * socks5_handshake_release): un túnel establecido no lo paga.
+ */
+struct handshake_st {
+    /** estados para el client_fd */
+    union {
+        struct hello_st           hello;
+        struct auth_st            auth;
+        struct request_st         request;
+    } client;
+
+    /** estado para el origin_fd */
+    struct connecting             conn;
+
+    /** copia del usuario autenticado: la tabla de usuarios puede cambiar */
+    char                          client_uname_buf[0xff];
+
+    /** resolucion DNS de la direc del origin server */
+    struct addrinfo               *origin_resolution;
+    /** siguiente direccion del origin server a intentar, NULL si no quedan */
+    struct addrinfo               *origin_resolution_current;
+    /** la resolución no se pudo iniciar: el pool está saturado */
+    bool                          origin_resolution_busy;
+
+    /** intentos de conexión en curso (ver REQUEST_CONNECTING), -1 los libres */
+    int                           attempt_fds[MAX_CONNECT_ATTEMPTS];
+    /** dirección de cada intento, NULL si es origin_addr (dirección literal) */
+    const struct addrinfo         *attempt_ai[MAX_CONNECT_ATTEMPTS];
+    /** cuándo empezó cada intento (us, CLOCK_MONOTONIC) */
+    uint64_t                      attempt_since[MAX_CONNECT_ATTEMPTS];
+    /** programa el próximo intento */
+    struct selector_timer         attempt_timer;
+
+    int                           origin_domain;
+};
+
+/**
+ * lo que necesita el disector de credenciales POP3 en COPY. Se pide al llegar
+ * a COPY si el disector está prendido, y vuelve a su slab cuando obtiene una
+ * credencial o descarta la conexión (ver copy_disect).
+ */
+struct disector_st {
+    struct disector_parser        dp;
+    /** copia de client_uname para el log */
+    char                          uname[0xff];
+    enum    socks_addr_type       dest_addr_type;
+    union   socks_addr            dest_addr;
 };
 
 /*
  * Si bien cada estado tiene su propio struct que le da un alcance
  * acotado, disponemos de la siguiente estructura para hacer una única
- * alocación cuando recibimos la conexión.
+ * alocación cuando recibimos la conexión. Lo que no dura toda la sesión va
+ * aparte (ver struct handshake_st y struct disector_st).
  *
  * Se utiliza un contador de referencias (references) para saber cuando debemos
  * liberarlo finalmente, y un pool para reusar alocaciones previas.
@@ -253,75 +344,248 @@ struct socks5 {
     int                           client_fd;
     struct sockaddr_storage       client_addr; // direccion IP
     socklen_t                     client_addr_len; // tamaño de IP (v4 o v6)
+    /** usuario autenticado, en `hs' o en `ds'. NULL si no hay o ya no se necesita */
     char                          *client_uname;
 
-    /** resolucion DNS de la direc del origin server */
-    struct addrinfo               *origin_resolution;
-    /** intento actual de la direccion del origin server */
-    struct addrinfo               *origin_resolution_current;
-
     /** informacion del origin server */
     int                           origin_fd;
     struct sockaddr_storage       origin_addr;
     socklen_t                     origin_addr_len;
-    int                           origin_domain;
-    enum    socks_addr_type       dest_addr_type;
-    union   socks_addr            dest_addr;
 
     /** maquinas de estados */
     struct state_machine          stm;
 
-    /** estados para el client_fd */
-    union {
-        struct hello_st           hello;
-        struct auth_st            auth;
-        struct request_st         request;
-        struct copy               copy;
-    } client;
+    /** estado de la negociación, NULL desde COPY */
+    struct handshake_st           *hs;
+    /** estado del disector, NULL si no mira el túnel */
+    struct disector_st            *ds;
 
-    /** estados para el origin_fd */
-    union {
-        struct connecting         conn;
+    /** estados de COPY para el client_fd y el origin_fd (los anteriores están en `hs') */
+    struct {
         struct copy               copy;
-    } orig;
-
-    struct disector_parser        dp;
+    } client, orig;
 
     /** buffers para ser usados read_buffer, write_buffer */
     // Los mismos se van reusando para todos los estados (van quedando limpios luego de cada transicion), y deberian tener al menos 10 bytes de tamaño para poder almacenar una request_marshall() completa.
-    uint8_t raw_buff_a[RAW_BUFFER_SIZE], raw_buff_b[RAW_BUFFER_SIZE];
+    // Su memoria sale de buffer_slabs (ver raw_buffer_get), salvo en modo relay.
     buffer read_buffer, write_buffer;
 
+    /** buffers del modo relay del selector (ver copy_init), NULL si no se usan */
+    fd_selector relay_selector;
+    uint8_t *relay_buff_a, *relay_buff_b;
+
+    /** pipes del modo splice de cada sentido (cliente->origin, origin->cliente), -1 si no se usan */
+    int splice_pipes[2][2];
+    /** pipe donde tee(2) copia lo que tiene que ver el disector en modo splice, -1 si no se usa */
+    int tee_pipe[2];
+
+    /** selector que atiende la sesión */
+    fd_selector                   selector;
+    /** límite de tiempo de la etapa actual (ver socks5_deadline) */
+    struct selector_timer         timer;
+    /** hubo tráfico en COPY desde que se programó `timer' */
+    bool                          copy_active;
+    /** devuelve los buffers vacíos de un túnel inactivo (ver copy_release_timer) */
+    struct selector_timer         release_timer;
+    /** hubo tráfico en COPY desde que se programó `release_timer' */
+    bool                          copy_recent;
+    /** bytes que puede copiar todavía en la iteración `budget_iteration' */
+    size_t                        budget;
+    uint64_t                      budget_iteration;
+
     /** cantidad de referencias a este objeto. si es 1 se debe destruir. */
     unsigned references;
-
-    struct socks5 *next; // siguiente en la pool
 };
 
-/** Pool de structs socks5 para ser reusados */
-static const unsigned   max_pool = 50; // tamaño max
-static unsigned         pool_size = 0; // tamaño actual
-static struct socks5    *pool = 0;     // pool propiamente dicho
+/** límites de tiempo de cada etapa (ver socksv5_set_timeouts) */
+static struct socks5_timeouts          timeouts;
+/** bytes por iteración de cada túnel (ver socksv5_set_copy_budget) */
+static size_t                          copy_budget = 0;
+/** copiar con splice(2) cuando se pueda (ver socksv5_set_splice) */
+static bool                            splice_enabled = true;
+
+/** respuesta si el pool de DNS está saturado (ver socksv5_set_resolver_busy_status) */
+static enum socks_response_status      resolver_busy_status = status_general_SOCKS_server_failure;
+
+/** contador de sesiones vivas del hilo (ver socksv5_set_sessions_counter) */
+static _Thread_local atomic_uint      *sessions = NULL;
+
+/**
+ * clases de tamaño de los buffers de las sesiones. Empiezan en la menor y en
+ * COPY cada sentido se adapta a lo que lee (ver copy_adapt)
+ */
+static const size_t                    buffer_sizes[] = { 4096, 16384, 65536 };
+/** slab de cada clase de buffers. Hay uno por hilo */
+static _Thread_local struct slab      *buffer_slabs[N(buffer_sizes)];
+
+/** cuántas sesiones tener a mano y cuándo devolverlas (ver socksv5_set_pool) */
+static struct socks5_pool              pool_config;
+/** contadores de los slabs de sesiones de todos los hilos */
+static struct slab_stats               pool_stats;
+/** Slab de structs socks5 para ser reusados. Hay uno por hilo */
+static _Thread_local struct slab      *pool = NULL;
+/** slabs de struct handshake_st y struct disector_st. Hay uno por hilo */
+static _Thread_local struct slab      *handshake_pool = NULL;
+static _Thread_local struct slab      *disector_pool = NULL;
 
 static const struct state_definition *socks5_describe_states(void);
 
-static struct socks5 *socks5_new(int client_fd) {
-    struct socks5 *ret;
+/** un buffer de la clase `cls', o NULL si no hay memoria */
+static uint8_t *
+raw_buffer_get(unsigned cls) {
+    if (buffer_slabs[cls] == NULL) {
+        // cada sesión tiene dos buffers: se devuelven al mismo ritmo que las sesiones
+        const struct slab_options opts = {
+            .high = 2 * pool_config.high,
+            .low  = 2 * pool_config.low,
+        };
+        buffer_slabs[cls] = slab_new(buffer_sizes[cls], BUFFER_BLOCK, &opts);
+        if (buffer_slabs[cls] == NULL) {
+            return NULL;
+        }
+    }
+    return slab_get(buffer_slabs[cls]);
+}
 
-    if (pool == NULL) {
-        ret = malloc(sizeof(*ret));
-    } else {
-        ret = pool;
-        pool = pool->next;
-        ret->next = 0; // lo sacamos de la pool para retornarlo y usarlo
+/** clase de tamaño de la memoria de `b' */
+static unsigned
+raw_buffer_class(const buffer *b) {
+    const size_t size = b->limit - b->data;
+    unsigned cls = 0;
+
+    while (cls < N(buffer_sizes) && buffer_sizes[cls] != size) {
+        cls++;
+    }
+    assert(cls < N(buffer_sizes));
+    return cls;
+}
+
+/** devuelve la memoria de `b' a su slab. No hace nada si no tiene (ver raw_buffer_release) */
+static void
+raw_buffer_put(buffer *b) {
+    if (b->data != NULL) {
+        slab_put(buffer_slabs[raw_buffer_class(b)], b->data);
     }
+}
+
+/**
+ * devuelve la memoria de `b', que tiene que estar vacío, también al sistema
+ * (ver slab_release), y lo deja sin memoria: no se puede leer ni escribir
+ * hasta volver a pedirla con raw_buffer_resize.
+ */
+static void
+raw_buffer_release(buffer *b) {
+    if (b->data != NULL) {
+        assert(!buffer_can_read(b));
+        slab_release(buffer_slabs[raw_buffer_class(b)], b->data);
+        memset(b, 0, sizeof(*b));
+    }
+}
+
+/**
+ * cambia la memoria de `b' por una de la clase `cls', conservando lo que
+ * tenga encolado (que tiene que entrar).
+ *
+ * @return false si no hay memoria; `b' queda como estaba
+ */
+static bool
+raw_buffer_resize(buffer *b, unsigned cls) {
+    uint8_t *data = raw_buffer_get(cls);
+    if (data == NULL) {
+        return false;
+    }
+    size_t n = 0;
+    if (b->data != NULL) {
+        const uint8_t *ptr = buffer_read_ptr(b, &n);
+        assert(n <= buffer_sizes[cls]);
+        memcpy(data, ptr, n);
+        raw_buffer_put(b);
+    }
+    buffer_init(b, buffer_sizes[cls], data);
+    buffer_write_adv(b, n);
+    return true;
+}
+
+/**
+ * devuelve el estado de la negociación a su slab. Desde COPY no se usa: los
+ * intentos de conexión ya se cerraron.
+ */
+static void
+socks5_handshake_release(struct socks5 *s) {
+    struct handshake_st *hs = s->hs;
+
+    if (hs == NULL) {
+        return;
+    }
+    if (s->selector != NULL) {
+        selector_timer_cancel(s->selector, &hs->attempt_timer);
+    }
+    if (hs->origin_resolution != NULL) {
+        // ej: se abandonó la conexión antes de probar todas las direcciones
+        dnscache_free(hs->origin_resolution);
+    }
+    if (s->client_uname == hs->client_uname_buf) {
+        s->client_uname = NULL;
+    }
+    slab_put(handshake_pool, hs);
+    s->hs = NULL;
+}
+
+/**
+ * devuelve el estado del disector a su slab: deja de mirar el túnel, y el
+ * pipe de tee(2) no hace más falta.
+ */
+static void
+socks5_disector_release(struct socks5 *s) {
+    if (s->ds != NULL) {
+        if (s->client_uname == s->ds->uname) {
+            s->client_uname = NULL;
+        }
+        for (unsigned j = 0; j < 2; j++) {
+            if (s->tee_pipe[j] != -1) {
+                close(s->tee_pipe[j]);
+                s->tee_pipe[j] = -1;
+            }
+        }
+        slab_put(disector_pool, s->ds);
+        s->ds = NULL;
+    }
+}
+
+/** realmente destruye */
+static void
+socks5_destroy_(struct socks5* s) {
+    socks5_handshake_release(s);
+    socks5_disector_release(s);
+    slab_put(pool, s);
+}
+
+static struct socks5 *socks5_new(int client_fd) {
+    struct socks5 *ret = NULL;
 
+    if (disector_pool == NULL && socksv5_pool_init() != 0) // es el último slab que crea
+        goto finally;
+
+    ret = slab_get(pool);
     if (ret == NULL)
         goto finally;
     
     memset(ret, 0x00, sizeof(*ret)); // inicializamos en 0 todo
 
+    ret->hs = slab_get(handshake_pool);
+    if (ret->hs == NULL) {
+        socks5_destroy_(ret);
+        ret = NULL;
+        goto finally;
+    }
+    memset(ret->hs, 0x00, sizeof(*ret->hs));
+
     ret->origin_fd = -1;
+    for (unsigned i = 0; i < MAX_CONNECT_ATTEMPTS; i++) {
+        ret->hs->attempt_fds[i] = -1;
+    }
+    memset(ret->splice_pipes, -1, sizeof(ret->splice_pipes));
+    memset(ret->tee_pipe, -1, sizeof(ret->tee_pipe));
     ret->client_fd = client_fd;
     ret->client_addr_len = sizeof(ret->client_addr);
 
@@ -330,28 +594,30 @@ static struct socks5 *socks5_new(int client_fd) {
     ret->stm.states = socks5_describe_states();
     stm_init(&ret->stm);
 
-    buffer_init(&ret->read_buffer, N(ret->raw_buff_a), ret->raw_buff_a);
-    buffer_init(&ret->write_buffer, N(ret->raw_buff_b), ret->raw_buff_b);
+    uint8_t *a = raw_buffer_get(0);
+    uint8_t *b = raw_buffer_get(0);
+    if (a == NULL || b == NULL) {
+        slab_put(buffer_slabs[0], a);
+        slab_put(buffer_slabs[0], b);
+        socks5_destroy_(ret);
+        ret = NULL;
+        goto finally;
+    }
+    buffer_init(&ret->read_buffer, buffer_sizes[0], a);
+    buffer_init(&ret->write_buffer, buffer_sizes[0], b);
 
     ret->references = 1;
+    if(sessions != NULL) {
+        atomic_fetch_add_explicit(sessions, 1, memory_order_relaxed);
+    }
 
 finally:
     return ret;
 }
 
-/** realmente destruye */
-static void
-socks5_destroy_(struct socks5* s) {
-    if(s->origin_resolution != NULL) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = 0;
-    }
-    free(s);
-}
-
 /**
- * destruye un  `struct socks5', tiene en cuenta las referencias
- * y el pool de objetos.
+ * destruye un  `struct socks5', tiene en cuenta las referencias.
+ * La memoria vuelve al pool del hilo.
  */
 static void
 socks5_destroy(struct socks5 *s) {
@@ -359,25 +625,142 @@ socks5_destroy(struct socks5 *s) {
         // nada para hacer
     } else if(s->references == 1) {
         if(s != NULL) {
-            if(pool_size < max_pool) {
-                s->next = pool;
-                pool    = s;
-                pool_size++;
+            if(sessions != NULL) {
+                atomic_fetch_sub_explicit(sessions, 1, memory_order_relaxed);
+            }
+            if(s->selector != NULL) {
+                selector_timer_cancel(s->selector, &s->timer);
+                selector_timer_cancel(s->selector, &s->release_timer);
+            }
+            if(s->relay_selector != NULL) {
+                selector_relay_buffer_put(s->relay_selector, s->relay_buff_a);
+                selector_relay_buffer_put(s->relay_selector, s->relay_buff_b);
+                s->relay_selector = NULL;
             } else {
-                socks5_destroy_(s);
+                raw_buffer_put(&s->read_buffer);
+                raw_buffer_put(&s->write_buffer);
             }
+            socks5_destroy_(s);
         }
     } else {
         s->references -= 1;
     }
 }
 
+void
+socksv5_set_sessions_counter(atomic_uint *counter) {
+    sessions = counter;
+}
+
+void
+socksv5_set_timeouts(const struct socks5_timeouts *t) {
+    timeouts = *t;
+}
+
+void
+socksv5_set_copy_budget(size_t bytes) {
+    copy_budget = bytes;
+}
+
+void
+socksv5_set_splice(bool enabled) {
+    splice_enabled = enabled;
+}
+
+void
+socksv5_set_resolver_busy_status(uint8_t status) {
+    resolver_busy_status = status;
+}
+
+static void socks5_timer(fd_selector s, void *data);
+static void copy_release_timer(fd_selector s, void *data);
+
+/**
+ * la etapa actual tiene `ms' milisegundos para terminar; si no, se ejecuta el
+ * on_timeout del estado en el que esté. 0 quita el límite.
+ */
+static void
+socks5_deadline(struct socks5 *s, const unsigned ms) {
+    if(ms == 0) {
+        selector_timer_cancel(s->selector, &s->timer);
+    } else {
+        selector_timer_add(s->selector, &s->timer, ms, socks5_timer, s);
+    }
+}
+
+/**
+ * programa la devolución de los buffers del túnel si sigue inactivo (ver
+ * copy_release_timer). No en modo relay: los buffers son del selector.
+ */
+static void
+copy_release_deadline(struct socks5 *s) {
+    if (timeouts.release != 0 && s->relay_selector == NULL) {
+        s->copy_recent = false;
+        selector_timer_add(s->selector, &s->release_timer, timeouts.release, copy_release_timer, s);
+    }
+}
+
+void
+socksv5_set_pool(const struct socks5_pool *p) {
+    pool_config = *p;
+}
+
+int
+socksv5_pool_init(void) {
+    const struct slab_options opts = {
+        .high  = pool_config.high,
+        .low   = pool_config.low,
+        .huge  = pool_config.huge_pages,
+        .stats = &pool_stats,
+    };
+    if (pool == NULL) {
+        pool = slab_new(sizeof(struct socks5), SESSION_BLOCK, &opts);
+        if (pool == NULL) {
+            return -1;
+        }
+    }
+    // los estados de cada etapa siguen a las sesiones, pero no cuentan en pool_stats
+    struct slab_options part = opts;
+    part.stats = NULL;
+    if (handshake_pool == NULL) {
+        handshake_pool = slab_new(sizeof(struct handshake_st), SESSION_BLOCK, &part);
+        if (handshake_pool == NULL) {
+            return -1;
+        }
+    }
+    if (disector_pool == NULL) {
+        disector_pool = slab_new(sizeof(struct disector_st), SESSION_BLOCK, &part);
+        if (disector_pool == NULL) {
+            return -1;
+        }
+    }
+    return slab_reserve(pool, pool_config.prewarm)
+        && slab_reserve(handshake_pool, pool_config.prewarm) ? 0 : -1;
+}
+
+void
+socksv5_pool_stats(struct socks5_pool_stats *stats) {
+    const size_t objects = atomic_load_explicit(&pool_stats.objects, memory_order_relaxed);
+    const size_t in_use  = atomic_load_explicit(&pool_stats.in_use, memory_order_relaxed);
+
+    stats->in_use = in_use;
+    // se leen por separado: pueden estar desfasados
+    stats->free   = objects > in_use ? objects - in_use : 0;
+    stats->peak   = atomic_load_explicit(&pool_stats.peak, memory_order_relaxed);
+    stats->bytes  = atomic_load_explicit(&pool_stats.bytes, memory_order_relaxed);
+}
+
 void
 socksv5_pool_destroy(void) {
-    struct socks5 *next, *s;
-    for(s = pool; s != NULL ; s = next) {
-        next = s->next;
-        socks5_destroy_(s);
+    slab_destroy(pool);
+    pool = NULL;
+    slab_destroy(handshake_pool);
+    handshake_pool = NULL;
+    slab_destroy(disector_pool);
+    disector_pool = NULL;
+    for(unsigned i = 0; i < N(buffer_slabs); i++) {
+        slab_destroy(buffer_slabs[i]);
+        buffer_slabs[i] = NULL;
     }
 }
 
@@ -404,13 +787,22 @@ void
 socksv5_passive_accept(struct selector_key *key) {
     struct sockaddr_storage       client_addr;
     socklen_t                     client_addr_len = sizeof(client_addr);
-    struct socks5                *state           = NULL;
 
     const int client = accept(key->fd, (struct sockaddr*) &client_addr,
                                                           &client_addr_len);
     if(client == -1) {
-        goto fail;
+        return;
     }
+    socksv5_handle_connection(key->s, client, (struct sockaddr *) &client_addr,
+                              client_addr_len);
+}
+
+int
+socksv5_handle_connection(fd_selector s, const int client,
+                          const struct sockaddr *client_addr,
+                          const socklen_t client_addr_len) {
+    struct socks5                *state           = NULL;
+
     if(selector_fd_set_nio(client) == -1) {
         goto fail;
     }
@@ -423,29 +815,33 @@ socksv5_passive_accept(struct selector_key *key) {
         // que se liberó alguna conexión.
         goto fail;
     }
-    memcpy(&state->client_addr, &client_addr, client_addr_len);
+    memcpy(&state->client_addr, client_addr, client_addr_len);
     state->client_addr_len = client_addr_len;
+    state->selector        = s;
 
     // handlers default que avanzan la maquina de estados, nos registramos para lectura esperando el HELLO_READ.
     // Los handlers particulares de cada estado se definen en los hooks del estado particular (struct state_definition)
-    if(SELECTOR_SUCCESS != selector_register(key->s, client, &socks5_handler,
+    if(SELECTOR_SUCCESS != selector_register(s, client, &socks5_handler,
                                               OP_READ, state)) {
         goto fail;
     }
-    return ;
+    // el hello no tiene on_arrival hasta el primer evento: el límite va acá
+    socks5_deadline(state, timeouts.hello);
+    return 0;
 fail:
-    if(client != -1) {
-        close(client);
-    }
+    close(client);
     socks5_destroy(state);
+    return -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // HELLO
 ////////////////////////////////////////////////////////////////////////////////
 
-bool is_auth_on = true;
+atomic_bool is_auth_on = true;
 size_t registered_users = 0;
+/** protege la tabla de usuarios: los workers la leen mientras el monitor la modifica */
+static pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /** callback que utiliza el parser cada vez que lee un metodo nuevo para elegir alguno de ellos */
 static void
@@ -461,7 +857,7 @@ on_hello_method(struct hello_parser *p, const uint8_t method) {
 /** inicializa las variables de los estados HELLO_… */
 static void
 hello_read_init(const unsigned state, struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
 
     d->rb                              = &(ATTACHMENT(key)->read_buffer);
     d->wb                              = &(ATTACHMENT(key)->write_buffer);
@@ -469,8 +865,10 @@ hello_read_init(const unsigned state, struct selector_key *key) {
     d->method                          = SOCKS_HELLO_NO_ACCEPTABLE_METHODS;
     d->parser.on_authentication_method = on_hello_method, hello_parser_init(&d->parser);
 
+    pthread_rwlock_rdlock(&users_lock);
     if (registered_users == 0)
         is_auth_on = false; // turn off authentication method
+    pthread_rwlock_unlock(&users_lock);
 }
 
 static unsigned
@@ -479,7 +877,7 @@ hello_process(const struct hello_st* d);
 /** lee todos los bytes del mensaje de tipo `hello' y inicia su proceso */
 static unsigned
 hello_read(struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
     unsigned  ret      = HELLO_READ;
         bool  error    = false;
      uint8_t *ptr;
@@ -519,13 +917,13 @@ hello_process(const struct hello_st* d) {
 /** libera los recursos al salir de HELLO_READ */
 static void
 hello_read_close(const unsigned state, struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
     hello_parser_close(&d->parser);
 }
 
 static unsigned
 hello_write(struct selector_key *key) { // key corresponde a un client_fd
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
 
     unsigned ret       = HELLO_WRITE;
     uint8_t  *ptr;
@@ -565,53 +963,68 @@ struct user {
 struct user users[MAX_USERS];
 
 int socksv5_register_user(char *uname, char *passwd) {
-    if (registered_users >= MAX_USERS)
-        return 1; // maximo numero de usuarios alcanzado
-    
+    int ret = 0;
+    pthread_rwlock_wrlock(&users_lock);
+    if (registered_users >= MAX_USERS) {
+        ret = 1; // maximo numero de usuarios alcanzado
+        goto finally;
+    }
+
     for (size_t i = 0; i < registered_users; i++) {
-        if (strcmp(uname, users[i].uname) == 0)
-            return -1; // username ya existente
+        if (strcmp(uname, users[i].uname) == 0) {
+            ret = -1; // username ya existente
+            goto finally;
+        }
     }
 
     // insertamos al final (podrian insertarse en orden alfabetico para mas eficiencia pero al ser pocos es irrelevante)
     strncpy(users[registered_users].uname, uname, 0xff);
     strncpy(users[registered_users++].passwd, passwd, 0xff);
-    return 0;
+finally:
+    pthread_rwlock_unlock(&users_lock);
+    return ret;
 }
 
 int socksv5_unregister_user(char *uname) {
+    int ret = -1;  // usuario no encontrado
+    pthread_rwlock_wrlock(&users_lock);
     for (size_t i = 0; i < registered_users; i++) {
         if (strcmp(uname, users[i].uname) == 0) {
             // movemos los elementos para tapar el hueco que pudo haber quedado
             if (i + 1 < registered_users)
                 memmove(&users[i], &users[i+1], sizeof(struct user) * (registered_users - (i + 1)));
             registered_users--;
-            return 0;
+            ret = 0;
+            break;
         }
     }
-    return -1;  // usuario no encontrado
+    pthread_rwlock_unlock(&users_lock);
+    return ret;
 }
 
 // entrega la lista de usuarios con formato <usuario>\0<usuario>
 uint16_t socksv5_get_users(char unames[MAX_USERS * 0xff]) {
     uint16_t dlen = 0;
+    pthread_rwlock_rdlock(&users_lock);
     for (size_t i = 0; i < registered_users; i++) {
         strcpy(unames + dlen, users[i].uname);
         dlen += strlen(users[i].uname) + 1; // incluimos el \0
     }
+    pthread_rwlock_unlock(&users_lock);
     return dlen > 1 ? dlen - 1 : 0; // no pone el ultimo \0
 }
 
 /** inicializa las variables de los estados AUTH_ */
 static void
 auth_init(const unsigned state, struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
     d->rb                   = &(ATTACHMENT(key)->read_buffer);
     d->wb                   = &(ATTACHMENT(key)->write_buffer);
     d->parser.auth          = &d->auth;
     d->status               = auth_status_failure;
     auth_parser_init(&d->parser);
     d->uname                = ATTACHMENT(key)->client_uname;
+    socks5_deadline(ATTACHMENT(key), timeouts.auth);
 }
 
 static unsigned
@@ -620,7 +1033,7 @@ auth_process(struct selector_key *key, struct auth_st *d);
 /** lee todos los bytes del mensaje de tipo 'auth' e inicia su proceso */
 static unsigned
 auth_read(struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
 
     buffer *b            = d->rb;
     unsigned ret         = AUTH_READ;
@@ -652,15 +1065,18 @@ static unsigned
 auth_process(struct selector_key *key, struct auth_st *d) {
     bool authenticated = false;
     
+    pthread_rwlock_rdlock(&users_lock);
     for (size_t i = 0; i < registered_users; i++) {
         if (strncmp(d->auth.uname, users[i].uname, 0xff) == 0 &&
             strncmp(d->auth.passwd, users[i].passwd, 0xff) == 0) {
             // sets client uname in struct socks5
-            ATTACHMENT(key)->client_uname = users[i].uname;
+            strncpy(ATTACHMENT(key)->hs->client_uname_buf, users[i].uname, 0xff);
+            ATTACHMENT(key)->client_uname = ATTACHMENT(key)->hs->client_uname_buf;
             authenticated = true;
             break;
         }
     }
+    pthread_rwlock_unlock(&users_lock);
     d->status = authenticated ? auth_status_succeeded : auth_status_failure;
 
     if (-1 == auth_marshall(d->wb, d->status))
@@ -671,7 +1087,7 @@ auth_process(struct selector_key *key, struct auth_st *d) {
 
 static unsigned
 auth_write(struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
     
     unsigned ret = AUTH_WRITE;
     buffer *b    = d->wb;
@@ -710,7 +1126,7 @@ auth_write(struct selector_key *key) {
 /** inicializa las variables de los estados REQUEST_ */
 static void
 request_init(const unsigned state, struct selector_key *key) {
-    struct request_st *d    = &ATTACHMENT(key)->client.request;
+    struct request_st *d    = &ATTACHMENT(key)->hs->client.request;
 
     d->rb                   = &(ATTACHMENT(key)->read_buffer);
     d->wb                   = &(ATTACHMENT(key)->write_buffer);
@@ -721,7 +1137,8 @@ request_init(const unsigned state, struct selector_key *key) {
     d->origin_fd            = &ATTACHMENT(key)->origin_fd;
     d->origin_addr          = &ATTACHMENT(key)->origin_addr;
     d->origin_addr_len      = &ATTACHMENT(key)->origin_addr_len;
-    d->origin_domain        = &ATTACHMENT(key)->origin_domain;
+    d->origin_domain        = &ATTACHMENT(key)->hs->origin_domain;
+    socks5_deadline(ATTACHMENT(key), timeouts.request);
 }
 
 static unsigned request_process(struct selector_key *key, struct request_st *d);
@@ -729,7 +1146,7 @@ static unsigned request_process(struct selector_key *key, struct request_st *d);
 /** lee todos los bytes del mensaje de tipo 'request' e inicia su proceso */
 static unsigned
 request_read(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
 
     buffer *b            = d->rb;
     unsigned ret         = REQUEST_READ;
@@ -755,8 +1172,8 @@ request_read(struct selector_key *key) {
 static unsigned
 request_connect(struct selector_key *key, struct request_st *d);
 
-static void *
-request_resolv_blocking(void *data);
+static unsigned
+request_resolv_done(struct selector_key *key);
 
 static unsigned
 request_error_write(struct selector_key *key, struct request_st *d, enum socks_response_status status) {
@@ -772,13 +1189,12 @@ request_error_write(struct selector_key *key, struct request_st *d, enum socks_r
 static unsigned
 request_process(struct selector_key *key, struct request_st *d) {
     unsigned ret;
-    pthread_t tid;
 
     switch (d->request.cmd) {
         case socks_req_cmd_connect:
             switch (d->request.dest_addr_type) {
                 case socks_req_addrtype_ipv4: {
-                    ATTACHMENT(key)->origin_domain = AF_INET;
+                    ATTACHMENT(key)->hs->origin_domain = AF_INET;
                     d->request.dest_addr.ipv4.sin_port = d->request.dest_port;
                     ATTACHMENT(key)->origin_addr_len = sizeof(d->request.dest_addr.ipv4);
                     memcpy(&ATTACHMENT(key)->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv4));
@@ -786,7 +1202,7 @@ request_process(struct selector_key *key, struct request_st *d) {
                     break;
                 }
                 case socks_req_addrtype_ipv6: {
-                    ATTACHMENT(key)->origin_domain = AF_INET6;
+                    ATTACHMENT(key)->hs->origin_domain = AF_INET6;
                     d->request.dest_addr.ipv6.sin6_port = d->request.dest_port;
                     ATTACHMENT(key)->origin_addr_len = sizeof(d->request.dest_addr.ipv6);
                     memcpy(&ATTACHMENT(key)->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv6));
@@ -794,19 +1210,28 @@ request_process(struct selector_key *key, struct request_st *d) {
                     break;
                 }
                 case socks_req_addrtype_domain: {
-                    struct selector_key *k = malloc(sizeof(*key));
-                    if (k == NULL) {
-                        ret = request_error_write(key, d, status_general_SOCKS_server_failure);
-                    } else {
-                        memcpy(k, key, sizeof(*key));
-                        // CREACION DE HILO PARA RESOLUCION DNS
-                        if (-1 == pthread_create(&tid, 0, request_resolv_blocking, k)) {
-                            ret = request_error_write(key, d, status_general_SOCKS_server_failure);
-                            free(k);
-                        } else {
-                            ret = REQUEST_RESOLV;
-                            selector_set_interest_key(key, OP_NOOP);
+                    struct socks5 *s = ATTACHMENT(key);
+                    bool refresh     = false;
+                    s->hs->origin_resolution      = NULL;
+                    s->hs->origin_resolution_busy = false;
+                    if (dnscache_get(d->request.dest_addr.fqdn, ntohs(d->request.dest_port),
+                                     AF_UNSPEC, &s->hs->origin_resolution, &refresh)) {
+                        if (refresh) {
+                            // nombre popular por vencer: se renueva en segundo plano
+                            resolver_refresh(key->s, d->request.dest_addr.fqdn, ntohs(d->request.dest_port));
                         }
+                        // acierto (quizás negativo): seguimos sin esperar a nadie
+                        ret = request_resolv_done(key);
+                    } else if (resolver_submit(key->s, s->client_fd, d->request.dest_addr.fqdn,
+                                               ntohs(d->request.dest_port), &s->hs->origin_resolution,
+                                               &s->hs->origin_resolution_busy)) {
+                        // lo resuelve un hilo del pool (ver resolver.h), que
+                        // nos avisa con un handle_block en el client_fd
+                        ret = REQUEST_RESOLV;
+                        selector_set_interest_key(key, OP_NOOP);
+                    } else {
+                        // pool saturado
+                        ret = request_error_write(key, d, resolver_busy_status);
                     }
                     break;
                 }
@@ -825,122 +1250,121 @@ request_process(struct selector_key *key, struct request_st *d) {
     return ret;
 }
 
-// EJECUTADA POR UN HILO APARTE, creado por request_process()
-static void *
-request_resolv_blocking(void *data) {
-    struct selector_key *key = (struct selector_key *) data;
-    struct socks5       *s   = ATTACHMENT(key);
-
-    pthread_detach(pthread_self());
-    s->origin_resolution = 0;
-    struct addrinfo hints = {
-        .ai_family      = AF_UNSPEC,    // allow IPv4 or IPv6
-        .ai_socktype    = SOCK_STREAM,  // datagram socket
-        .ai_flags       = AI_PASSIVE,   // for wildcard IP address
-        .ai_protocol    = 0,            // any protocol
-        .ai_canonname   = NULL,
-        .ai_addr        = NULL,
-        .ai_next        = NULL,
-    };
-
-    char buff[7];
-    snprintf(buff, sizeof(buff), "%d", ntohs(s->client.request.request.dest_port));
+/**
+ * el hilo del pool que resuelve escribe sobre la sesión y la notifica al terminar: no
+ * la podemos liberar mientras tanto, así que esta etapa no tiene límite.
+ */
+static void
+request_resolv_init(const unsigned state, struct selector_key *key) {
+    socks5_deadline(ATTACHMENT(key), 0);
+}
 
-    if (getaddrinfo(s->client.request.request.dest_addr.fqdn, buff, &hints, &s->origin_resolution) != 0) {
-        s->client.request.status = status_general_SOCKS_server_failure;
-        s->origin_resolution = 0;
+/**
+ * reordena `list' alternando familias (RFC 8305, sección 4), empezando por la
+ * de la primera dirección: la que prefiere quien resolvió.
+ */
+static struct addrinfo *
+addrinfo_interleave(struct addrinfo *list) {
+    struct addrinfo *same = NULL, **same_tail = &same;
+    struct addrinfo *other = NULL, **other_tail = &other;
+    const int family = list->ai_family;
+
+    for (struct addrinfo *next; list != NULL; list = next) {
+        next = list->ai_next;
+        list->ai_next = NULL;
+        if (list->ai_family == family) {
+            *same_tail = list;
+            same_tail  = &list->ai_next;
+        } else {
+            *other_tail = list;
+            other_tail  = &list->ai_next;
+        }
     }
 
-    selector_notify_block(key->s, key->fd);
-
-    free(data); // era una copia del estado original
-    return 0;    
+    struct addrinfo *ret = NULL, **tail = &ret;
+    while (same != NULL || other != NULL) {
+        struct addrinfo **from[] = { &same, &other };
+        for (unsigned i = 0; i < N(from); i++) {
+            if (*from[i] != NULL) {
+                *tail = *from[i];
+                *from[i] = (*from[i])->ai_next;
+                tail = &(*tail)->ai_next;
+            }
+        }
+    }
+    *tail = NULL;
+    return ret;
 }
 
-/** procesa el resultado de la resolucion de nombres. se llama en el "on_block_ready" del state REQUEST_RESOLV. */
+/**
+ * procesa el resultado de la resolucion de nombres. se llama en el "on_block_ready" del state REQUEST_RESOLV,
+ * o directamente desde request_process() si el nombre estaba en el cache.
+ */
 static unsigned
 request_resolv_done(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
     struct socks5 *s     = ATTACHMENT(key);
 
-    if (s->origin_resolution == 0)
+    if (s->hs->origin_resolution_busy)
+        return request_error_write(key, d, resolver_busy_status);
+    if (s->hs->origin_resolution == 0)
+        return request_error_write(key, d, status_host_unreachable);
+
+    // las caídas quedan al final: no se intentan, y si son todas no hay nada
+    // que esperar
+    const size_t up = scoreboard_sort(&s->hs->origin_resolution);
+    struct addrinfo **down = &s->hs->origin_resolution;
+    for (size_t i = 0; i < up; i++) {
+        down = &(*down)->ai_next;
+    }
+    dnscache_free(*down);
+    *down = NULL;
+    if (s->hs->origin_resolution == 0)
         return request_error_write(key, d, status_host_unreachable);
 
-    s->origin_resolution_current = s->origin_resolution;
-    s->origin_domain = s->origin_resolution->ai_family;
-    s->origin_addr_len = s->origin_resolution->ai_addrlen;
-    memcpy(&s->origin_addr, s->origin_resolution->ai_addr, s->origin_resolution->ai_addrlen);
+    s->hs->origin_resolution = addrinfo_interleave(s->hs->origin_resolution);
+    s->hs->origin_resolution_current = s->hs->origin_resolution;
     return request_connect(key, d);
 }
 
-// debe retornar un state
-// OJO: key puede ser tanto de un cliente como de un origin (esto ultimo si se re-llama esta funcion desde el request_connecting())
+static bool attempt_next(struct socks5 *s);
+static bool attempt_start(struct socks5 *s, unsigned i, const struct addrinfo *ai);
+
+/**
+ * empieza a conectarse al origin server: a origin_addr si el request trae una
+ * dirección literal, o a las de la resolución (ver REQUEST_CONNECTING).
+ */
 static unsigned
 request_connect(struct selector_key *key, struct request_st *d) {
-    bool error                        = false;
-    int *fd                           = d->origin_fd;
-    enum socks_response_status status = d->status;
+    struct socks5 *s = ATTACHMENT(key);
+    bool started;
 
-    // si ya habiamos asignado una vez el fd y estamos tratando de conectarnos con una IP diferente, cerramos el viejo y lo creamos devuelta
-    if (ATTACHMENT(key)->stm.current->state == REQUEST_CONNECTING) {
-        selector_unregister_fd(key->s, *fd);
-        close(*fd);
-    }
-
-    *fd = socket(ATTACHMENT(key)->origin_domain, SOCK_STREAM, 0);
-
-    if (*fd == -1) {
-        status = status_general_SOCKS_server_failure;
-        error = true;
-        goto finally;
+    // dejamos de escuchar del socket del cliente mientras tanto
+    if (SELECTOR_SUCCESS != selector_set_interest(key->s, s->client_fd, OP_NOOP)) {
+        return request_error_write(key, d, status_general_SOCKS_server_failure);
     }
-
-    if (selector_fd_set_nio(*fd) == -1)
-        goto finally;
-    
-    if (-1 == connect(*fd, (const struct sockaddr *)&ATTACHMENT(key)->origin_addr, ATTACHMENT(key)->origin_addr_len)) {
-        if (errno == EINPROGRESS) {
-            // es lo esperable, hay que aguardar la conexion
-            // dejamos de escuchar del socket del cliente
-            selector_status st = selector_set_interest(key->s, ATTACHMENT(key)->client_fd, OP_NOOP);
-            if (SELECTOR_SUCCESS != st) {
-                error = true;
-                goto finally;
-            }
-
-            // esperamosla conexion en el nuevo socket
-            st = selector_register(key->s, *fd, &socks5_handler, OP_WRITE, key->data);
-
-            if (SELECTOR_SUCCESS != st) {
-                error = true;
-                goto finally;
-            }
-            ATTACHMENT(key)->references += 1;
-        } else {
-            status = errno_to_socks(errno);
-            error = true;
-            goto finally;
-        }
+    if (d->request.dest_addr_type == socks_req_addrtype_domain) {
+        started = attempt_next(s);
+    } else if (scoreboard_is_down((const struct sockaddr *) &s->origin_addr)) {
+        d->status = status_host_unreachable;
+        started   = false;
     } else {
-        // estamos conectados sin esperar, es imposible
-        abort();
+        started = attempt_start(s, 0, NULL);
     }
-
-finally:
-    if (error) {
-        if (*fd != -1) {
-            close(*fd);
-            *fd = -1;
+    if (!started) {
+        if (d->request.dest_addr_type == socks_req_addrtype_domain) {
+            dnscache_free(s->hs->origin_resolution);
+            s->hs->origin_resolution = 0;
+            s->hs->origin_resolution_current = 0;
         }
-        return request_error_write(key, d, status);
+        return request_error_write(key, d, d->status);
     }
-
     return REQUEST_CONNECTING;
 }
 
 static void
 request_read_close(const unsigned state, struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
     request_close(&d->parser);
 }
 
@@ -950,64 +1374,249 @@ request_read_close(const unsigned state, struct selector_key *key) {
 
 static void
 request_connecting_init(const unsigned state, struct selector_key *key) {
-    struct connecting *d = &ATTACHMENT(key)->orig.conn;
+    struct connecting *d = &ATTACHMENT(key)->hs->conn;
     d->client_fd = &ATTACHMENT(key)->client_fd;
     d->origin_fd = &ATTACHMENT(key)->origin_fd;
-    d->status    = &ATTACHMENT(key)->client.request.status;
+    d->status    = &ATTACHMENT(key)->hs->client.request.status;
     d->wb        = &ATTACHMENT(key)->write_buffer;
 }
 
-/** la conexion ha sido establecida (o fallo) */
-static unsigned
-request_connecting(struct selector_key *key) { // key es un origin_fd
-    int error;
-    socklen_t len = sizeof(error);
-    struct socks5 *s     = ATTACHMENT(key);
-    struct connecting *d = &s->orig.conn;
+static void attempt_timeout(fd_selector sel, void *data);
 
-    if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-        *d->status = status_general_SOCKS_server_failure;
-    } else {
-        if (error == 0) {
-            *d->status = status_succeeded;
-            *d->origin_fd = key->fd;
-        } else if (s->client.request.request.dest_addr_type == socks_req_addrtype_domain && s->origin_resolution_current->ai_next != NULL) {
-            s->origin_resolution_current = s->origin_resolution_current->ai_next;
-            s->origin_domain = s->origin_resolution_current->ai_family;
-            s->origin_addr_len = s->origin_resolution_current->ai_addrlen;
-            memcpy(&s->origin_addr, s->origin_resolution_current->ai_addr, s->origin_resolution_current->ai_addrlen);
-            request_connect(key, &s->client.request);
-            return REQUEST_CONNECTING;
-        } else {
-            *d->status = errno_to_socks(error);
-        }
-    }
+static uint64_t
+now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
 
-    if (s->client.request.request.dest_addr_type == socks_req_addrtype_domain) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = 0;
-        s->origin_resolution_current = 0;
+/** el error de connect(2) indica que del otro lado no respondió nadie */
+static bool
+errno_unresponsive(int error) {
+    return error == ETIMEDOUT || error == EHOSTUNREACH || error == ENETUNREACH;
+}
+
+/**
+ * abre el intento `i' hacia `ai' (o hacia origin_addr si es NULL).
+ *
+ * @return false si falló en el acto, dejando el motivo en el status del request
+ */
+static bool
+attempt_start(struct socks5 *s, unsigned i, const struct addrinfo *ai) {
+    const struct sockaddr *addr = (const struct sockaddr *) &s->origin_addr;
+    socklen_t addr_len          = s->origin_addr_len;
+    int family                  = s->hs->origin_domain;
+    enum socks_response_status status = status_general_SOCKS_server_failure;
+
+    if (ai != NULL) {
+        addr     = ai->ai_addr;
+        addr_len = ai->ai_addrlen;
+        family   = ai->ai_family;
+        // si ninguno se conecta, el log muestra el último intentado
+        memcpy(&s->origin_addr, addr, addr_len);
+        s->origin_addr_len = addr_len;
     }
 
-    if (-1 == request_marshall(s->client.request.wb, s->client.request.status)) {
-        s->client.request.status = status_general_SOCKS_server_failure;
-        abort();
+    const int fd = socket(family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        goto fail;
+    }
+    if (selector_fd_set_nio(fd) == -1) {
+        goto fail;
+    }
+    // conectarse sin esperar (loopback) se procesa igual que EINPROGRESS
+    if (-1 == connect(fd, addr, addr_len) && errno != EINPROGRESS) {
+        status = errno_to_socks(errno);
+        scoreboard_failure(addr, errno_unresponsive(errno));
+        goto fail;
+    }
+    if (SELECTOR_SUCCESS != selector_register(s->selector, fd, &socks5_handler, OP_WRITE, s)) {
+        goto fail;
+    }
+    s->references += 1;
+    s->hs->attempt_fds[i] = fd;
+    s->hs->attempt_ai[i]  = ai;
+    s->hs->attempt_since[i] = now_us();
+
+    // cada intento tiene su límite; el último reinicia el de todos
+    socks5_deadline(s, timeouts.connect);
+    if (s->hs->origin_resolution_current != NULL && timeouts.connect_delay != 0) {
+        selector_timer_add(s->selector, &s->hs->attempt_timer, timeouts.connect_delay, attempt_timeout, s);
+    } else {
+        selector_timer_cancel(s->selector, &s->hs->attempt_timer);
     }
+    return true;
 
-    selector_status ss = 0;
+fail:
+    if (fd != -1) {
+        close(fd);
+    }
+    s->hs->client.request.status = status;
+    return false;
+}
+
+/** dirección del intento `i' */
+static const struct sockaddr *
+attempt_addr(const struct socks5 *s, unsigned i) {
+    return s->hs->attempt_ai[i] != NULL ? s->hs->attempt_ai[i]->ai_addr
+                                    : (const struct sockaddr *) &s->origin_addr;
+}
+
+/** cierra el intento `i' */
+static void
+attempt_close(struct socks5 *s, unsigned i) {
+    const int fd = s->hs->attempt_fds[i];
+
+    s->hs->attempt_fds[i] = -1;
+    if (SELECTOR_SUCCESS != selector_unregister_fd(s->selector, fd)) {
+        abort();
+    }
+    close(fd);
+}
+
+/**
+ * empieza un intento con la siguiente dirección de la resolución, salteando
+ * las que fallan en el acto, si hay lugar para uno más.
+ *
+ * @return false si no quedó ningún intento en curso
+ */
+static bool
+attempt_next(struct socks5 *s) {
+    const unsigned max = timeouts.connect_delay == 0 ? 1 : MAX_CONNECT_ATTEMPTS;
+    unsigned free_slot = max, running = 0;
+
+    for (unsigned i = 0; i < max; i++) {
+        if (s->hs->attempt_fds[i] == -1) {
+            free_slot = i;
+        } else {
+            running++;
+        }
+    }
+    if (free_slot == max) {
+        // se reintenta cuando falle alguno
+        return true;
+    }
+    while (s->hs->origin_resolution_current != NULL) {
+        const struct addrinfo *ai    = s->hs->origin_resolution_current;
+        s->hs->origin_resolution_current = ai->ai_next;
+        if (attempt_start(s, free_slot, ai)) {
+            return true;
+        }
+    }
+    if (running > 0) {
+        selector_timer_cancel(s->selector, &s->hs->attempt_timer);
+    }
+    return running > 0;
+}
+
+/** pasó `connect_delay' desde el último intento sin que ninguno se conecte */
+static void
+attempt_timeout(fd_selector sel, void *data) {
+    // quedan intentos en curso: si no, la etapa ya terminó y no estaría programado
+    attempt_next(data);
+}
+
+/** termina la etapa: prepara la respuesta al cliente con `status' */
+static unsigned
+request_connecting_done(struct selector_key *key, enum socks_response_status status) {
+    struct socks5 *s     = ATTACHMENT(key);
+    struct connecting *d = &s->hs->conn;
+
+    *d->status = status;
+    selector_timer_cancel(key->s, &s->hs->attempt_timer);
+    for (unsigned i = 0; i < MAX_CONNECT_ATTEMPTS; i++) {
+        if (s->hs->attempt_fds[i] != -1) {
+            attempt_close(s, i);
+        }
+    }
+    if (s->hs->client.request.request.dest_addr_type == socks_req_addrtype_domain) {
+        dnscache_free(s->hs->origin_resolution);
+        s->hs->origin_resolution = 0;
+        s->hs->origin_resolution_current = 0;
+    }
+
+    if (-1 == request_marshall(s->hs->client.request.wb, s->hs->client.request.status)) {
+        s->hs->client.request.status = status_general_SOCKS_server_failure;
+        abort();
+    }
+
+    selector_status ss = 0;
     ss |= selector_set_interest(key->s, *d->client_fd, OP_WRITE);
-    ss |= selector_set_interest_key(key, OP_NOOP);
+    if (*d->origin_fd != -1) {
+        ss |= selector_set_interest(key->s, *d->origin_fd, OP_NOOP);
+    }
 
     // se llamara a request_write() en ambos casos, pero difieren en *d->status por lo que si falla pasara a estado de DONE/ERROR y sino a COPY
     return SELECTOR_SUCCESS == ss ? REQUEST_WRITE : ERROR;
 }
 
+/** uno de los intentos se conectó (o falló). key es su fd */
+static unsigned
+request_connecting(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    int error;
+    socklen_t len = sizeof(error);
+    unsigned i = 0;
+
+    while (s->hs->attempt_fds[i] != key->fd) {
+        i++;
+    }
+    assert(i < MAX_CONNECT_ATTEMPTS);
+    if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        s->hs->client.request.status = status_general_SOCKS_server_failure;
+    } else if (error == 0) {
+        // ganó: deja de ser un intento para que no lo cierre la etapa
+        const struct addrinfo *ai = s->hs->attempt_ai[i];
+        scoreboard_success(attempt_addr(s, i), (unsigned) (now_us() - s->hs->attempt_since[i]));
+        s->origin_fd      = key->fd;
+        s->hs->attempt_fds[i] = -1;
+        if (ai != NULL) {
+            memcpy(&s->origin_addr, ai->ai_addr, ai->ai_addrlen);
+            s->origin_addr_len = ai->ai_addrlen;
+        }
+        return request_connecting_done(key, status_succeeded);
+    } else {
+        s->hs->client.request.status = errno_to_socks(error);
+        scoreboard_failure(attempt_addr(s, i), errno_unresponsive(error));
+    }
+
+    attempt_close(s, i);
+    if (attempt_next(s)) {
+        return REQUEST_CONNECTING;
+    }
+    return request_connecting_done(key, s->hs->client.request.status);
+}
+
+/** venció el último intento de conexión (y con él los anteriores). key es un client_fd */
+static unsigned
+request_connecting_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    for (unsigned i = 0; i < MAX_CONNECT_ATTEMPTS; i++) {
+        if (s->hs->attempt_fds[i] != -1) {
+            scoreboard_failure(attempt_addr(s, i), true);
+            attempt_close(s, i);
+        }
+    }
+    s->hs->client.request.status = status_ttl_expired;
+    if (attempt_next(s)) {
+        return REQUEST_CONNECTING;
+    }
+    return request_connecting_done(key, s->hs->client.request.status);
+}
+
 void log_request(enum socks_response_status status, const char *uname, struct request *request, const struct sockaddr *clientaddr, const struct sockaddr* originaddr);
 
+/** la respuesta al request tiene su propio límite (el cliente puede no leerla) */
+static void
+request_write_init(const unsigned state, struct selector_key *key) {
+    socks5_deadline(ATTACHMENT(key), timeouts.request);
+}
+
 /** escribe todos los bytes de la respuesta al mensaje 'request' */
 static unsigned
 request_write(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
 
     unsigned ret = REQUEST_WRITE;
     buffer *b    = d->wb;
@@ -1027,9 +1636,6 @@ request_write(struct selector_key *key) {
                 ret = COPY;
                 selector_set_interest(key->s, *d->client_fd, OP_READ);
                 selector_set_interest(key->s, *d->origin_fd, OP_READ);
-                // guardamos estos valores que necesitaremos luego para logear en la etapa posterior
-                memcpy(&ATTACHMENT(key)->dest_addr, &ATTACHMENT(key)->client.request.request.dest_addr, sizeof(union socks_addr));
-                ATTACHMENT(key)->dest_addr_type = ATTACHMENT(key)->client.request.request.dest_addr_type;
                 // aumentamos los stats del servidor
                 historic_connections += 1;
                 current_connections  += 1;
@@ -1043,7 +1649,7 @@ request_write(struct selector_key *key) {
             log_request(
                 d->status,
                 ATTACHMENT(key)->client_uname,
-                &ATTACHMENT(key)->client.request.request,
+                &ATTACHMENT(key)->hs->client.request.request,
                 (const struct sockaddr *) &ATTACHMENT(key)->client_addr,
                 (const struct sockaddr *) &ATTACHMENT(key)->origin_addr
             );
@@ -1057,13 +1663,102 @@ request_write(struct selector_key *key) {
 // COPY
 ////////////////////////////////////////////////////////////////////////////////
 
-bool is_disector_on = true;
+atomic_bool is_disector_on = true;
 
 void
 socksv5_toggle_disector(bool to) {
     is_disector_on = to;
 }
 
+static fd_interest copy_compute_interests(fd_selector s, struct copy *d);
+
+/**
+ * pide el estado del disector si está prendido, con los datos de la
+ * negociación que necesita para logear (ver copy_disect). Si no hay memoria
+ * el túnel anda igual, sin disector.
+ */
+static void
+copy_disector_init(struct socks5 *s) {
+    struct disector_st *ds;
+
+    if (!is_disector_on || (ds = slab_get(disector_pool)) == NULL) {
+        return;
+    }
+    const struct request *request = &s->hs->client.request.request;
+    disector_parser_init(&ds->dp);
+    ds->dest_addr_type = request->dest_addr_type;
+    memcpy(&ds->dest_addr, &request->dest_addr, sizeof(ds->dest_addr));
+    if (s->client_uname != NULL) {
+        strncpy(ds->uname, s->client_uname, sizeof(ds->uname));
+        s->client_uname = ds->uname;
+    }
+    s->ds = ds;
+}
+
+/**
+ * pasa los buffers de la conexión a buffers del modo relay del selector,
+ * conservando lo que tuvieran encolado. Así el selector hace las lecturas y
+ * escrituras directamente sobre memoria registrada y con buffers más grandes.
+ */
+static void
+copy_relay_init(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    if(!selector_relay_supported(key->s)) {
+        return;
+    }
+    // sin intereses el relay no encola lecturas: si hay que deshacerlo no
+    // se cancela ninguna que ya haya consumido bytes del socket. Los pone
+    // copy_init después
+    if(SELECTOR_SUCCESS != selector_set_interest(key->s, s->client_fd, OP_NOOP)
+       || SELECTOR_SUCCESS != selector_set_interest(key->s, s->origin_fd, OP_NOOP)) {
+        return;
+    }
+    uint8_t *a = selector_relay_buffer_get(key->s);
+    uint8_t *b = selector_relay_buffer_get(key->s);
+    if(a == NULL || b == NULL) {
+        selector_relay_buffer_put(key->s, a);
+        selector_relay_buffer_put(key->s, b);
+        return;
+    }
+    // los buffers del pool se devuelven recién cuando el relay quedó
+    // activo en los dos fds: si no, la sesión sigue con ellos
+    buffer read_buffer  = s->read_buffer;
+    buffer write_buffer = s->write_buffer;
+    size_t n;
+    uint8_t *ptr;
+    ptr = buffer_read_ptr(&s->read_buffer, &n);
+    memcpy(a, ptr, n);
+    buffer_init(&s->read_buffer, SELECTOR_RELAY_BUFFER_SIZE, a);
+    buffer_write_adv(&s->read_buffer, n);
+
+    ptr = buffer_read_ptr(&s->write_buffer, &n);
+    memcpy(b, ptr, n);
+    buffer_init(&s->write_buffer, SELECTOR_RELAY_BUFFER_SIZE, b);
+    buffer_write_adv(&s->write_buffer, n);
+
+    if(SELECTOR_SUCCESS != selector_set_relay(key->s, s->client_fd, &s->read_buffer, &s->write_buffer)) {
+        goto fail;
+    }
+    if(SELECTOR_SUCCESS != selector_set_relay(key->s, s->origin_fd, &s->write_buffer, &s->read_buffer)) {
+        selector_set_relay(key->s, s->client_fd, NULL, NULL);
+        goto fail;
+    }
+    raw_buffer_put(&read_buffer);
+    raw_buffer_put(&write_buffer);
+    s->relay_selector = key->s;
+    s->relay_buff_a   = a;
+    s->relay_buff_b   = b;
+    return;
+
+fail:
+    // todavía nadie avanzó los buffers: los del pool tienen lo mismo
+    s->read_buffer  = read_buffer;
+    s->write_buffer = write_buffer;
+    selector_relay_buffer_put(key->s, a);
+    selector_relay_buffer_put(key->s, b);
+}
+
 static void
 copy_init(const unsigned state, struct selector_key *key) {
     struct copy *d = &ATTACHMENT(key)->client.copy;
@@ -1072,6 +1767,12 @@ copy_init(const unsigned state, struct selector_key *key) {
     d->wb          = &ATTACHMENT(key)->write_buffer;
     d->duplex      = OP_READ | OP_WRITE;
     d->other       = &ATTACHMENT(key)->orig.copy;
+    d->pipe        = NULL;
+    d->piped       = 0;
+    d->pipe_full   = false;
+    d->write_short = false;
+    d->fills       = 0;
+    d->lulls       = 0;
 
     d              = &ATTACHMENT(key)->orig.copy;
     d->fd          = &ATTACHMENT(key)->origin_fd;
@@ -1079,18 +1780,40 @@ copy_init(const unsigned state, struct selector_key *key) {
     d->wb          = &ATTACHMENT(key)->read_buffer;
     d->duplex      = OP_READ | OP_WRITE;
     d->other       = &ATTACHMENT(key)->client.copy;
+    d->pipe        = NULL;
+    d->piped       = 0;
+    d->pipe_full   = false;
+    d->write_short = false;
+    d->fills       = 0;
+    d->lulls       = 0;
+
+    // lo que queda de la negociación ya no se usa
+    copy_disector_init(ATTACHMENT(key));
+    socks5_handshake_release(ATTACHMENT(key));
+
+    ATTACHMENT(key)->copy_active = false;
+    socks5_deadline(ATTACHMENT(key), timeouts.idle);
+
+    copy_relay_init(key);
+    copy_release_deadline(ATTACHMENT(key));
+    copy_compute_interests(key->s, &ATTACHMENT(key)->client.copy);
+    copy_compute_interests(key->s, &ATTACHMENT(key)->orig.copy);
+}
 
-    // init disector
-    disector_parser_init(&ATTACHMENT(key)->dp);
+/** quedan bytes leídos de d->fd sin escribir en el otro extremo */
+static bool
+copy_pending(const struct copy *d) {
+    return d->pipe != NULL ? d->piped > 0 : buffer_can_read(d->rb);
 }
 
 /** actualiza los intereses en el selector segun el estado del copy */
 static fd_interest
 copy_compute_interests(fd_selector s, struct copy *d) {
     fd_interest ret = OP_NOOP;
-    if ((d->duplex & OP_READ) && buffer_can_write(d->rb))
+    // sin memoria en el buffer es que se devolvió por inactividad (ver copy_release_timer): se pide al leer
+    if ((d->duplex & OP_READ) && (d->pipe != NULL ? !d->pipe_full : d->rb->data == NULL || buffer_can_write(d->rb)))
         ret |= OP_READ;
-    if ((d->duplex & OP_WRITE) && buffer_can_read(d->wb))
+    if ((d->duplex & OP_WRITE) && copy_pending(d->other))
         ret |= OP_WRITE;
     if (SELECTOR_SUCCESS != selector_set_interest(s, *d->fd, ret))
         abort();
@@ -1114,6 +1837,305 @@ copy_ptr(struct selector_key *key) {
     return d;
 }
 
+/**
+ * bytes que el túnel puede copiar todavía en esta iteración del selector (ver
+ * socksv5_set_copy_budget); se recarga en cada iteración. Si es 0 el handler
+ * no hace nada: el fd sigue listo y se lo atiende en la próxima iteración,
+ * después de las demás conexiones.
+ */
+static size_t
+copy_allowance(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    if (copy_budget == 0) {
+        return SIZE_MAX;
+    }
+    const uint64_t iteration = selector_iteration(key->s);
+    if (s->budget_iteration != iteration) {
+        s->budget_iteration = iteration;
+        s->budget           = copy_budget;
+    }
+    return s->budget;
+}
+
+static void
+copy_spend(struct selector_key *key, const size_t n) {
+    if (copy_budget != 0) {
+        ATTACHMENT(key)->budget -= n;
+    }
+}
+
+void log_credentials(const char *user, const char *pass, const char *uname, enum socks_addr_type addr_type, union socks_addr *addr, const struct sockaddr* originaddr);
+
+/**
+ * el disector tiene que ver lo que se escribe en `fd': si estamos esperando
+ * el usuario y pass, lo que escribe cliente sobre origin, y si estamos
+ * esperando la response o que se inicie una conexion POP3, al reves
+ */
+static bool
+copy_disector_wants(struct selector_key *key, const int fd) {
+    if (ATTACHMENT(key)->ds == NULL) {
+        return false;
+    }
+    const struct disector_parser *dp = &ATTACHMENT(key)->ds->dp;
+
+    return is_disector_on
+        && ((dp->state < disector_response && dp->state >= disector_user && fd == ATTACHMENT(key)->origin_fd)
+        || ((dp->state == disector_response || dp->state == disector_wait_pop) && fd == ATTACHMENT(key)->client_fd));
+}
+
+/**
+ * le pasa al disector `n' bytes escritos en un socket del túnel. Después de
+ * una credencial la sesión POP3 ya está autenticada: el disector no mira más,
+ * y su estado vuelve al slab. Lo mismo si descarta la conexión por no ser POP3.
+ */
+static void
+copy_disect(struct selector_key *key, uint8_t *ptr, size_t n) {
+    struct disector_st *ds     = ATTACHMENT(key)->ds;
+    struct disector_parser *dp = &ds->dp;
+
+    const enum disector_state st = disector_consume(dp, ptr, n);
+    if (st == disector_done) {
+        log_credentials(dp->disector.user,
+            dp->disector.pass,
+            ATTACHMENT(key)->client_uname,
+            ds->dest_addr_type,
+            &ds->dest_addr,
+            (const struct sockaddr *) &ATTACHMENT(key)->origin_addr
+        );
+    }
+    if (st == disector_done || st == disector_incompatible) {
+        socks5_disector_release(ATTACHMENT(key));
+    }
+}
+
+/** crea el pipe de tee(2) si no existe. false si no se pudo */
+static bool
+copy_tee_pipe(struct socks5 *s) {
+    if (s->tee_pipe[0] == -1 && pipe2(s->tee_pipe, O_NONBLOCK) == -1) {
+        s->tee_pipe[0] = s->tee_pipe[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+/** no se leerá más de d->fd. Si no queda nada encolado se cierra la escritura del otro extremo */
+static void
+copy_read_closed(struct copy *d) {
+    shutdown(*d->fd, SHUT_RD); // no leeremos mas de ahi
+    d->duplex &= ~OP_READ;
+    // si quedan bytes encolados, el cierre de escritura lo hace copy_w al terminar de mandarlos
+    if (*d->other->fd != -1 && !copy_pending(d)) {
+        shutdown(*d->other->fd, SHUT_WR);
+        d->other->duplex &= ~OP_WRITE;
+    }
+}
+
+/** falló la escritura en d->fd: tampoco tiene sentido seguir leyendo del otro extremo */
+static void
+copy_write_failed(struct copy *d) {
+    shutdown(*d->fd, SHUT_WR);
+    d->duplex &= ~OP_WRITE;
+    if (*d->other->fd != -1) {
+        shutdown(*d->other->fd, SHUT_RD);
+        d->other->duplex &= ~OP_READ;
+    }
+}
+
+/** hubo tráfico en el túnel (ver copy_timeout y copy_release_timer) */
+static void
+copy_touch(struct socks5 *s) {
+    s->copy_active = true;
+    s->copy_recent = true;
+}
+
+/** se escribieron `n' bytes en d->fd */
+static void
+copy_written(struct selector_key *key, struct copy *d, const size_t n) {
+    atomic_fetch_add_explicit(&bytes_transferred, n, memory_order_relaxed);
+    copy_touch(ATTACHMENT(key));
+
+    // el otro extremo ya no nos va a mandar nada: terminamos de vaciar el buffer y propagamos el cierre
+    if (!copy_pending(d->other) && !(d->other->duplex & OP_READ)) {
+        shutdown(*d->fd, SHUT_WR);
+        d->duplex &= ~OP_WRITE;
+    }
+}
+
+/**
+ * recalcula los intereses de ambos extremos. DONE cuando ninguno puede leer ni
+ * escribir: si sólo terminó este, el otro puede tener bytes por mandar (por
+ * ejemplo la respuesta a un cliente que ya cerró su escritura).
+ */
+static unsigned
+copy_update(struct selector_key *key, struct copy *d) {
+    copy_compute_interests(key->s, d);
+    copy_compute_interests(key->s, d->other);
+
+    if (d->duplex == OP_NOOP && d->other->duplex == OP_NOOP) {
+        current_connections -= 1;
+        return DONE;
+    }
+    return COPY;
+}
+
+/**
+ * pasa el sentido que lee de d->fd al modo splice: los bytes van del socket a
+ * un pipe y del pipe al otro socket sin pasar por memoria del proceso (el
+ * disector ve una copia, ver copy_splice_w). Sólo si no se usa el modo relay
+ * del selector y no queda nada en el buffer (así no se desordenan). Si no se
+ * puede crear el pipe se sigue con el buffer; también si el disector todavía
+ * mira el túnel y no se puede crear el pipe de tee(2).
+ */
+static void
+copy_splice_init(struct selector_key *key, struct copy *d) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    if (!splice_enabled || d->pipe != NULL || s->relay_selector != NULL || buffer_can_read(d->rb)) {
+        return;
+    }
+    if (s->ds != NULL && !copy_tee_pipe(s)) {
+        return;
+    }
+    int *p = s->splice_pipes[d == &s->client.copy ? 0 : 1];
+    if (pipe2(p, O_NONBLOCK) == -1) {
+        p[0] = p[1] = -1;
+        return;
+    }
+    d->pipe = p;
+    // mientras tenga el pipe este sentido no usa su buffer
+    raw_buffer_release(d->rb);
+}
+
+/** cierra el pipe (vacío) del sentido `d'; si se vuelve a leer se crea otro */
+static void
+copy_splice_close(struct copy *d) {
+    assert(d->piped == 0);
+    close(d->pipe[0]);
+    close(d->pipe[1]);
+    d->pipe[0]   = d->pipe[1] = -1;
+    d->pipe      = NULL;
+    d->pipe_full = false;
+}
+
+static void copy_write_through(struct selector_key *key, struct copy *d);
+
+/** lee de un socket al pipe de su sentido */
+static unsigned
+copy_splice_r(struct selector_key *key, struct copy *d) {
+    const size_t allowance = copy_allowance(key);
+    if (allowance == 0) {
+        return COPY;
+    }
+    const ssize_t n = splice(key->fd, NULL, d->pipe[1], NULL,
+                             allowance < SPLICE_MAX_LEN ? allowance : SPLICE_MAX_LEN,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        copy_spend(key, n);
+        d->piped += n;
+        copy_touch(ATTACHMENT(key));
+        copy_write_through(key, d->other);
+    } else if (n == -1 && errno == EAGAIN) {
+        // con bytes en el pipe es que está lleno; si no, no había nada para leer
+        d->pipe_full = d->piped > 0;
+    } else {
+        copy_read_closed(d);
+    }
+    return copy_update(key, d);
+}
+
+/**
+ * escribe en d->fd lo que hay en el pipe del otro sentido. Si el disector
+ * tiene que ver estos bytes, antes se duplican con tee(2) (que no los saca del
+ * pipe) hasta TEE_WINDOW bytes, y se le pasan los que efectivamente se
+ * escribieron; si no se pudo duplicar ninguno no se escribe nada, y se
+ * reintenta cuando el socket vuelva a estar listo. Cuando el disector termina
+ * o descarta la conexión queda sólo splice.
+ */
+static void
+copy_splice_send(struct selector_key *key, struct copy *d) {
+    struct socks5 *s  = ATTACHMENT(key);
+    struct copy *from = d->other;
+    const size_t allowance = copy_allowance(key);
+    if (allowance == 0) {
+        return;
+    }
+    size_t len = from->piped < allowance ? from->piped : allowance;
+
+    uint8_t window[TEE_WINDOW];
+    ssize_t teed = 0;
+    if (copy_disector_wants(key, *d->fd)) {
+        if (copy_tee_pipe(s)) {
+            teed = tee(from->pipe[0], s->tee_pipe[1], len < TEE_WINDOW ? len : TEE_WINDOW, SPLICE_F_NONBLOCK);
+        }
+        if (teed <= 0) {
+            // el disector no vería estos bytes: quedan en el pipe
+            d->write_short = true;
+            return;
+        }
+        len = teed;
+    }
+    const ssize_t n = splice(from->pipe[0], NULL, *d->fd, NULL, len,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    d->write_short = n != (ssize_t) len;
+    if (teed > 0) {
+        // se vacía el pipe entero: lo que no se escribió se vuelve a duplicar la próxima vez
+        if (read(s->tee_pipe[0], window, teed) != teed) {
+            abort();
+        }
+        if (n > 0) {
+            copy_disect(key, window, n);
+        }
+    }
+    if (n > 0) {
+        copy_spend(key, n);
+        from->piped    -= n;
+        from->pipe_full = false;
+        copy_written(key, d, n);
+    } else if (n == -1 && errno == EAGAIN) {
+        // el socket no tenía lugar: se reintenta cuando vuelva a estar listo
+    } else {
+        copy_write_failed(d);
+    }
+}
+
+/** escribe en un socket lo que hay en el pipe del otro sentido */
+static unsigned
+copy_splice_w(struct selector_key *key, struct copy *d) {
+    copy_splice_send(key, d);
+    return copy_update(key, d);
+}
+
+/**
+ * adapta el buffer de lectura del sentido `d' a lo que viene leyendo: pasa a
+ * la clase siguiente tras BUFFER_GROW_AFTER lecturas seguidas que lo llenan,
+ * y vuelve a la anterior tras BUFFER_SHRINK_AFTER lecturas seguidas de `n'
+ * bytes que hubieran entrado holgadas en ella. Cada sentido se adapta por su
+ * cuenta. Si no hay memoria sigue con el que tiene.
+ */
+static void
+copy_adapt(struct copy *d, const size_t n) {
+    const unsigned cls = raw_buffer_class(d->rb);
+    size_t queued;
+
+    buffer_read_ptr(d->rb, &queued);
+    if (!buffer_can_write(d->rb)) {
+        d->lulls = 0;
+        if (++d->fills >= BUFFER_GROW_AFTER && cls + 1 < N(buffer_sizes)) {
+            raw_buffer_resize(d->rb, cls + 1);
+            d->fills = 0;
+        }
+    } else if (cls > 0 && n <= buffer_sizes[cls - 1] / 2) {
+        d->fills = 0;
+        if (++d->lulls >= BUFFER_SHRINK_AFTER && queued <= buffer_sizes[cls - 1]) {
+            raw_buffer_resize(d->rb, cls - 1);
+            d->lulls = 0;
+        }
+    } else {
+        d->fills = d->lulls = 0;
+    }
+}
+
 /** lee bytes de un socket y los encola para ser escritos en otro socket */
 static unsigned
 copy_r(struct selector_key *key) {
@@ -1121,36 +2143,106 @@ copy_r(struct selector_key *key) {
 
     assert(*d->fd == key->fd);
 
+    copy_splice_init(key, d);
+    if (d->pipe != NULL) {
+        return copy_splice_r(key, d);
+    }
+
     size_t size;
     ssize_t n;
     buffer *b   = d->rb;
-    unsigned ret = COPY;
 
+    if (b->data == NULL) {
+        // se había devuelto por inactividad
+        if (!raw_buffer_resize(b, 0)) {
+            current_connections -= 1;
+            return ERROR;
+        }
+        copy_release_deadline(ATTACHMENT(key));
+    }
     uint8_t *ptr = buffer_write_ptr(b, &size);
-    n = recv(key->fd, ptr, size, 0);
-    if (n <= 0) {
-        shutdown(*d->fd, SHUT_RD); // no leeremos mas de ahi
-        d->duplex &= ~OP_READ;
-        if (*d->other->fd != -1) {
-            shutdown(*d->other->fd, SHUT_WR);
-            d->other->duplex &= ~OP_WRITE;
+    if (key->io_ptr != NULL) {
+        // modo relay: el selector ya leyó. Si mientras tanto el buffer se compactó, movemos lo leído
+        n = key->io_result;
+        if (n > 0 && key->io_ptr != ptr) {
+            memmove(ptr, key->io_ptr, n);
+        }
+    } else {
+        // en modo relay no hace falta: el selector hace una operación por fd por iteración
+        const size_t allowance = copy_allowance(key);
+        if (allowance == 0) {
+            return COPY;
+        }
+        n = recv(key->fd, ptr, size < allowance ? size : allowance, 0);
+        if (n > 0) {
+            copy_spend(key, n);
         }
+    }
+    if (n <= 0) {
+        copy_read_closed(d);
     } else {
         buffer_write_adv(b, n);
+        copy_touch(ATTACHMENT(key));
+        if (key->io_ptr == NULL) {
+            // en modo relay los buffers son los del selector, y también escribe él
+            copy_adapt(d, n);
+            copy_write_through(key, d->other);
+        }
     }
+    return copy_update(key, d);
+}
 
-    copy_compute_interests(key->s, d);
-    copy_compute_interests(key->s, d->other);
-
-    if (d->duplex == OP_NOOP) {
-        ret = DONE;
-        current_connections -= 1;
+/** se escribieron en d->fd `n' bytes de los encolados en d->wb, a partir de `ptr' */
+static void
+copy_sent(struct selector_key *key, struct copy *d, uint8_t *ptr, const size_t n) {
+    if (copy_disector_wants(key, *d->fd)) {
+        copy_disect(key, ptr, n);
     }
+    buffer_read_adv(d->wb, n);
+    copy_written(key, d, n);
+}
 
-    return ret;
+/** escribe en d->fd los bytes encolados */
+static void
+copy_send(struct selector_key *key, struct copy *d) {
+    size_t size;
+    uint8_t *ptr = buffer_read_ptr(d->wb, &size);
+    const size_t allowance = copy_allowance(key);
+    if (allowance == 0) {
+        return;
+    }
+    const size_t len = size < allowance ? size : allowance;
+    const ssize_t n  = send(*d->fd, ptr, len, MSG_NOSIGNAL);
+    d->write_short   = n != (ssize_t) len;
+
+    if (n >= 0) {
+        copy_spend(key, n);
+        copy_sent(key, d, ptr, n);
+    } else if (errno == EAGAIN) {
+        // el socket no tenía lugar: se reintenta cuando vuelva a estar listo
+    } else {
+        copy_write_failed(d);
+    }
 }
 
-void log_credentials(const char *user, const char *pass, const char *uname, enum socks_addr_type addr_type, union socks_addr *addr, const struct sockaddr* originaddr);
+/**
+ * escribe enseguida en d->fd lo que se acaba de leer del otro extremo, sin
+ * esperar a que el selector avise que se puede: si la última escritura entró
+ * entera lo más probable es que el socket tenga lugar, y así se ahorra una
+ * vuelta del selector (y cambiar los intereses dos veces). Lo que no entre lo
+ * escribe copy_w cuando el selector avise.
+ */
+static void
+copy_write_through(struct selector_key *key, struct copy *d) {
+    if (!(d->duplex & OP_WRITE) || d->write_short) {
+        return;
+    }
+    if (d->other->pipe != NULL) {
+        copy_splice_send(key, d);
+    } else {
+        copy_send(key, d);
+    }
+}
 
 /** escribe bytes encolados */
 static unsigned
@@ -1158,52 +2250,47 @@ copy_w(struct selector_key *key) {
     struct copy *d = copy_ptr(key);
     assert(*d->fd == key->fd);
 
-    struct disector_parser *dp = &ATTACHMENT(key)->dp;
-
-    size_t size;
-    ssize_t n;
-    buffer *b = d->wb;
-    unsigned ret = COPY;
+    if (d->other->pipe != NULL) {
+        // el buffer quedó vacío al pasar al modo splice
+        return copy_splice_w(key, d);
+    }
 
-    uint8_t *ptr = buffer_read_ptr(b, &size);
-    n = send(key->fd, ptr, size, MSG_NOSIGNAL);
-    if (n == -1) {
-        shutdown(*d->fd, SHUT_WR);
-        d->duplex &= ~OP_WRITE;
-        if (*d->other->fd != -1) {
-            shutdown(*d->other->fd, SHUT_RD);
-            d->other->duplex &= ~OP_READ;
+    if (key->io_ptr != NULL) {
+        // modo relay: el selector ya escribió desde el inicio del buffer
+        if (key->io_result < 0) {
+            copy_write_failed(d);
+        } else {
+            size_t size;
+            copy_sent(key, d, buffer_read_ptr(d->wb, &size), key->io_result);
         }
     } else {
-        // si estamos esperando el usuario y pass, miramos lo que escribe cliente sobre origin, y si estamos esperando la response o que se inicie una conexion POP3, al reves
-        if (is_disector_on && dp->state != disector_incompatible
-        && ((dp->state < disector_response && dp->state >= disector_user && key->fd == ATTACHMENT(key)->origin_fd)
-        || ((dp->state == disector_response || dp->state == disector_wait_pop) && key->fd == ATTACHMENT(key)->client_fd))) {
-            const enum disector_state st = disector_consume(dp, ptr, n);
-            if (st == disector_done) {
-                log_credentials(dp->disector.user,
-                    dp->disector.pass,
-                    ATTACHMENT(key)->client_uname,
-                    ATTACHMENT(key)->dest_addr_type,
-                    &ATTACHMENT(key)->dest_addr,
-                    (const struct sockaddr *) &ATTACHMENT(key)->origin_addr
-                );
-                disector_parser_reset(dp);
-            }
-        }
-        buffer_read_adv(b, n);
-        bytes_transferred += n;
+        copy_send(key, d);
     }
+    return copy_update(key, d);
+}
 
-    copy_compute_interests(key->s, d);
-    copy_compute_interests(key->s, d->other);
+/**
+ * venció el límite de inactividad. Para no tocar el temporizador en cada
+ * lectura/escritura sólo marcamos que hubo tráfico, y si lo hubo volvemos a
+ * esperar un período entero: se detecta luego de entre 1 y 2 períodos.
+ */
+static unsigned
+copy_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
 
-    if (d->duplex == OP_NOOP) {
-        ret = DONE;
-        current_connections -= 1;
+    if (s->copy_active) {
+        s->copy_active = false;
+        socks5_deadline(s, timeouts.idle);
+        return COPY;
     }
+    current_connections -= 1;
+    return DONE;
+}
 
-    return ret;
+/** venció el límite de una etapa de la negociación: se cierra la conexión */
+static unsigned
+socks5_expired(struct selector_key *key) {
+    return ERROR;
 }
 
 /** definición de handlers para cada estado */
@@ -1213,44 +2300,54 @@ static const struct state_definition client_statbl[] = {
         .on_arrival       = hello_read_init,
         .on_departure     = hello_read_close,
         .on_read_ready    = hello_read,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = HELLO_WRITE,
         .on_write_ready   = hello_write,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = AUTH_READ,
         .on_arrival       = auth_init,
         .on_read_ready    = auth_read,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = AUTH_WRITE,
         .on_write_ready   = auth_write,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = REQUEST_READ,
         .on_arrival       = request_init,
         .on_departure     = request_read_close,
         .on_read_ready    = request_read,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = REQUEST_RESOLV,
+        .on_arrival       = request_resolv_init,
         .on_block_ready   = request_resolv_done,
     },
     {
         .state            = REQUEST_CONNECTING,
         .on_arrival       = request_connecting_init,
         .on_write_ready   = request_connecting,
+        .on_timeout       = request_connecting_timeout,
     },
     {
         .state            = REQUEST_WRITE,
+        .on_arrival       = request_write_init,
         .on_write_ready   = request_write,
+        .on_timeout       = socks5_expired,
     },
     {
         .state            = COPY,
         .on_arrival       = copy_init,
         .on_read_ready    = copy_r,
         .on_write_ready   = copy_w,
+        .on_timeout       = copy_timeout,
     },
     {
         .state            = DONE,
@@ -1301,6 +2398,60 @@ socksv5_block(struct selector_key *key) {
     }
 }
 
+/** venció el temporizador de la sesión (ver socks5_deadline) */
+static void
+socks5_timer(fd_selector s, void *data) {
+    struct socks5 *state = data;
+    struct selector_key key = {
+        .s    = s,
+        .fd   = state->client_fd,
+        .data = state,
+    };
+    const enum socks_v5state st = stm_handler_timeout(&state->stm, &key);
+
+    if(ERROR == st || DONE == st) {
+        socksv5_done(&key);
+    }
+}
+
+/**
+ * venció el plazo de inactividad para devolver los buffers de un túnel en
+ * COPY. Como con copy_timeout, si hubo tráfico se espera otro período. Los
+ * buffers vacíos vuelven al slab y al sistema, y los pipes vacíos del modo
+ * splice se cierran; cada sentido los vuelve a pedir en su próxima lectura.
+ * Si alguno tenía bytes encolados (el otro extremo no los recibe) se vuelve a
+ * intentar más tarde.
+ */
+static void
+copy_release_timer(fd_selector s, void *data) {
+    struct socks5 *state = data;
+    bool retry = state->copy_recent;
+
+    if (!retry) {
+        struct copy *copies[] = { &state->client.copy, &state->orig.copy };
+        for (unsigned i = 0; i < N(copies); i++) {
+            struct copy *d = copies[i];
+            if (d->pipe != NULL ? d->piped > 0 : buffer_can_read(d->rb)) {
+                retry = true;
+            } else if (d->pipe != NULL) {
+                copy_splice_close(d);
+            } else {
+                raw_buffer_release(d->rb);
+            }
+        }
+        // sólo tiene algo durante copy_splice_w
+        for (unsigned j = 0; j < 2; j++) {
+            if (state->tee_pipe[j] != -1) {
+                close(state->tee_pipe[j]);
+                state->tee_pipe[j] = -1;
+            }
+        }
+    }
+    if (retry) {
+        copy_release_deadline(state);
+    }
+}
+
 static void
 socksv5_close(struct selector_key *key) {
     socks5_destroy(ATTACHMENT(key));
@@ -1308,9 +2459,33 @@ socksv5_close(struct selector_key *key) {
 
 static void
 socksv5_done(struct selector_key* key) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    // desde COPY ya no hay intentos de conexión
+    for(unsigned i = 0; s->hs != NULL && i < MAX_CONNECT_ATTEMPTS; i++) {
+        if(s->hs->attempt_fds[i] != -1) {
+            attempt_close(s, i);
+        }
+    }
+    // los pipes del modo splice no están en el selector. Van antes que los
+    // sockets: al desregistrar el último se libera `s'
+    for(unsigned i = 0; i < N(s->splice_pipes); i++) {
+        for(unsigned j = 0; j < 2; j++) {
+            if(s->splice_pipes[i][j] != -1) {
+                close(s->splice_pipes[i][j]);
+                s->splice_pipes[i][j] = -1;
+            }
+        }
+    }
+    for(unsigned j = 0; j < 2; j++) {
+        if(s->tee_pipe[j] != -1) {
+            close(s->tee_pipe[j]);
+            s->tee_pipe[j] = -1;
+        }
+    }
     const int fds[] = {
-        ATTACHMENT(key)->client_fd,
-        ATTACHMENT(key)->origin_fd,
+        s->client_fd,
+        s->origin_fd,
     };
     for(unsigned i = 0; i < N(fds); i++) {
         if(fds[i] != -1) {
@@ -1325,12 +2500,12 @@ socksv5_done(struct selector_key* key) {
 // ISO-8601 date
 static void log_current_local_date(char *buf) {
     time_t rawtime;
-    struct tm *ptm;
-    // time retorna la cant de segundos since Epoch, localtime devuelve un struct tm en localtime
-    if ((rawtime = time(NULL)) != -1 && (ptm = localtime(&rawtime)) != NULL) {
+    struct tm tm, *ptm;
+    // time retorna la cant de segundos since Epoch, localtime devuelve un struct tm en localtime (_r: hay varios workers)
+    if ((rawtime = time(NULL)) != -1 && (ptm = localtime_r(&rawtime, &tm)) != NULL) {
         if (strftime(buf, 50, "%FT%T", ptm) > 0) {
             printf("%s", buf);
-            printf("%s", ptm->__tm_zone); //indica el offset local con respecto a UTC
+            printf("%s", ptm->tm_zone); //indica el offset local con respecto a UTC
         }
         else
             printf("<date error>");
@@ -1354,6 +2529,8 @@ static void log_destination(char *buf, const struct sockaddr* originaddr, enum s
 void log_request(enum socks_response_status status, const char *uname, struct request *request, const struct sockaddr *clientaddr, const struct sockaddr* originaddr) {
     char buf[50];
     
+    // que las líneas de distintos workers no se mezclen
+    flockfile(stdout);
     log_current_local_date(buf);
     putchar('\t');
 
@@ -1377,11 +2554,13 @@ void log_request(enum socks_response_status status, const char *uname, struct re
     // status code socks5
     printf("%d", status);
     putchar('\n');
+    funlockfile(stdout);
 }
 
 void log_credentials(const char *user, const char *pass, const char *uname, enum socks_addr_type addr_type, union socks_addr *addr, const struct sockaddr* originaddr) {
     char buf[50];
 
+    flockfile(stdout);
     log_current_local_date(buf);
     putchar('\t');
 
@@ -1408,4 +2587,5 @@ void log_credentials(const char *user, const char *pass, const char *uname, enum
     // contraseña descubierta
     printf("%s", pass);
     putchar('\n');
+    funlockfile(stdout);
 }
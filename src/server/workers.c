@@ -0,0 +1,342 @@
+/**
+ * workers.c - hilos adicionales que atienden conexiones SOCKS
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../include/resolver.h"
+#include "../include/selector.h"
+#include "../include/socks5nio.h"
+#include "../include/workers.h"
+
+/** capacidad de cada cola del acceptor. Potencia de 2 */
+#define HANDOFF_QUEUE_SIZE  1024
+/** máximas conexiones que acepta el acceptor por evento */
+#define ACCEPT_BATCH        64
+/** tamaño de una línea de cache, para separar los índices de las colas */
+#define CACHE_LINE          64
+
+/** conexión aceptada por el acceptor y todavía no atendida por el worker */
+struct handoff {
+    int                     fd;
+    socklen_t               addr_len;
+    struct sockaddr_storage addr;
+};
+
+/**
+ * cola circular sin locks de un productor (el acceptor) y un consumidor
+ * (el worker). El productor sólo escribe `tail' y el consumidor sólo `head';
+ * van en líneas de cache distintas para no invalidarse mutuamente.
+ */
+struct handoff_queue {
+    atomic_size_t   head;
+    char            pad_head[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t   tail;
+    char            pad_tail[CACHE_LINE - sizeof(atomic_size_t)];
+    struct handoff  slots[HANDOFF_QUEUE_SIZE];
+};
+
+struct worker {
+    pthread_t               thread;
+    bool                    started;
+    struct worker_listeners listeners;
+    /**
+     * se crea en workers_start para poder encolarle tareas. Lo destruye el
+     * worker al terminar: sus sesiones tienen que volver a los pools de su
+     * hilo (ver socksv5_pool_destroy)
+     */
+    fd_selector             selector;
+    /** workers_stop ya no usa `selector': el worker lo puede destruir */
+    sem_t                   released;
+
+    /** sesiones vivas en el worker (ver socksv5_set_sessions_counter) */
+    atomic_uint             sessions;
+
+    // modo acceptor
+    struct handoff_queue    queue;
+    /** ya hay una tarea `worker_drain' encolada que el worker no ejecutó */
+    atomic_bool             drain_pending;
+};
+
+static struct worker   *workers  = NULL;
+static size_t           nworkers = 0;
+static atomic_bool      stopping = false;
+/** por dónde empieza a buscar el acceptor, para repartir los empates */
+static size_t           next_worker = 0;
+
+static const struct fd_handler socksv5 = {
+    .handle_read       = socksv5_passive_accept,
+    .handle_write      = NULL,
+    .handle_close      = NULL, // nada que liberar
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// COLA DEL ACCEPTOR
+////////////////////////////////////////////////////////////////////////////////
+
+/** encola `h'. Sólo lo llama el acceptor. false si la cola está llena */
+static bool
+handoff_push(struct handoff_queue *q, const struct handoff *h) {
+    const size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if(tail - atomic_load(&q->head) == HANDOFF_QUEUE_SIZE) {
+        return false;
+    }
+    q->slots[tail & (HANDOFF_QUEUE_SIZE - 1)] = *h;
+    atomic_store(&q->tail, tail + 1);
+    return true;
+}
+
+/** desencola en `h'. Sólo lo llama el worker. false si la cola está vacía */
+static bool
+handoff_pop(struct handoff_queue *q, struct handoff *h) {
+    const size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if(head == atomic_load(&q->tail)) {
+        return false;
+    }
+    *h = q->slots[head & (HANDOFF_QUEUE_SIZE - 1)];
+    atomic_store(&q->head, head + 1);
+    return true;
+}
+
+static size_t
+handoff_size(struct handoff_queue *q) {
+    return atomic_load(&q->tail) - atomic_load(&q->head);
+}
+
+/**
+ * tarea (ver selector_post) que atiende las conexiones que encoló el acceptor.
+ *
+ * Se baja `drain_pending' antes de vaciar la cola: si el acceptor encola
+ * después, ve la marca baja y vuelve a encolar la tarea.
+ */
+static void
+worker_drain(fd_selector s, void *data) {
+    struct worker *w = data;
+    struct handoff h;
+
+    atomic_store(&w->drain_pending, false);
+
+    while(handoff_pop(&w->queue, &h)) {
+        // si falla cierra la conexión; no hay a quién avisarle
+        socksv5_handle_connection(s, h.fd, (struct sockaddr *) &h.addr,
+                                  h.addr_len);
+    }
+}
+
+/** el worker con menos carga: sesiones vivas más conexiones encoladas */
+static struct worker *
+least_loaded(void) {
+    struct worker *ret = NULL;
+    size_t min = SIZE_MAX;
+
+    for(size_t i = 0; i < nworkers; i++) {
+        struct worker *w = workers + (next_worker + i) % nworkers;
+        const size_t load = atomic_load_explicit(&w->sessions, memory_order_relaxed)
+                          + handoff_size(&w->queue);
+        if(load < min) {
+            min = load;
+            ret = w;
+        }
+    }
+    next_worker = (next_worker + 1) % nworkers;
+    return ret;
+}
+
+void
+workers_passive_accept(struct selector_key *key) {
+    for(unsigned i = 0; i < ACCEPT_BATCH; i++) {
+        struct handoff h;
+        h.addr_len = sizeof(h.addr);
+        h.fd = accept(key->fd, (struct sockaddr *) &h.addr, &h.addr_len);
+        if(h.fd == -1) {
+            break; // no hay más pendientes (o falló): esperamos otro evento
+        }
+
+        struct worker *w = least_loaded();
+        if(!handoff_push(&w->queue, &h)) {
+            // el menos cargado tiene la cola llena: estamos saturados
+            close(h.fd);
+            continue;
+        }
+        if(!atomic_exchange(&w->drain_pending, true)
+           && SELECTOR_SUCCESS != selector_post(w->selector, worker_drain, w)) {
+            // sin memoria: que lo reintente la próxima conexión
+            atomic_store(&w->drain_pending, false);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// WORKERS
+////////////////////////////////////////////////////////////////////////////////
+
+/** tarea que sólo despierta al worker para que vea `stopping' */
+static void
+worker_wakeup(fd_selector s, void *data) {
+    // nada que hacer
+}
+
+static void *
+worker_run(void *arg) {
+    struct worker *w          = arg;
+    const char    *err_msg    = NULL;
+    selector_status ss        = SELECTOR_SUCCESS;
+
+    socksv5_set_sessions_counter(&w->sessions);
+    if(socksv5_pool_init() != 0) {
+        err_msg = "preallocating worker sessions";
+        goto finally;
+    }
+
+    if(w->listeners.v4 != -1) {
+        ss = selector_register(w->selector, w->listeners.v4, &socksv5, OP_READ, NULL);
+        if(ss != SELECTOR_SUCCESS) {
+            err_msg = "registering worker IPv4 socks fd";
+            goto finally;
+        }
+    }
+    if(w->listeners.v6 != -1) {
+        ss = selector_register(w->selector, w->listeners.v6, &socksv5, OP_READ, NULL);
+        if(ss != SELECTOR_SUCCESS) {
+            err_msg = "registering worker IPv6 socks fd";
+            goto finally;
+        }
+    }
+
+    while(!stopping) {
+        ss = selector_select(w->selector);
+        if(ss != SELECTOR_SUCCESS) {
+            err_msg = "worker serving";
+            goto finally;
+        }
+    }
+    err_msg = NULL;
+
+finally:
+    if(ss != SELECTOR_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", (err_msg == NULL) ? "": err_msg,
+            ss == SELECTOR_IO ? strerror(errno) : selector_error(ss)
+        );
+    } else if(err_msg) {
+        perror(err_msg);
+    }
+    // los sockets pasivos no son nuestros: los sacamos antes de que se
+    // destruya el selector
+    if(w->listeners.v4 != -1) {
+        selector_unregister_fd(w->selector, w->listeners.v4);
+    }
+    if(w->listeners.v6 != -1) {
+        selector_unregister_fd(w->selector, w->listeners.v6);
+    }
+    // hasta workers_stop le pueden seguir encolando tareas (el acceptor, o
+    // el aviso de que termine)
+    while(sem_wait(&w->released) == -1 && errno == EINTR) {
+        // reintentamos
+    }
+    // otros workers pueden seguir resolviendo nombres que esperan nuestras
+    // sesiones: que ya no las notifiquen
+    resolver_detach(w->selector);
+    // cierra las sesiones que quedaron; vuelven a los pools de este hilo
+    selector_destroy(w->selector);
+    w->selector = NULL;
+    socksv5_pool_destroy();
+    return NULL;
+}
+
+int
+workers_start(const struct workers_init *c) {
+    int ret = 0;
+    sigset_t block, old;
+
+    workers = calloc(c->n, sizeof(*workers));
+    if(workers == NULL) {
+        ret = -1;
+        goto finally;
+    }
+    nworkers    = c->n;
+
+    for(size_t i = 0; i < nworkers; i++) {
+        struct worker *w = workers + i;
+        if(c->listeners != NULL) {
+            w->listeners = c->listeners[i];
+        } else {
+            w->listeners.v4 = w->listeners.v6 = -1;
+        }
+        if(sem_init(&w->released, 0, 0) == -1) {
+            // workers_stop no tiene que tocar los que siguen
+            nworkers = i;
+            ret = -1;
+            goto finally;
+        }
+        w->selector = selector_new(1024);
+        if(w->selector == NULL) {
+            nworkers = i + 1;
+            ret = -1;
+            goto finally;
+        }
+    }
+
+    // los hilos heredan la máscara: que SIGINT/SIGTERM los atienda el principal
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for(size_t i = 0; i < nworkers; i++) {
+        if(0 != pthread_create(&workers[i].thread, NULL, worker_run, workers + i)) {
+            ret = -1;
+            break;
+        }
+        workers[i].started = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+finally:
+    return ret;
+}
+
+void
+workers_loop_stats(struct selector_loop_stats *stats) {
+    for(size_t i = 0; i < nworkers; i++) {
+        selector_loop_stats(workers[i].selector, stats);
+    }
+}
+
+void
+workers_stop(void) {
+    stopping = true;
+    for(size_t i = 0; i < nworkers; i++) {
+        struct worker *w = workers + i;
+        if(w->started) {
+            // si la tarea no se puede encolar el worker igual se entera
+            // de `stopping' al vencer el timeout del selector
+            selector_post(w->selector, worker_wakeup, NULL);
+            sem_post(&w->released);
+            pthread_join(w->thread, NULL);
+        } else {
+            // nunca atendió conexiones
+            selector_destroy(w->selector);
+        }
+        sem_destroy(&w->released);
+        // conexiones que el worker no llegó a atender
+        struct handoff h;
+        while(handoff_pop(&w->queue, &h)) {
+            close(h.fd);
+        }
+    }
+    free(workers);
+    workers  = NULL;
+    nworkers = 0;
+}